@@ -10,6 +10,13 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 2 disk block reads
 0 disk block writes
 EOF
@@ -27,9 +34,17 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
+    7 data blocks in 2 extents
 Inode 3:
     size: 9546 bytes
     direct blocks: 10 11 12
+    3 data blocks in 1 extents
+Fragmentation:
+    10 data blocks in 3 extents across 2 files
+    12.5% fragmented
+Free space:
+    6 free blocks in 2 runs
+    largest free run: 5 blocks
 4 disk block reads
 0 disk block writes
 EOF
@@ -45,16 +60,25 @@ SuperBlock:
 Inode 1:
     size: 1523 bytes
     direct blocks: 152
+    1 data blocks in 1 extents
 Inode 2:
     size: 105421 bytes
     direct blocks: 49 50 51 52 53
     indirect block: 54
     indirect data blocks: 55 56 57 58 59 60 61 62 63 64 65 66 67 68 69 70 71 72 73 74 75
+    26 data blocks in 2 extents
 Inode 9:
     size: 409305 bytes
     direct blocks: 22 23 24 25 26
     indirect block: 28
     indirect data blocks: 29 30 31 32 33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48 76 77 78 79 80 82 83 84 85 86 87 88 89 90 91 92 93 94 95 96 97 98 99 100 101 102 103 104 105 106 107 108 109 110 111 112 113 114 115 116 117 118 119 120 121 122 123 124 125 126 127 128 129 130 131 132 133 134 135 136 137 138 139 140 141 142 143 144 145 146 147 148 149 150 151
+    100 data blocks in 4 extents
+Fragmentation:
+    127 data blocks in 7 extents across 3 files
+    3.2% fragmented
+Free space:
+    50 free blocks in 4 runs
+    largest free run: 47 blocks
 23 disk block reads
 0 disk block writes
 EOF
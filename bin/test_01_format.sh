@@ -8,8 +8,16 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
+    1 bitmap blocks
+    clean
+Fragmentation:
+    0 data blocks in 0 extents across 0 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 2 disk block reads
-5 disk block writes
+3 disk block writes
 EOF
 }
 
@@ -21,8 +29,16 @@ SuperBlock:
     20 blocks
     2 inode blocks
     256 inodes
+    1 bitmap blocks
+    clean
+Fragmentation:
+    0 data blocks in 0 extents across 0 files
+    0.0% fragmented
+Free space:
+    16 free blocks in 1 runs
+    largest free run: 16 blocks
 3 disk block reads
-20 disk block writes
+4 disk block writes
 EOF
 }
 
@@ -34,8 +50,16 @@ SuperBlock:
     200 blocks
     20 inode blocks
     2560 inodes
+    1 bitmap blocks
+    clean
+Fragmentation:
+    0 data blocks in 0 extents across 0 files
+    0.0% fragmented
+Free space:
+    178 free blocks in 1 runs
+    largest free run: 178 blocks
 21 disk block reads
-200 disk block writes
+22 disk block writes
 EOF
 }
 
@@ -19,6 +19,13 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 disk mounted.
 created inode 0.
 created inode 2.
@@ -159,6 +166,7 @@ Inode 0:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
 Inode 2:
     size: 0 bytes
     direct blocks:
@@ -537,7 +545,13 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-261 disk block reads
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
+6 disk block reads
 127 disk block writes
 EOF
 }
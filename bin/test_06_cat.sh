@@ -29,7 +29,7 @@ image-5-output() {
 "And, has thou slain the Jabberwock?
 "Beware the Jabberwock, my son!
 0 disk block writes
-5 disk block reads
+3 disk block reads
 965 bytes copied
 All mimsy were the borogoves,
 All mimsy were the borogoves,
@@ -295,7 +295,7 @@ image-20-output() {
    William Williams
 0 bytes copied
 0 disk block writes
-21 disk block reads
+15 disk block reads
 27160 bytes copied
 9546 bytes copied
 A Person charged in any State with Treason, Felony, or other Crime, who shall flee from Justice, and be found in another State, shall on Demand of the executive Authority of the State from which he fled, be delivered up, to be removed to the State having Jurisdiction of the Crime.
@@ -32,6 +32,13 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 disk mounted.
 created inode 0.
 created inode 2.
@@ -45,12 +52,19 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
 Inode 2:
     size: 0 bytes
     direct blocks:
 Inode 3:
     size: 0 bytes
     direct blocks:
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 created inode 0.
 removed inode 0.
 remove failed!
@@ -64,7 +78,13 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-25 disk block reads
+Fragmentation:
+    0 data blocks in 0 extents across 0 files
+    0.0% fragmented
+Free space:
+    3 free blocks in 1 runs
+    largest free run: 3 blocks
+8 disk block reads
 8 disk block writes
 EOF
 }
@@ -111,6 +131,13 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
+Fragmentation:
+    1 data blocks in 1 extents across 1 files
+    0.0% fragmented
+Free space:
+    2 free blocks in 1 runs
+    largest free run: 2 blocks
 disk mounted.
 965 bytes copied
 created inode 0.
@@ -125,12 +152,21 @@ SuperBlock:
 Inode 0:
     size: 965 bytes
     direct blocks: 3
+    1 data blocks in 1 extents
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
 Inode 2:
     size: 965 bytes
     direct blocks: 4
+    1 data blocks in 1 extents
+Fragmentation:
+    3 data blocks in 3 extents across 3 files
+    0.0% fragmented
+Free space:
+    0 free blocks in 0 runs
+    largest free run: 0 blocks
 removed inode 0.
 SuperBlock:
     magic number is valid
@@ -140,9 +176,17 @@ SuperBlock:
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
 Inode 2:
     size: 965 bytes
     direct blocks: 4
+    1 data blocks in 1 extents
+Fragmentation:
+    2 data blocks in 2 extents across 2 files
+    0.0% fragmented
+Free space:
+    1 free blocks in 1 runs
+    largest free run: 1 blocks
 created inode 0.
 965 bytes copied
 SuperBlock:
@@ -153,13 +197,22 @@ SuperBlock:
 Inode 0:
     size: 965 bytes
     direct blocks: 3
+    1 data blocks in 1 extents
 Inode 1:
     size: 965 bytes
     direct blocks: 2
+    1 data blocks in 1 extents
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-27 disk block reads
+    1 data blocks in 1 extents
+Fragmentation:
+    3 data blocks in 3 extents across 3 files
+    0.0% fragmented
+Free space:
+    0 free blocks in 0 runs
+    largest free run: 0 blocks
+11 disk block reads
 10 disk block writes
 EOF
 }
@@ -201,9 +254,17 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
+    7 data blocks in 2 extents
 Inode 3:
     size: 9546 bytes
     direct blocks: 10 11 12
+    3 data blocks in 1 extents
+Fragmentation:
+    10 data blocks in 3 extents across 2 files
+    12.5% fragmented
+Free space:
+    6 free blocks in 2 runs
+    largest free run: 5 blocks
 disk mounted.
 27160 bytes copied
 removed inode 3.
@@ -217,6 +278,13 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
+    7 data blocks in 2 extents
+Fragmentation:
+    7 data blocks in 2 extents across 1 files
+    16.7% fragmented
+Free space:
+    9 free blocks in 3 runs
+    largest free run: 5 blocks
 created inode 0.
 27160 bytes copied
 SuperBlock:
@@ -226,16 +294,24 @@ SuperBlock:
     256 inodes
 Inode 0:
     size: 27160 bytes
-    direct blocks: 3 10 11 12 15
-    indirect block: 16
-    indirect data blocks: 17 18
+    direct blocks: 15 16 17 18 19
+    indirect block: 10
+    indirect data blocks: 11 12
+    7 data blocks in 2 extents
 Inode 2:
     size: 27160 bytes
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-41 disk block reads
-18 disk block writes
+    7 data blocks in 2 extents
+Fragmentation:
+    14 data blocks in 4 extents across 2 files
+    16.7% fragmented
+Free space:
+    1 free blocks in 1 runs
+    largest free run: 1 blocks
+25 disk block reads
+11 disk block writes
 EOF
 }
 
@@ -249,4 +325,46 @@ else
     EXIT=$(($EXIT + 1))
 fi
 
+# Test 3
+
+test-3-input() {
+    cat <<EOF
+mount
+remove 2 3 3 9
+debug
+remove
+EOF
+}
+
+test-3-output() {
+    cat <<EOF
+disk mounted.
+removed 2 of 4 inodes.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    256 inodes
+Fragmentation:
+    0 data blocks in 0 extents across 0 files
+    0.0% fragmented
+Free space:
+    17 free blocks in 1 runs
+    largest free run: 17 blocks
+Usage: remove <inode> [inode...]
+8 disk block reads
+1 disk block writes
+EOF
+}
+
+cp data/image.20 $SCRATCH/image.20
+echo -n "Testing remove many in $SCRATCH/image.20 ... "
+if diff -u <(test-3-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(test-3-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+    EXIT=$(($EXIT + 1))
+fi
+
 exit $EXIT
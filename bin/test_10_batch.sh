@@ -0,0 +1,50 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+EXIT=0
+
+test-input() {
+    echo mount
+    for i in $(seq 130); do
+    	echo create
+    done
+    echo stat 1
+    for i in 2 3 3 9 1000 4; do
+    	echo remove $i
+    done
+    echo remove 5 6
+    echo create
+    echo debug
+}
+
+# Batch mode must print the same as interactive mode (but write less)
+
+cp data/image.20 $SCRATCH/image.20
+test-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null > $SCRATCH/interactive.txt
+cp data/image.20 $SCRATCH/image.20
+test-input > $SCRATCH/script
+./bin/sfssh -f $SCRATCH/script $SCRATCH/image.20 20 2> $SCRATCH/timing.txt > $SCRATCH/batch.txt
+
+echo -n "Testing batch output in $SCRATCH/image.20 ... "
+if diff -u <(grep -v "disk block writes" $SCRATCH/interactive.txt) <(grep -v "disk block writes" $SCRATCH/batch.txt) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "False"
+    cat $SCRATCH/test.log
+    EXIT=$(($EXIT + 1))
+fi
+
+echo -n "Testing batch writes in $SCRATCH/image.20 ... "
+if [ "$(grep "disk block writes" $SCRATCH/batch.txt)" = "5 disk block writes" ] &&
+   grep -q "^141 commands (137 in 3 batched calls)" $SCRATCH/timing.txt; then
+    echo "Success"
+else
+    echo "False"
+    grep "disk block writes" $SCRATCH/interactive.txt $SCRATCH/batch.txt
+    cat $SCRATCH/timing.txt
+    EXIT=$(($EXIT + 1))
+fi
+
+exit $EXIT
@@ -0,0 +1,37 @@
+/* bitmap.h: SimpleFS packed bitmap */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+/* Bitmap Constants */
+
+#define BITS_PER_WORD       (64)
+
+/* Bitmap Macros */
+
+#define BITMAP_WORDS(bits)  (((bits) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/* Bitmap Functions */
+
+/* Bit updates are atomic, so threads may set, clear and claim bits
+ * concurrently; searches see a consistent value for each word. */
+
+uint64_t *  bitmap_create(size_t bits, bool value);
+
+bool        bitmap_get(const uint64_t *bitmap, size_t bit);
+void        bitmap_set(uint64_t *bitmap, size_t bit);
+void        bitmap_clear(uint64_t *bitmap, size_t bit);
+bool        bitmap_claim(uint64_t *bitmap, size_t bit);
+
+ssize_t     bitmap_find(const uint64_t *bitmap, size_t bits, size_t start);
+size_t      bitmap_find_clear(const uint64_t *bitmap, size_t bits, size_t start);
+size_t      bitmap_count(const uint64_t *bitmap, size_t bits);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
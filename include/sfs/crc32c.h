@@ -0,0 +1,19 @@
+/* crc32c.h: SimpleFS CRC32C (Castagnoli) checksums */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Checksum Functions */
+
+/* Checksums chain: crc32c(crc32c(0, a, n), b, m) is the checksum of a
+ * followed by b.  The SSE4.2 or ARMv8 CRC instructions are used when the
+ * processor has them, and a table driven kernel otherwise. */
+
+uint32_t    crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,7 +3,11 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "sfs/uring.h"
+
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Disk Constants */
@@ -11,25 +15,109 @@
 #define BLOCK_SIZE      (1<<12)
 #define DISK_FAILURE    (-1)
 
+/* Disk Backends */
+
+typedef enum {
+    DISK_FILE,          /* POSIX file I/O (pread/pwrite)	*/
+    DISK_MMAP,          /* Memory-mapped disk image		*/
+    DISK_URING,         /* io_uring submission ring		*/
+    DISK_MEMORY,        /* In-memory RAM disk (no image file)	*/
+} DiskBackend;
+
+/* Disk I/O Classes */
+
+typedef enum {
+    DISK_METADATA,      /* SuperBlock, Inode table, bitmap and mapping blocks	*/
+    DISK_DATA,          /* File data blocks			*/
+    DISK_CLASSES,
+} DiskClass;
+
 /* Disk Structure */
 
+typedef struct Cache Cache;
+typedef struct DiskOps DiskOps;
 typedef struct Disk Disk;
 
 struct Disk {
-    int	    fd;	        /* File descriptor of disk image	*/
+    const DiskOps *ops; /* Backend operations			*/
+    int	    fd;	        /* File descriptor of disk image (-1 if none)	*/
+    char   *map;        /* Mapping of disk image (DISK_MMAP) or RAM disk (DISK_MEMORY)	*/
     size_t  blocks;     /* Number of blocks in disk image	*/
     size_t  reads;      /* Number of reads to disk image	*/
     size_t  writes;     /* Number of writes to disk image	*/
+    size_t  syscalls;   /* Number of I/O system calls made	*/
+    size_t  hits;       /* Number of block cache hits		*/
+    size_t  misses;     /* Number of block cache misses		*/
+    Cache  *cache;      /* Write-back block cache (NULL if none)	*/
+    pthread_mutex_t lock; /* Guards block cache			*/
+    Uring  *ring;       /* Submission ring (DISK_URING)		*/
+    pthread_mutex_t ring_lock; /* Guards submission ring		*/
+    uint32_t *sums;     /* CRC32C of each block (NULL if unchecked)	*/
+    bool    sum_data;   /* Whether or not data blocks are checksummed	*/
+    size_t  corrupt;    /* Number of blocks that failed verification	*/
 }; 
 
+/* Disk Request Structure */
+
+typedef struct DiskRequest DiskRequest;
+
+struct DiskRequest {
+    size_t  block;      /* Block number to transfer		*/
+    char   *data;       /* Data buffer (must be BLOCK_SIZE)	*/
+    bool    write;      /* Whether to write (true) or read	*/
+    ssize_t result;     /* Bytes transferred (or DISK_FAILURE)	*/
+    bool    done;       /* Whether or not request completed	*/
+};
+
+/* Disk Statistics Structures */
+
+typedef struct DiskAccount DiskAccount;
+
+struct DiskAccount {
+    size_t  reads[DISK_CLASSES];    /* Blocks read from disk image by class	*/
+    size_t  writes[DISK_CLASSES];   /* Blocks written to disk image by class	*/
+    size_t  hits;       /* Block cache hits			*/
+    size_t  misses;     /* Block cache misses			*/
+    DiskClass class;    /* Class charged for transfers		*/
+};
+
+typedef struct DiskStats DiskStats;
+
+struct DiskStats {
+    size_t  reads;      /* Number of reads to disk image	*/
+    size_t  writes;     /* Number of writes to disk image	*/
+    size_t  syscalls;   /* Number of I/O system calls made	*/
+    size_t  hits;       /* Number of block cache hits		*/
+    size_t  misses;     /* Number of block cache misses		*/
+    size_t  cached;     /* Number of blocks in cache (0 if none)	*/
+    size_t  corrupt;    /* Number of blocks that failed verification	*/
+};
+
 /* Disk Functions */
 
 Disk *	disk_open(const char *path, size_t blocks);
+Disk *	disk_open_backend(const char *path, size_t blocks, DiskBackend backend);
 void	disk_close(Disk *disk);
 
+bool	disk_cache(Disk *disk, size_t blocks);
+bool	disk_sync(Disk *disk);
+void	disk_checksums(Disk *disk, uint32_t *sums, bool data);
+
 ssize_t	disk_read(Disk *disk, size_t block, char *data);
 ssize_t	disk_write(Disk *disk, size_t block, char *data);
 
+ssize_t	disk_readv(Disk *disk, const size_t *blocks, char **data, size_t n);
+ssize_t	disk_writev(Disk *disk, const size_t *blocks, char **data, size_t n);
+ssize_t	disk_prefetch(Disk *disk, const size_t *blocks, size_t n);
+bool	disk_discard(Disk *disk, size_t block, size_t count);
+
+ssize_t	disk_submit(Disk *disk, DiskRequest *requests, size_t n);
+ssize_t	disk_complete(Disk *disk, size_t min);
+
+void	disk_stats(Disk *disk, DiskStats *stats);
+DiskAccount *disk_account(DiskAccount *account);
+DiskClass disk_account_class(DiskClass class);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -5,6 +5,7 @@
 
 #include "sfs/disk.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,9 +13,48 @@
 /* File System Constants */
 
 #define MAGIC_NUMBER        (0xf0f03410)
+#define FS_VERSION          (0x53460002)        /* Version word of images with on-disk bitmap */
+#define BITS_PER_BLOCK      (BLOCK_SIZE * 8)    /* Free block bits per bitmap block */
 #define INODES_PER_BLOCK    (128)               /* TODO: Number of inodes per block */
 #define POINTERS_PER_INODE  (5)                 /* TODO: Number of direct pointers per inode */
 #define POINTERS_PER_BLOCK  (1024)              /* TODO: Number of pointers per block */
+#define READAHEAD_MIN       (4)                 /* Initial readahead window in blocks */
+#define READAHEAD_MAX       (64)                /* Largest readahead window in blocks */
+#define DELALLOC_MAX        (64)                /* Largest delayed allocation buffer in blocks */
+#define DINDIRECT_POINTER   (POINTERS_PER_BLOCK - 1) /* Indirect slot leading to double indirect block */
+#define EXTENTS_PER_INODE   (2)                 /* Extents stored in an extent Inode */
+#define EXTENTS_PER_BLOCK   (BLOCK_SIZE / 8)    /* Extents stored in an extent block */
+#define INLINE_MAX          ((POINTERS_PER_INODE + 1) * 4) /* Bytes of data stored in an inline Inode */
+#define STATS_BUCKETS       (24)                /* Latency histogram buckets (powers of two microseconds) */
+#define JOURNAL_MAGIC       (0x4a524e4c)        /* Journal descriptor magic number */
+#define JOURNAL_TARGETS     (BLOCK_SIZE / 4 - 4)/* Home blocks listed in a journal descriptor */
+#define INODE_RATIO         (10)                /* Default Disk blocks per Inode block */
+#define SUMS_PER_BLOCK      (BLOCK_SIZE / 4)    /* Block checksums per checksum block */
+
+/* File System Features */
+
+#define FS_FEATURE_DINDIRECT (0x00000001)       /* Last indirect pointer leads to a double indirect block */
+#define FS_FEATURE_EXTENTS   (0x00000002)       /* Inodes map data with extents instead of pointers */
+#define FS_FEATURE_INLINE    (0x00000004)       /* Files of up to INLINE_MAX bytes are stored in their Inode */
+#define FS_FEATURE_JOURNAL   (0x00000008)       /* Meta data updates are committed to a journal after the bitmap */
+#define FS_FEATURE_CHECKSUMS (0x00000010)       /* Meta data blocks are verified against CRC32C checksums stored after the journal */
+#define FS_FEATURE_DATA_SUMS (0x00000020)       /* Data blocks are verified too (implies FS_FEATURE_CHECKSUMS) */
+#define FS_FEATURES          (FS_FEATURE_DINDIRECT | FS_FEATURE_EXTENTS | FS_FEATURE_INLINE | FS_FEATURE_JOURNAL | FS_FEATURE_CHECKSUMS | FS_FEATURE_DATA_SUMS) /* Features this implementation supports */
+
+/* File System Operations */
+
+typedef enum {
+    FS_OP_CREATE,                               /* fs_create and fs_create_many */
+    FS_OP_REMOVE,                               /* fs_remove and fs_remove_many */
+    FS_OP_STAT,                                 /* fs_stat */
+    FS_OP_OPEN,                                 /* fs_open */
+    FS_OP_CLOSE,                                /* fs_close */
+    FS_OP_READ,                                 /* fs_read */
+    FS_OP_WRITE,                                /* fs_write */
+    FS_OP_SYNC,                                 /* fs_sync */
+    FS_OP_DEFRAG,                               /* fs_defrag */
+    FS_OPS,
+} FsOp;
 
 /* File System Structures */
 
@@ -24,14 +64,47 @@ struct SuperBlock {
     uint32_t    blocks;                         /* Number of blocks in file system */
     uint32_t    inode_blocks;                   /* Number of blocks reserved for inodes */
     uint32_t    inodes;                         /* Number of inodes in file system */
+    uint32_t    version;                        /* FS_VERSION (anything else is original format) */
+    uint32_t    bitmap_blocks;                  /* Number of free bitmap blocks after inodes */
+    uint32_t    clean;                          /* Whether or not last unmount was clean */
+    uint32_t    features;                       /* FS_FEATURE_* flags of image */
+    uint32_t    journal_blocks;                 /* Number of journal blocks after bitmap (FS_FEATURE_JOURNAL) */
+    uint32_t    inode_ratio;                    /* Disk blocks per Inode block (0 if image predates it) */
+    uint32_t    checksum_blocks;                /* Number of checksum blocks after journal (FS_FEATURE_CHECKSUMS) */
+};
+
+typedef struct JournalDescriptor JournalDescriptor;
+struct JournalDescriptor {
+    uint32_t    magic;                          /* JOURNAL_MAGIC */
+    uint32_t    sequence;                       /* Sequence number of transaction */
+    uint32_t    count;                          /* Number of blocks following descriptor */
+    uint32_t    checksum;                       /* Checksum of descriptor (as 0) and following blocks */
+    uint32_t    targets[JOURNAL_TARGETS];       /* Home block of each following block */
+};
+
+typedef struct Extent     Extent;
+struct Extent {
+    uint32_t    start;                          /* First block of run */
+    uint32_t    length;                         /* Number of blocks in run */
 };
 
 typedef struct Inode      Inode;
 struct Inode {
     uint32_t    valid;                          /* Whether or not inode is valid */
     uint32_t    size;                           /* Size of file */
-    uint32_t    direct[POINTERS_PER_INODE];     /* Direct pointers */
-    uint32_t    indirect;                       /* Indirect pointers */
+    union {
+        struct {
+            union {
+                uint32_t direct[POINTERS_PER_INODE];    /* Direct pointers */
+                struct {
+                    Extent   extents[EXTENTS_PER_INODE];/* First extents (FS_FEATURE_EXTENTS) */
+                    uint32_t nextents;                  /* Number of extents (FS_FEATURE_EXTENTS) */
+                };
+            };
+            uint32_t indirect;                  /* Indirect pointers (extent block with FS_FEATURE_EXTENTS) */
+        };
+        char    inline_data[INLINE_MAX];        /* File data (FS_FEATURE_INLINE and size <= INLINE_MAX) */
+    };
 };
 
 typedef union  Block      Block;
@@ -39,31 +112,134 @@ union Block {
     SuperBlock  super;                          /* View block as superblock */
     Inode       inodes[INODES_PER_BLOCK];       /* View block as inode */
     uint32_t    pointers[POINTERS_PER_BLOCK];   /* View block as pointers */
+    Extent      extents[EXTENTS_PER_BLOCK];     /* View block as extents */
+    JournalDescriptor descriptor;               /* View block as journal descriptor */
     char        data[BLOCK_SIZE];               /* View block as data */
 };
 
+typedef struct File File;
+struct File {
+    size_t       inode_number;                  /* Inode held open */
+    size_t       references;                    /* Number of fs_open calls not closed */
+    bool         loaded;                        /* Whether or not indirect is resident */
+    bool         dirty;                         /* Whether or not indirect must be written */
+    bool         dloaded;                       /* Whether or not dindirect is resident */
+    bool         ddirty;                        /* Whether or not dindirect must be written */
+    size_t       leaf_index;                    /* Double indirect slot of resident leaf plus one (0 if none) */
+    size_t       ra_offset;                     /* Byte offset a sequential read starts at */
+    size_t       ra_window;                     /* Readahead window in blocks (0 if random) */
+    char        *pending;                       /* Delayed allocation buffer (NULL until used) */
+    size_t       pending_offset;                /* Byte offset of buffered data */
+    size_t       pending_length;                /* Bytes of buffered data not yet written */
+    Block        indirect;                      /* Resident indirect pointer block */
+    Block        dindirect;                     /* Resident double indirect pointer block */
+    Block        leaf;                          /* Most recently used double indirect leaf */
+    File        *next;                          /* Next open File */
+    pthread_mutex_t lock;                       /* Guards loading mapping blocks and readahead */
+};
+
+typedef struct OpStats OpStats;
+struct OpStats {
+    size_t      calls;                          /* Number of calls */
+    size_t      failures;                       /* Number of calls that failed */
+    size_t      nsecs;                          /* Total latency in nanoseconds */
+    size_t      max_nsecs;                      /* Largest latency in nanoseconds */
+    size_t      histogram[STATS_BUCKETS];       /* Calls under 2^i usec (and at least half that), last is unbounded */
+    size_t      reads[DISK_CLASSES];            /* Disk blocks read by class */
+    size_t      writes[DISK_CLASSES];           /* Disk blocks written by class */
+    size_t      hits;                           /* Block cache hits */
+    size_t      misses;                         /* Block cache misses */
+};
+
+typedef struct FsStats FsStats;
+struct FsStats {
+    OpStats     ops[FS_OPS];                    /* Statistics of each operation */
+    DiskStats   disk;                           /* Counters of mounted Disk (zero if not mounted) */
+};
+
+typedef struct Journal Journal;
+
 typedef struct FileSystem FileSystem;
 struct FileSystem {
     Disk        *disk;                          /* Disk file system is mounted on */
-    bool        *free_blocks;                   /* Free block bitmap */
+    Inode       *inodes;                        /* Resident inode table */
+    bool        *dirty_inodes;                  /* Dirty inode table blocks */
+    uint64_t    *free_blocks;                   /* Free block bitmap (packed, 1 is free) */
+    size_t       free_hint;                     /* No free blocks below this block */
+    uint64_t    *free_inodes;                   /* Free inode bitmap (packed, 1 is free) */
+    size_t       free_inode_hint;               /* No free inodes below this inode */
+    File        *files;                         /* Open files */
     SuperBlock   meta_data;                     /* File system meta data */
+    pthread_rwlock_t *inode_locks;              /* Per inode reader/writer locks */
+    pthread_mutex_t lock;                       /* Guards inode table and open files */
+    OpStats      stats[FS_OPS];                 /* Operation statistics (updated atomically) */
+    Journal     *journal;                       /* Meta data journal (NULL without FS_FEATURE_JOURNAL) */
+    bool         sparse;                        /* Leave all-zero written blocks unallocated (see fs_sparse) */
+    uint32_t    *checksums;                     /* CRC32C of each block (NULL without FS_FEATURE_CHECKSUMS) */
 };
 
+/* Locking: fs_read and fs_stat hold an Inode's lock for reading, while
+ * fs_write, fs_remove and fs_close hold it for writing (fs_remove_many
+ * locks each group of Inodes in ascending order), so operations on
+ * different Inodes run in parallel.  Changes to the resident Inode table,
+ * its dirty blocks and the open File list are made under the FileSystem
+ * lock, which is only ever taken after an Inode lock.  The delayed
+ * allocation buffer of an open File is guarded by its Inode lock.  Blocks are claimed
+ * from the free bitmap atomically.  fs_format, fs_mount and fs_unmount must
+ * not run concurrently with other operations.
+ *
+ * With FS_FEATURE_JOURNAL, operations that modify the image are grouped into
+ * transactions: a commit waits for the operations in progress to finish
+ * and holds back new ones until the transaction is in the journal, and
+ * blocks freed by a transaction are only reused once it has committed. */
+
+/* Holes: a data block pointer of 0 is unallocated and reads as zeroes.  A
+ * write allocates the holes it covers, unless fs_sparse is enabled and the
+ * data for a block is all zero (extent mapped files are never sparse). */
+
+/* Checksums: with FS_FEATURE_CHECKSUMS, the Disk verifies each meta data
+ * block (and data block with FS_FEATURE_DATA_SUMS) against its CRC32C when
+ * reading it from the image, and reads of corrupt blocks fail.  Checksums
+ * are stored on a clean unmount only, so after a crash they are dropped and
+ * blocks are checked again once they are rewritten. */
+
+/* Defragmentation: fs_defrag moves an Inode's data blocks into fewer
+ * extents while the file system stays mounted; readers and writers of that
+ * Inode wait, others do not. */
+
 /* File System Functions */
 
 void    fs_debug(Disk *disk);
 bool    fs_format(FileSystem *fs, Disk *disk);
+bool    fs_format_features(FileSystem *fs, Disk *disk, uint32_t features);
+bool    fs_format_wipe(FileSystem *fs, Disk *disk, uint32_t features);
+bool    fs_format_density(FileSystem *fs, Disk *disk, uint32_t features, uint32_t ratio, bool wipe);
 
 bool    fs_mount(FileSystem *fs, Disk *disk);
 void    fs_unmount(FileSystem *fs);
+bool    fs_sync(FileSystem *fs);
+void    fs_sparse(FileSystem *fs, bool sparse);
 
 ssize_t fs_create(FileSystem *fs);
+ssize_t fs_create_many(FileSystem *fs, size_t *inode_numbers, size_t n);
 bool    fs_remove(FileSystem *fs, size_t inode_number);
+ssize_t fs_remove_many(FileSystem *fs, const size_t *inode_numbers, size_t n);
 ssize_t fs_stat(FileSystem *fs, size_t inode_number);
 
+bool    fs_open(FileSystem *fs, size_t inode_number);
+bool    fs_close(FileSystem *fs, size_t inode_number);
+
 ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
 
+ssize_t fs_fragments(FileSystem *fs, size_t inode_number);
+ssize_t fs_defrag(FileSystem *fs, size_t inode_number);
+
+void    fs_stats(FileSystem *fs, FsStats *stats);
+void    fs_stats_reset(FileSystem *fs);
+const char *fs_stats_name(FsOp op);
+double  fs_stats_percentile(const OpStats *stats, double p);
+
 #endif
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
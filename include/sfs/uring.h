@@ -0,0 +1,40 @@
+/* uring.h: SimpleFS io_uring submission ring */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Ring Operations */
+
+typedef enum {
+    URING_READ,         /* Read into one buffer			*/
+    URING_WRITE,        /* Write from one buffer		*/
+    URING_READV,        /* Read into an iovec array		*/
+    URING_WRITEV,       /* Write from an iovec array		*/
+} UringOp;
+
+/* Ring Structure */
+
+typedef struct Uring Uring;
+
+/* Ring Functions */
+
+/* A Uring is not thread safe: callers serialize preparing, entering and
+ * reaping.  Buffers (and iovec arrays) must stay valid until the request
+ * is reaped. */
+
+Uring *     uring_open(unsigned entries);
+void        uring_close(Uring *ring);
+
+bool        uring_prep(Uring *ring, UringOp op, int fd, const void *addr, unsigned len, off_t offset, void *tag);
+int         uring_enter(Uring *ring, unsigned wait);
+bool        uring_reap(Uring *ring, void **tag, ssize_t *result);
+unsigned    uring_pending(const Uring *ring);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
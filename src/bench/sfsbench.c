@@ -0,0 +1,243 @@
+/* sfsbench.c: SimpleFS benchmark */
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+/* Macros */
+
+#define streq(a, b)	(strcmp((a), (b)) == 0)
+
+/* Benchmark Structures */
+
+typedef struct Workload Workload;
+struct Workload {
+    const char *name;       /* Name of file size class */
+    size_t      size;       /* Bytes per file */
+};
+
+typedef struct Result Result;
+struct Result {
+    size_t      ops;        /* Number of operations timed */
+    size_t      bytes;      /* Bytes transferred by all operations */
+    double      seconds;    /* Total time spent in operations */
+    double     *latencies;  /* Per operation latency in seconds */
+    size_t      reads;      /* Disk block reads by all operations */
+    size_t      writes;     /* Disk block writes by all operations */
+};
+
+/* Benchmark Workloads */
+
+Workload WORKLOADS[] = {
+    {"small",    512},
+    {"direct",   POINTERS_PER_INODE * BLOCK_SIZE},
+    {"indirect", 64 * BLOCK_SIZE},
+};
+
+const char *OPERATIONS[] = {"create", "write", "read", "stat", "remove"};
+
+#define NWORKLOADS  (sizeof(WORKLOADS) / sizeof(WORKLOADS[0]))
+#define NOPERATIONS (sizeof(OPERATIONS) / sizeof(OPERATIONS[0]))
+
+/* Utility Prototypes */
+
+double  now();
+int     compare_doubles(const void *a, const void *b);
+double  percentile(double *sorted, size_t n, double p);
+bool    run_workload(Disk *disk, Workload *w, size_t files, FILE *stream);
+void    report(FILE *stream, Workload *w, const char *operation, Result *r);
+
+/* Main Execution */
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-c cacheblocks] [-d file|mmap|uring|memory] [-n files] [-o output] <diskfile> <nblocks>\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    size_t cache_blocks = 0;
+    size_t files = 32;
+    DiskBackend backend = DISK_FILE;
+    const char *output = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "c:d:n:o:")) != -1) {
+	switch (option) {
+	    case 'c':
+		cache_blocks = atoi(optarg);
+		break;
+	    case 'd':
+		if (streq(optarg, "file")) {
+		    backend = DISK_FILE;
+		} else if (streq(optarg, "mmap")) {
+		    backend = DISK_MMAP;
+		} else if (streq(optarg, "uring")) {
+		    backend = DISK_URING;
+		} else if (streq(optarg, "memory")) {
+		    backend = DISK_MEMORY;
+		} else {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    case 'n':
+		files = atoi(optarg);
+		break;
+	    case 'o':
+		output = optarg;
+		break;
+	    default:
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 2 || files == 0) {
+	usage(argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    FILE *stream = output ? fopen(output, "w") : stdout;
+    if (!stream) {
+	fprintf(stderr, "Unable to open %s: %s\n", output, strerror(errno));
+	return EXIT_FAILURE;
+    }
+
+    Disk *disk = disk_open_backend(argv[optind], atoi(argv[optind + 1]), backend);
+    if (!disk) {
+	return EXIT_FAILURE;
+    }
+
+    if (!disk_cache(disk, cache_blocks)) {
+	fprintf(stderr, "Unable to allocate %lu block cache\n", cache_blocks);
+	disk_close(disk);
+	return EXIT_FAILURE;
+    }
+
+    fprintf(stream, "workload,size,operation,ops,seconds,ops_per_sec,mb_per_sec,p50_usec,p99_usec,reads_per_op,writes_per_op\n");
+
+    int status = EXIT_SUCCESS;
+    for (size_t w = 0; w < NWORKLOADS; w++) {
+	if (!run_workload(disk, &WORKLOADS[w], files, stream)) {
+	    fprintf(stderr, "Workload %s failed\n", WORKLOADS[w].name);
+	    status = EXIT_FAILURE;
+	    break;
+	}
+    }
+
+    if (output) {
+	fclose(stream);
+    } else {
+	fflush(stream);
+    }
+
+    disk_close(disk);
+    return status;
+}
+
+/* Utility Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, size_t n, double p) {
+    size_t index = p * (n - 1) + 0.5;
+    return sorted[index];
+}
+
+bool run_workload(Disk *disk, Workload *w, size_t files, FILE *stream) {
+    FileSystem fs = {0};
+
+    if (!fs_format(&fs, disk) || !fs_mount(&fs, disk)) {
+	return false;
+    }
+
+    ssize_t *inodes = calloc(files, sizeof(ssize_t));
+    char    *data   = malloc(w->size);
+    char    *copy   = malloc(w->size);
+    double  *times  = malloc(files * sizeof(double));
+    bool     success = inodes && data && copy && times;
+
+    for (size_t i = 0; success && i < w->size; i++) {
+	data[i] = i % 251;
+    }
+
+    for (size_t op = 0; success && op < NOPERATIONS; op++) {
+	Result r = {0, 0, 0.0, times, disk->reads, disk->writes};
+
+	for (size_t f = 0; success && f < files; f++) {
+	    double  start = now();
+	    ssize_t bytes = 0;
+
+	    switch (op) {
+		case 0:
+		    success = (inodes[f] = fs_create(&fs)) >= 0;
+		    break;
+		case 1:
+		    success = (bytes = fs_write(&fs, inodes[f], data, w->size, 0)) == (ssize_t)w->size;
+		    break;
+		case 2:
+		    success = (bytes = fs_read(&fs, inodes[f], copy, w->size, 0)) == (ssize_t)w->size;
+		    break;
+		case 3:
+		    success = fs_stat(&fs, inodes[f]) == (ssize_t)w->size;
+		    break;
+		case 4:
+		    success = fs_remove(&fs, inodes[f]);
+		    break;
+	    }
+
+	    times[f]   = now() - start;
+	    r.seconds += times[f];
+	    r.bytes   += bytes;
+	    r.ops++;
+	}
+
+	if (success && op == 2) {
+	    success = memcmp(data, copy, w->size) == 0;
+	}
+
+	if (success) {
+	    r.reads  = disk->reads  - r.reads;
+	    r.writes = disk->writes - r.writes;
+	    report(stream, w, OPERATIONS[op], &r);
+	}
+    }
+
+    fs_unmount(&fs);
+    free(inodes);
+    free(data);
+    free(copy);
+    free(times);
+    return success;
+}
+
+void report(FILE *stream, Workload *w, const char *operation, Result *r) {
+    qsort(r->latencies, r->ops, sizeof(double), compare_doubles);
+
+    double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+    fprintf(stream, "%s,%lu,%s,%lu,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+	w->name, w->size, operation, r->ops, r->seconds,
+	r->ops / seconds,
+	r->bytes / seconds / (1 << 20),
+	percentile(r->latencies, r->ops, 0.50) * 1e6,
+	percentile(r->latencies, r->ops, 0.99) * 1e6,
+	(double)r->reads  / r->ops,
+	(double)r->writes / r->ops);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,175 @@
+/* bitmap.c: SimpleFS packed bitmap */
+
+#include "sfs/bitmap.h"
+#include "sfs/utils.h"
+
+#include <string.h>
+
+/* Bitmap Macros */
+
+#define WORD_LOAD(bitmap, w)    __atomic_load_n(&(bitmap)[w], __ATOMIC_RELAXED)
+
+/* External Functions */
+
+/**
+ * Allocate a packed bitmap with every bit set to the specified value.
+ *
+ * Note: Padding bits past the end of the bitmap are always clear, so
+ * searches never return them.
+ *
+ * @param       bits        Number of bits in bitmap.
+ * @param       value       Initial value of every bit.
+ *
+ * @return      Pointer to newly allocated bitmap (NULL on failure).
+ **/
+uint64_t *  bitmap_create(size_t bits, bool value) {
+
+    size_t    words  = BITMAP_WORDS(bits);
+    uint64_t *bitmap = calloc(words ? words : 1, sizeof(uint64_t));
+    if(!bitmap || !value) {
+        return bitmap;
+    }
+
+    memset(bitmap, 0xff, words * sizeof(uint64_t));
+
+    if(bits % BITS_PER_WORD) {
+        bitmap[words - 1] = (UINT64_C(1) << (bits % BITS_PER_WORD)) - 1;
+    }
+
+    return bitmap;
+}
+
+/**
+ * Return value of specified bit.
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bit         Bit to check.
+ *
+ * @return      Whether or not the bit is set.
+ **/
+bool        bitmap_get(const uint64_t *bitmap, size_t bit) {
+    return (WORD_LOAD(bitmap, bit / BITS_PER_WORD) >> (bit % BITS_PER_WORD)) & 1;
+}
+
+/**
+ * Set specified bit (atomically).
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bit         Bit to set.
+ **/
+void        bitmap_set(uint64_t *bitmap, size_t bit) {
+    __atomic_fetch_or(&bitmap[bit / BITS_PER_WORD], UINT64_C(1) << (bit % BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+/**
+ * Clear specified bit (atomically).
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bit         Bit to clear.
+ **/
+void        bitmap_clear(uint64_t *bitmap, size_t bit) {
+    __atomic_fetch_and(&bitmap[bit / BITS_PER_WORD], ~(UINT64_C(1) << (bit % BITS_PER_WORD)), __ATOMIC_RELAXED);
+}
+
+/**
+ * Atomically clear specified bit if it is set.
+ *
+ * When several threads claim the same bit, exactly one of them sees it set.
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bit         Bit to claim.
+ *
+ * @return      Whether or not the bit was set (and is now claimed).
+ **/
+bool        bitmap_claim(uint64_t *bitmap, size_t bit) {
+    uint64_t mask = UINT64_C(1) << (bit % BITS_PER_WORD);
+    return __atomic_fetch_and(&bitmap[bit / BITS_PER_WORD], ~mask, __ATOMIC_ACQ_REL) & mask;
+}
+
+/**
+ * Find the first set bit at or after start by scanning a word at a time:
+ *
+ *  1. Mask off bits below start in the first word.
+ *
+ *  2. Skip zero words and use count trailing zeros on the first non-zero
+ *  word.
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bits        Number of bits in bitmap.
+ * @param       start       First bit to consider.
+ *
+ * @return      Index of first set bit (-1 if none).
+ **/
+ssize_t     bitmap_find(const uint64_t *bitmap, size_t bits, size_t start) {
+
+    if(start >= bits) {
+        return -1;
+    }
+
+    size_t   words = BITMAP_WORDS(bits);
+    size_t   w     = start / BITS_PER_WORD;
+    uint64_t word  = WORD_LOAD(bitmap, w) & (~UINT64_C(0) << (start % BITS_PER_WORD));
+
+    while(!word) {
+        if(++w >= words) {
+            return -1;
+        }
+        word = WORD_LOAD(bitmap, w);
+    }
+
+    size_t bit = w * BITS_PER_WORD + __builtin_ctzll(word);
+    return bit < bits ? (ssize_t)bit : -1;
+}
+
+/**
+ * Find the first clear bit at or after start by scanning a word at a time.
+ *
+ * Together with bitmap_find this yields runs of set bits: a run beginning
+ * at bitmap_find(start) ends at bitmap_find_clear of that bit.
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bits        Number of bits in bitmap.
+ * @param       start       First bit to consider.
+ *
+ * @return      Index of first clear bit (bits if none).
+ **/
+size_t      bitmap_find_clear(const uint64_t *bitmap, size_t bits, size_t start) {
+
+    if(start >= bits) {
+        return bits;
+    }
+
+    size_t   words = BITMAP_WORDS(bits);
+    size_t   w     = start / BITS_PER_WORD;
+    uint64_t word  = ~WORD_LOAD(bitmap, w) & (~UINT64_C(0) << (start % BITS_PER_WORD));
+
+    while(!word) {
+        if(++w >= words) {
+            return bits;
+        }
+        word = ~WORD_LOAD(bitmap, w);
+    }
+
+    return min(w * BITS_PER_WORD + __builtin_ctzll(word), bits);
+}
+
+/**
+ * Count number of set bits using population count on each word.
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bits        Number of bits in bitmap.
+ *
+ * @return      Number of set bits.
+ **/
+size_t      bitmap_count(const uint64_t *bitmap, size_t bits) {
+
+    size_t count = 0;
+
+    for(size_t w = 0; w < BITMAP_WORDS(bits); w++) {
+        count += __builtin_popcountll(WORD_LOAD(bitmap, w));
+    }
+
+    return count;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,232 @@
+/* crc32c.c: SimpleFS CRC32C (Castagnoli) checksums */
+
+#include "sfs/crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8
+#endif
+
+/* Checksum Constants */
+
+#define CRC32C_POLY     (0x82f63b78)    /* Castagnoli polynomial (bit reversed)	*/
+#define CRC32C_LANE     (1360)          /* Bytes per interleaved stream (three fill a block)	*/
+
+/* Checksum Structures */
+
+typedef uint32_t (*CrcKernel)(uint32_t crc, const unsigned char *data, size_t length);
+
+/* Checksum State */
+
+static uint32_t       Table[8][256];            /* Slicing by eight tables		*/
+static uint32_t       Shift[2][4][256];         /* Advance by one and two lanes of zeros	*/
+static CrcKernel      Kernel = NULL;            /* Best kernel for this processor	*/
+static pthread_once_t Once   = PTHREAD_ONCE_INIT;
+
+/* Internal Prototypes */
+
+void        crc32c_init(void);
+uint32_t    crc32c_software(uint32_t crc, const unsigned char *data, size_t length);
+uint32_t    crc32c_shift(uint32_t crc, size_t which);
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+uint32_t    crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length);
+#endif
+
+/* External Functions */
+
+/**
+ * Compute CRC32C of a buffer, continuing from a previous checksum.
+ *
+ * @param       crc         Checksum of preceding data (0 to start).
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Checksum of preceding data followed by buffer.
+ **/
+uint32_t    crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&Once, crc32c_init);
+    return ~Kernel(~crc, data, length);
+}
+
+/* Internal Functions */
+
+/**
+ * Build the lookup tables and pick a kernel by doing the following:
+ *
+ *  1. Generate the slicing by eight tables from the polynomial.
+ *
+ *  2. Generate the tables that advance a checksum past one and two lanes of
+ *  zeros (from the 32 single bit checksums, as advancing is linear).
+ *
+ *  3. Use the hardware kernel if the processor supports it.
+ **/
+void        crc32c_init(void) {
+
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++) {
+            c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+        }
+        Table[0][i] = c;
+    }
+
+    for(int t = 1; t < 8; t++) {
+        for(uint32_t i = 0; i < 256; i++) {
+            Table[t][i] = (Table[t - 1][i] >> 8) ^ Table[0][Table[t - 1][i] & 0xff];
+        }
+    }
+
+    static const unsigned char zeros[2 * CRC32C_LANE];
+    uint32_t basis[32];
+
+    for(size_t which = 0; which < 2; which++) {
+        for(int bit = 0; bit < 32; bit++) {
+            basis[bit] = crc32c_software(1u << bit, zeros, (which + 1) * CRC32C_LANE);
+        }
+
+        for(int byte = 0; byte < 4; byte++) {
+            for(uint32_t i = 0; i < 256; i++) {
+                uint32_t c = 0;
+                for(int bit = 0; bit < 8; bit++) {
+                    c ^= (i >> bit) & 1 ? basis[byte * 8 + bit] : 0;
+                }
+                Shift[which][byte][i] = c;
+            }
+        }
+    }
+
+    Kernel = crc32c_software;
+#if defined(CRC32C_SSE42)
+    if(__builtin_cpu_supports("sse4.2")) {
+        Kernel = crc32c_hardware;
+    }
+#elif defined(CRC32C_ARMV8)
+    Kernel = crc32c_hardware;
+#endif
+}
+
+/**
+ * Advance a checksum past one (which = 0) or two (which = 1) lanes of zero
+ * bytes.
+ *
+ * @param       crc         Checksum (not inverted).
+ * @param       which       Number of lanes less one.
+ *
+ * @return      Advanced checksum (not inverted).
+ **/
+uint32_t    crc32c_shift(uint32_t crc, size_t which) {
+    return Shift[which][0][crc & 0xff] ^ Shift[which][1][(crc >> 8) & 0xff] ^
+           Shift[which][2][(crc >> 16) & 0xff] ^ Shift[which][3][crc >> 24];
+}
+
+/**
+ * Compute CRC32C eight bytes at a time with table lookups (one byte at a
+ * time on big endian processors).
+ *
+ * @param       crc         Checksum so far (not inverted).
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Updated checksum (not inverted).
+ **/
+uint32_t    crc32c_software(uint32_t crc, const unsigned char *data, size_t length) {
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+
+        crc = Table[7][word & 0xff]         ^ Table[6][(word >> 8) & 0xff]  ^
+              Table[5][(word >> 16) & 0xff] ^ Table[4][(word >> 24) & 0xff] ^
+              Table[3][(word >> 32) & 0xff] ^ Table[2][(word >> 40) & 0xff] ^
+              Table[1][(word >> 48) & 0xff] ^ Table[0][word >> 56];
+
+        data   += 8;
+        length -= 8;
+    }
+#endif
+
+    while(length--) {
+        crc = Table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARMV8)
+
+#if defined(CRC32C_SSE42)
+#define CRC32C_TARGET   __attribute__((target("sse4.2")))
+#define CRC32C_WORD(c, w)   ((uint32_t)_mm_crc32_u64((c), (w)))
+#define CRC32C_BYTE(c, b)   _mm_crc32_u8((c), (b))
+#else
+#define CRC32C_TARGET
+#define CRC32C_WORD(c, w)   __crc32cd((c), (w))
+#define CRC32C_BYTE(c, b)   __crc32cb((c), (b))
+#endif
+
+/**
+ * Compute CRC32C with the processor's CRC instructions by doing the
+ * following:
+ *
+ *  1. Checksum each run of three lanes as three independent streams, so
+ *  the instruction's latency overlaps, and combine them by advancing the
+ *  first two past the lanes that follow them.
+ *
+ *  2. Checksum the rest eight bytes at a time, then byte by byte.
+ *
+ * @param       crc         Checksum so far (not inverted).
+ * @param       data        Buffer to checksum.
+ * @param       length      Number of bytes in buffer.
+ *
+ * @return      Updated checksum (not inverted).
+ **/
+CRC32C_TARGET
+uint32_t    crc32c_hardware(uint32_t crc, const unsigned char *data, size_t length) {
+
+    while(length >= 3 * CRC32C_LANE) {
+        uint32_t c0 = crc;
+        uint32_t c1 = 0;
+        uint32_t c2 = 0;
+
+        for(size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, data + i, sizeof(w0));
+            memcpy(&w1, data + CRC32C_LANE + i, sizeof(w1));
+            memcpy(&w2, data + 2 * CRC32C_LANE + i, sizeof(w2));
+            c0 = CRC32C_WORD(c0, w0);
+            c1 = CRC32C_WORD(c1, w1);
+            c2 = CRC32C_WORD(c2, w2);
+        }
+
+        crc     = crc32c_shift(c0, 1) ^ crc32c_shift(c1, 0) ^ c2;
+        data   += 3 * CRC32C_LANE;
+        length -= 3 * CRC32C_LANE;
+    }
+
+    while(length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc     = CRC32C_WORD(crc, word);
+        data   += 8;
+        length -= 8;
+    }
+
+    while(length--) {
+        crc = CRC32C_BYTE(crc, *data++);
+    }
+
+    return crc;
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
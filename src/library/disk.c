@@ -1,86 +1,364 @@
 /* disk.c: SimpleFS disk emulator */
 
+#define _GNU_SOURCE     /* fallocate */
+
+#include "sfs/crc32c.h"
 #include "sfs/disk.h"
 #include "sfs/logging.h"
+#include "sfs/utils.h"
 
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+/* Disk Constants */
+
+#ifndef IOV_MAX
+#define IOV_MAX         (1024)
+#endif
+
+#define URING_ENTRIES   (64)    /* Requests kept in flight (DISK_URING)	*/
+#define DISCARD_BATCH   (256)   /* Zero blocks written per request on discard	*/
+
+/* Cache Structures */
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    size_t  block;      /* Disk block held by entry		*/
+    bool    valid;      /* Whether or not entry holds a block	*/
+    bool    dirty;      /* Whether or not entry must be written	*/
+    bool    referenced; /* CLOCK reference bit			*/
+    bool    pinned;     /* Whether or not entry is being loaded	*/
+    char   *data;       /* Cached block data			*/
+};
+
+struct Cache {
+    size_t      capacity;   /* Number of blocks in cache	*/
+    size_t      hand;       /* CLOCK hand			*/
+    size_t     *slots;      /* Block to entry map (index + 1)	*/
+    CacheEntry *entries;    /* Cache entries			*/
+    char       *buffer;     /* Backing memory for entry data	*/
+};
+
+/* Backend Structures */
+
+struct DiskOps {
+    bool    (*open)(Disk *disk, const char *path);     /* Set up backing store	*/
+    ssize_t (*io)(Disk *disk, const size_t *blocks, char **data, size_t n, bool write);
+                                                        /* Transfer blocks	*/
+    bool    (*sync)(Disk *disk);                        /* Flush to backing store	*/
+    bool    (*discard)(Disk *disk, size_t block, size_t count);
+                                                        /* Zero a range of blocks	*/
+    void    (*close)(Disk *disk);                       /* Release backing store	*/
+};
+
+/* Accounting State */
+
+static __thread DiskAccount *Account = NULL;  /* Account charged by calling thread */
+
 /* Internal Prototyes */
 
 bool    disk_sanity_check(Disk *disk, size_t blocknum, const char *data);
+bool    disk_sanity_checkv(Disk *disk, const size_t *blocks, char **data, size_t n);
+ssize_t disk_device_read(Disk *disk, size_t block, char *data);
+ssize_t disk_device_write(Disk *disk, size_t block, char *data);
+ssize_t disk_device_readv(Disk *disk, const size_t *blocks, char **data, size_t n);
+ssize_t disk_device_writev(Disk *disk, const size_t *blocks, char **data, size_t n);
+ssize_t disk_uring_wait(Disk *disk, size_t wait);
+CacheEntry *disk_cache_lookup(Disk *disk, size_t block);
+CacheEntry *disk_cache_insert(Disk *disk, size_t block);
+ssize_t disk_cache_read(Disk *disk, size_t block, char *data);
+ssize_t disk_cache_write(Disk *disk, size_t block, char *data);
+bool    disk_cache_fill(Disk *disk, size_t *blocks, char **data, char **copies, CacheEntry **entries, size_t n);
+void    disk_cache_release(Disk *disk);
+void    disk_cache_discard(Disk *disk, size_t block, size_t count);
+bool    disk_zero(Disk *disk, size_t block, size_t count);
+void    disk_count(Disk *disk, bool write, size_t n);
+void    disk_count_cache(Disk *disk, bool hit);
+void    disk_checksum_record(Disk *disk, const size_t *blocks, char **data, size_t n);
+bool    disk_checksum_verify(Disk *disk, const size_t *blocks, char **data, size_t n);
+bool    disk_file_open(Disk *disk, const char *path);
+bool    disk_map_open(Disk *disk, const char *path);
+bool    disk_uring_open(Disk *disk, const char *path);
+bool    disk_memory_open(Disk *disk, const char *path);
+ssize_t disk_file_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write);
+ssize_t disk_uring_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write);
+ssize_t disk_memory_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write);
+bool    disk_file_sync(Disk *disk);
+bool    disk_map_sync(Disk *disk);
+bool    disk_memory_sync(Disk *disk);
+bool    disk_file_discard(Disk *disk, size_t block, size_t count);
+bool    disk_memory_discard(Disk *disk, size_t block, size_t count);
+void    disk_file_close(Disk *disk);
+void    disk_map_close(Disk *disk);
+void    disk_uring_close(Disk *disk);
+void    disk_memory_close(Disk *disk);
+
+/* Disk Backends */
+
+static const DiskOps FileOps   = {disk_file_open,   disk_file_io,   disk_file_sync, disk_file_discard,   disk_file_close};
+static const DiskOps MapOps    = {disk_map_open,    disk_memory_io, disk_map_sync,  disk_file_discard,   disk_map_close};
+static const DiskOps UringOps  = {disk_uring_open,  disk_uring_io,  disk_file_sync, disk_file_discard,   disk_uring_close};
+static const DiskOps MemoryOps = {disk_memory_open, disk_memory_io, disk_memory_sync, disk_memory_discard, disk_memory_close};
+
+static const DiskOps *Backends[] = {
+    [DISK_FILE]   = &FileOps,
+    [DISK_MMAP]   = &MapOps,
+    [DISK_URING]  = &UringOps,
+    [DISK_MEMORY] = &MemoryOps,
+};
 
 /* External Functions */
 
 /**
  *
- * Opens disk at specified path with the specified number of blocks by doing
- * the following:
+ * Opens disk at specified path with the specified number of blocks using
+ * the file backend.
+ *
+ * @param       path        Path to disk image to create.
+ * @param       blocks      Number of blocks to allocate for disk image.
+ *
+ * @return      Pointer to newly allocated and configured Disk structure (NULL
+ *              on failure).
+ **/
+Disk *	disk_open(const char *path, size_t blocks) {
+    return disk_open_backend(path, blocks, DISK_FILE);
+}
+
+/**
+ *
+ * Opens disk at specified path with the specified number of blocks and
+ * backend by doing the following:
  *
  *  1. Allocates Disk structure and sets appropriate attributes.
  *
- *  2. Opens file descriptor to specified path.
+ *  2. Looks up the operations of the backend, through which every transfer,
+ *  sync and discard is made.
  *
- *  3. Truncates file to desired file size (blocks * BLOCK_SIZE).
+ *  3. Sets up the backend's store: the image file (truncated to blocks *
+ *  BLOCK_SIZE), plus its mapping (DISK_MMAP) or submission ring
+ *  (DISK_URING, falling back to POSIX file I/O if the kernel does not allow
+ *  it), or zeroed memory and no file at all (DISK_MEMORY).
  *
- * @param       path        Path to disk image to create.
+ * @param       path        Path to disk image to create (unused by DISK_MEMORY).
  * @param       blocks      Number of blocks to allocate for disk image.
+ * @param       backend     How blocks are transferred to the disk image.
  *
  * @return      Pointer to newly allocated and configured Disk structure (NULL
  *              on failure).
  **/
-Disk *	disk_open(const char *path, size_t blocks) {
+Disk *	disk_open_backend(const char *path, size_t blocks, DiskBackend backend) {
 
-    int new_fd = open(path, O_RDWR | O_CREAT, S_IRWXU);
-    if(new_fd == -1) {
-        fprintf(stderr, "Error opening file: %s\n", strerror(errno));
+    if((size_t)backend >= sizeof(Backends) / sizeof(Backends[0])) {
         return NULL;
     }
 
-    if(ftruncate(new_fd, blocks*BLOCK_SIZE) == -1) {
-        fprintf(stderr, "Error truncating file: %s\n", strerror(errno));
+    Disk *d = calloc((size_t)1, sizeof(Disk));
+    if(!d) {
         return NULL;
     }
 
-    Disk *d = calloc((size_t)1, sizeof(Disk));
+    d->ops    = Backends[backend];
+    d->fd     = -1;
     d->blocks = blocks;
-    d->fd = new_fd;
 
+    if(!d->ops->open(d, path)) {
+        free(d);
+        return NULL;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_mutex_init(&d->ring_lock, NULL);
     return d;
 }
 
 /**
  * Close disk structure by doing the following:
  *
- *  1. Close disk file descriptor.
+ *  1. Flush and release block cache (if any).
  *
- *  2. Report number of disk reads and writes.
+ *  2. Release the backend's store (waiting for submitted requests first).
  *
- *  3. Releasing disk structure memory.
+ *  3. Report number of disk reads and writes (and cache hits and misses).
+ *
+ *  4. Releasing disk structure memory.
  *
  * @param       disk        Pointer to Disk structure.
  */
 void	disk_close(Disk *disk) {
 
-    if(close(disk->fd) == -1) {
-        fprintf(stderr, "Error closing file: %s\n", strerror(errno));
+    bool cached = disk->cache != NULL;
+
+    if(!disk_sync(disk)) {
+        fprintf(stderr, "Error flushing block cache\n");
     }
-    
+
+    disk_cache_release(disk);
+    disk->ops->close(disk);
+
     printf("%lu disk block reads\n%lu disk block writes\n", disk->reads, disk->writes);
 
+    if(cached) {
+        printf("%lu disk block cache hits\n%lu disk block cache misses\n", disk->hits, disk->misses);
+    }
+
+    pthread_mutex_destroy(&disk->lock);
+    pthread_mutex_destroy(&disk->ring_lock);
     free(disk);
 
 }
 
+/**
+ * Configure write-back block cache by doing the following:
+ *
+ *  1. Flush and release any existing block cache.
+ *
+ *  2. Allocate cache entries and block to entry map (if blocks > 0).
+ *
+ * Blocks are evicted using the CLOCK (second chance) policy and dirty blocks
+ * are only written to the disk image on eviction or disk_sync.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Number of blocks to cache (0 disables caching).
+ *
+ * @return      Whether or not the cache was configured successfully.
+ **/
+bool	disk_cache(Disk *disk, size_t blocks) {
+
+    if(!disk || !disk_sync(disk)) {
+        return false;
+    }
+
+    disk_cache_release(disk);
+
+    if(blocks == 0) {
+        return true;
+    }
+
+    blocks = min(blocks, disk->blocks);
+
+    Cache *c = calloc(1, sizeof(Cache));
+    if(!c) {
+        return false;
+    }
+
+    c->capacity = blocks;
+    c->slots    = calloc(disk->blocks, sizeof(size_t));
+    c->entries  = calloc(blocks, sizeof(CacheEntry));
+    c->buffer   = malloc(blocks * BLOCK_SIZE);
+
+    if(!c->slots || !c->entries || !c->buffer) {
+        free(c->slots);
+        free(c->entries);
+        free(c->buffer);
+        free(c);
+        return false;
+    }
+
+    for(size_t i = 0; i < blocks; i++) {
+        c->entries[i].data = c->buffer + i * BLOCK_SIZE;
+    }
+
+    disk->cache = c;
+    return true;
+}
+
+/**
+ * Write all dirty blocks in the block cache back to the disk image by doing
+ * the following:
+ *
+ *  1. Collect dirty blocks in block number order using the block to entry
+ *  map.
+ *
+ *  2. Write them with a single vectored request so adjacent blocks are
+ *  merged.
+ *
+ *  3. Flush the backend to its store (fdatasync for the image file, msync
+ *  for DISK_MMAP).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not all dirty blocks were written.
+ **/
+bool	disk_sync(Disk *disk) {
+
+    if(!disk) {
+        return false;
+    }
+
+    Cache *c = disk->cache;
+    if(!c) {
+        return disk->ops->sync(disk);
+    }
+
+    size_t *blocks = malloc(c->capacity * sizeof(size_t));
+    char  **data   = malloc(c->capacity * sizeof(char *));
+    size_t  n      = 0;
+    if(!blocks || !data) {
+        free(blocks);
+        free(data);
+        return false;
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    for(size_t b = 0; b < disk->blocks && n < c->capacity; b++) {
+        if(c->slots[b] && c->entries[c->slots[b] - 1].dirty) {
+            blocks[n] = b;
+            data[n++] = c->entries[c->slots[b] - 1].data;
+        }
+    }
+
+    bool synced = disk_device_writev(disk, blocks, data, n) != DISK_FAILURE;
+
+    for(size_t i = 0; synced && i < n; i++) {
+        c->entries[c->slots[blocks[i]] - 1].dirty = false;
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    free(blocks);
+    free(data);
+    return synced && disk->ops->sync(disk);
+}
+
+/**
+ * Verify blocks against a table of checksums by doing the following:
+ *
+ *  1. Record the CRC32C of every block written in the table (or 0, which
+ *  is never checked, for data blocks unless data is set).
+ *
+ *  2. Check every block read from the disk image against its entry, so
+ *  blocks are verified once when loaded into the block cache and not on
+ *  cache hits.  A read of a block that does not match fails (with errno
+ *  set to EBADMSG) and the block is not cached.
+ *
+ * Blocks are data blocks when written under the DISK_DATA class (see
+ * disk_account_class).  Discarded blocks get an entry of 0.
+ *
+ * Note: The table is owned by the caller.  Do not change it while
+ * transfers are in progress.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       sums        Checksum of each block (NULL to stop checking).
+ * @param       data        Whether or not data blocks are checksummed.
+ **/
+void	disk_checksums(Disk *disk, uint32_t *sums, bool data) {
+    disk->sums     = sums;
+    disk->sum_data = data;
+}
+
 /**
  * Read data from disk at specified block into data buffer by doing the
  * following:
  *
  *  1. Performing sanity check.
  *
- *  2. Seeking to specified block.
+ *  2. Copying block from the block cache (loading it on a miss).
  *
- *  3. Reading from block to data buffer (must be BLOCK_SIZE).
+ *  3. Reading from block to data buffer (must be BLOCK_SIZE) if uncached.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -95,18 +373,14 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
         return DISK_FAILURE;
     }
 
-    if(lseek(disk->fd, block*BLOCK_SIZE, SEEK_SET) == -1) {
-        return 0;
-    }
-
-    if(read(disk->fd, data, BLOCK_SIZE) == DISK_FAILURE) { // args here may be wrong
-        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
-        return DISK_FAILURE;
+    if(!disk->cache) {
+        return disk_device_read(disk, block, data);
     }
 
-    disk->reads++;
-
-    return BLOCK_SIZE;
+    pthread_mutex_lock(&disk->lock);
+    ssize_t result = disk_cache_read(disk, block, data);
+    pthread_mutex_unlock(&disk->lock);
+    return result;
 }
 
 /**
@@ -115,9 +389,9 @@ ssize_t disk_read(Disk *disk, size_t block, char *data) {
  *
  *  1. Performing sanity check.
  *
- *  2. Seeking to specified block.
+ *  2. Copying data buffer into the block cache and marking it dirty.
  *
- *  3. Writing data buffer (must be BLOCK_SIZE) to disk block.
+ *  3. Writing data buffer (must be BLOCK_SIZE) to disk block if uncached.
  *
  * @param       disk        Pointer to Disk structure.
  * @param       block       Block number to perform operation on.
@@ -132,48 +406,1384 @@ ssize_t disk_write(Disk *disk, size_t block, char *data) {
         return DISK_FAILURE;
     }
 
-    int new_fd = disk->fd;
-    if(lseek(new_fd, block*BLOCK_SIZE, SEEK_SET) == DISK_FAILURE) {
-        return 0;
+    ssize_t result;
+
+    if(!disk->cache) {
+        result = disk_device_write(disk, block, data);
+    } else {
+        pthread_mutex_lock(&disk->lock);
+        result = disk_cache_write(disk, block, data);
+        pthread_mutex_unlock(&disk->lock);
     }
 
-    if(write(new_fd, data, BLOCK_SIZE) == -1) { // args here may be wrong
-        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+    if(result != DISK_FAILURE) {
+        disk_checksum_record(disk, &block, &data, 1);
+    }
+    return result;
+}
+
+/**
+ * Read multiple blocks from disk into their data buffers by doing the
+ * following:
+ *
+ *  1. Performing sanity check on every block and buffer.
+ *
+ *  2. Copying cached blocks and reserving cache entries for the rest.
+ *
+ *  3. Reading uncached blocks with preadv, merging runs of adjacent blocks
+ *  into a single system call.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to read.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to read.
+ *
+ * @return      Number of bytes read.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_readv(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    if(!disk_sanity_checkv(disk, blocks, data, n)) {
         return DISK_FAILURE;
     }
 
-    disk->writes++;
+    Cache *c = disk->cache;
+    if(!c) {
+        return disk_device_readv(disk, blocks, data, n);
+    }
 
-    return BLOCK_SIZE;
+    size_t batch = min(n, c->capacity);
+    size_t      *pblocks  = malloc(batch * sizeof(size_t));
+    char       **pdata    = malloc(batch * sizeof(char *));
+    char       **pcopies  = malloc(batch * sizeof(char *));
+    CacheEntry **pentries = malloc(batch * sizeof(CacheEntry *));
+    size_t       pending  = 0;
+    bool         success  = pblocks && pdata && pcopies && pentries;
+
+    pthread_mutex_lock(&disk->lock);
+    for(size_t i = 0; success && i < n; i++) {
+        CacheEntry *e = disk_cache_lookup(disk, blocks[i]);
+
+        if(e && e->pinned) {
+            success = disk_cache_fill(disk, pblocks, pdata, pcopies, pentries, pending);
+            pending = 0;
+            if(!success) {
+                break;
+            }
+        }
+
+        if(e) {
+            disk_count_cache(disk, true);
+            memcpy(data[i], e->data, BLOCK_SIZE);
+            continue;
+        }
+
+        disk_count_cache(disk, false);
+
+        if(pending == c->capacity) {
+            success = disk_cache_fill(disk, pblocks, pdata, pcopies, pentries, pending);
+            pending = 0;
+        }
+
+        if(!success || !(e = disk_cache_insert(disk, blocks[i]))) {
+            success = false;
+            break;
+        }
+
+        e->pinned = true;
+        pblocks[pending]  = blocks[i];
+        pdata[pending]    = e->data;
+        pcopies[pending]  = data[i];
+        pentries[pending] = e;
+        pending++;
+    }
+
+    if(success) {
+        success = disk_cache_fill(disk, pblocks, pdata, pcopies, pentries, pending);
+    } else {
+        for(size_t i = 0; i < pending; i++) {
+            pentries[i]->pinned = false;
+            pentries[i]->valid  = false;
+            c->slots[pblocks[i]] = 0;
+        }
+    }
+    pthread_mutex_unlock(&disk->lock);
+
+    free(pblocks);
+    free(pdata);
+    free(pcopies);
+    free(pentries);
+    return success ? (ssize_t)(n * BLOCK_SIZE) : DISK_FAILURE;
 }
 
-/* Internal Functions */
+/**
+ * Write multiple blocks to disk from their data buffers by doing the
+ * following:
+ *
+ *  1. Performing sanity check on every block and buffer.
+ *
+ *  2. Copying buffers into the block cache and marking them dirty.
+ *
+ *  3. Writing with pwritev, merging runs of adjacent blocks into a single
+ *  system call, if uncached.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to write.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to write.
+ *
+ * @return      Number of bytes written.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_writev(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    if(!disk_sanity_checkv(disk, blocks, data, n)) {
+        return DISK_FAILURE;
+    }
+
+    ssize_t result = n * BLOCK_SIZE;
+
+    if(!disk->cache) {
+        result = disk_device_writev(disk, blocks, data, n);
+    } else {
+        pthread_mutex_lock(&disk->lock);
+        for(size_t i = 0; i < n; i++) {
+            if(disk_cache_write(disk, blocks[i], data[i]) == DISK_FAILURE) {
+                result = DISK_FAILURE;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&disk->lock);
+    }
+
+    if(result != DISK_FAILURE) {
+        disk_checksum_record(disk, blocks, data, n);
+    }
+    return result;
+}
 
 /**
- * Perform sanity check before read or write operation:
+ * Load multiple blocks into the block cache without copying them anywhere
+ * by doing the following:
  *
- *  1. Check for valid disk.
+ *  1. Performing sanity check on every block.
  *
- *  2. Check for valid block.
+ *  2. Reserving cache entries for blocks that are not already cached (at
+ *  most half of the cache, so prefetching never evicts everything).
  *
- *  3. Check for valid data.
+ *  3. Reading the reserved blocks with one vectored device read.
+ *
+ * Note: Without a block cache this does nothing.
  *
  * @param       disk        Pointer to Disk structure.
- * @param       block       Block number to perform operation on.
- * @param       data        Data buffer.
+ * @param       blocks      Block numbers to prefetch.
+ * @param       n           Number of blocks to prefetch.
  *
- * @return      Whether or not it is safe to perform a read/write operation
- *              (true for safe, false for unsafe).
+ * @return      Number of blocks loaded (DISK_FAILURE on failure).
  **/
-bool    disk_sanity_check(Disk *disk, size_t block, const char *data) {
+ssize_t disk_prefetch(Disk *disk, const size_t *blocks, size_t n) {
 
-    if(!disk) return false;
+    if(!disk || (n && !blocks)) {
+        return DISK_FAILURE;
+    }
 
-    if(block >= disk->blocks) return false;
+    for(size_t i = 0; i < n; i++) {
+        if(blocks[i] >= disk->blocks) {
+            return DISK_FAILURE;
+        }
+    }
 
-    if(!data) return false;
+    Cache *c = disk->cache;
+    if(!c || n == 0) {
+        return 0;
+    }
 
-    return true;
+    size_t batch = min(n, max(c->capacity / 2, 1));
+    size_t      *pblocks  = malloc(batch * sizeof(size_t));
+    char       **pdata    = malloc(batch * sizeof(char *));
+    CacheEntry **pentries = malloc(batch * sizeof(CacheEntry *));
+    size_t       pending  = 0;
+    ssize_t      result   = DISK_FAILURE;
+
+    if(pblocks && pdata && pentries) {
+        pthread_mutex_lock(&disk->lock);
+        for(size_t i = 0; i < n && pending < batch; i++) {
+            if(c->slots[blocks[i]]) {
+                continue;
+            }
+
+            CacheEntry *e = disk_cache_insert(disk, blocks[i]);
+            if(!e) {
+                break;
+            }
+
+            e->pinned = true;
+            pblocks[pending]  = blocks[i];
+            pdata[pending]    = e->data;
+            pentries[pending] = e;
+            pending++;
+        }
+
+        if(disk_cache_fill(disk, pblocks, pdata, NULL, pentries, pending)) {
+            result = pending;
+        }
+        pthread_mutex_unlock(&disk->lock);
+    }
+
+    free(pblocks);
+    free(pdata);
+    free(pentries);
+    return result;
+}
+
+/**
+ * Discard a range of blocks so they read back as zeros by doing the
+ * following:
+ *
+ *  1. Performing sanity check on the range.
+ *
+ *  2. Dropping any cached copies of the blocks (dirty ones included).
+ *
+ *  3. Having the backend zero the range (see disk_file_discard).
+ *
+ * Note: Requests submitted on these blocks must be completed first.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to discard.
+ * @param       count       Number of blocks to discard.
+ *
+ * @return      Whether or not the blocks were discarded.
+ **/
+bool    disk_discard(Disk *disk, size_t block, size_t count) {
+
+    if(!disk || block > disk->blocks || count > disk->blocks - block) {
+        return false;
+    }
+
+    if(count == 0) {
+        return true;
+    }
+
+    if(disk->cache) {
+        pthread_mutex_lock(&disk->lock);
+        disk_cache_discard(disk, block, count);
+        pthread_mutex_unlock(&disk->lock);
+    }
+
+    for(size_t b = block; disk->sums && b < block + count; b++) {
+        __atomic_store_n(&disk->sums[b], 0, __ATOMIC_RELAXED);
+    }
+
+    return disk->ops->discard(disk, block, count);
+}
+
+/**
+ * Submit block requests without waiting for them by doing the following:
+ *
+ *  1. Performing sanity check on every request.
+ *
+ *  2. Queueing each request on the submission ring and handing them all to
+ *  the kernel with one io_uring_enter (waiting for completions only when
+ *  the ring is full).
+ *
+ * Each request is marked done, with its result set, once it completes;
+ * reap completions with disk_complete.
+ *
+ * Note: Without a submission ring, or with a block cache (which requests
+ * must not bypass), requests are performed synchronously and are done on
+ * return.  Buffers must stay valid until the request is done.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       requests    Requests to submit.
+ * @param       n           Number of requests.
+ *
+ * @return      Number of requests submitted (DISK_FAILURE on failure).
+ **/
+ssize_t disk_submit(Disk *disk, DiskRequest *requests, size_t n) {
+
+    for(size_t i = 0; i < n; i++) {
+        if(!disk_sanity_check(disk, requests[i].block, requests[i].data)) {
+            return DISK_FAILURE;
+        }
+    }
+
+    if(n && (!disk->ring || disk->cache)) {
+        for(size_t i = 0; i < n; i++) {
+            DiskRequest *r = &requests[i];
+            r->result = r->write ? disk_write(disk, r->block, r->data)
+                                 : disk_read(disk, r->block, r->data);
+            r->done   = true;
+        }
+        return n;
+    }
+
+    ssize_t result = n;
+
+    pthread_mutex_lock(&disk->ring_lock);
+    for(size_t i = 0; i < n; i++) {
+        DiskRequest *r = &requests[i];
+        r->done = false;
+
+        while(!uring_prep(disk->ring, r->write ? URING_WRITE : URING_READ, disk->fd,
+                          r->data, BLOCK_SIZE, r->block * BLOCK_SIZE, r)) {
+            if(disk_uring_wait(disk, 1) == DISK_FAILURE) {
+                result = DISK_FAILURE;
+                break;
+            }
+        }
+    }
+
+    if(result != DISK_FAILURE && disk_uring_wait(disk, 0) == DISK_FAILURE) {
+        result = DISK_FAILURE;
+    }
+    pthread_mutex_unlock(&disk->ring_lock);
+
+    return result;
+}
+
+/**
+ * Reap completed requests, waiting until at least min more have completed
+ * (or none are outstanding).
+ *
+ * Note: Any thread's call may reap any request, so check each request's
+ * done flag rather than the count returned.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       min         Minimum number of completions to wait for.
+ *
+ * @return      Number of requests reaped (DISK_FAILURE on failure).
+ **/
+ssize_t disk_complete(Disk *disk, size_t min) {
+
+    if(!disk) {
+        return DISK_FAILURE;
+    }
+
+    if(!disk->ring) {
+        return 0;
+    }
+
+    ssize_t reaped = 0;
+
+    pthread_mutex_lock(&disk->ring_lock);
+    do {
+        ssize_t result = disk_uring_wait(disk, min - reaped);
+        if(result == DISK_FAILURE) {
+            reaped = DISK_FAILURE;
+            break;
+        }
+        reaped += result;
+    } while((size_t)reaped < min && uring_pending(disk->ring));
+    pthread_mutex_unlock(&disk->ring_lock);
+
+    return reaped;
+}
+
+/**
+ * Take a snapshot of the disk's counters.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       stats       Set to current counters.
+ **/
+void	disk_stats(Disk *disk, DiskStats *stats) {
+
+    stats->reads    = __atomic_load_n(&disk->reads, __ATOMIC_RELAXED);
+    stats->writes   = __atomic_load_n(&disk->writes, __ATOMIC_RELAXED);
+    stats->syscalls = __atomic_load_n(&disk->syscalls, __ATOMIC_RELAXED);
+    stats->corrupt  = __atomic_load_n(&disk->corrupt, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&disk->lock);
+    stats->hits   = disk->hits;
+    stats->misses = disk->misses;
+    stats->cached = disk->cache ? disk->cache->capacity : 0;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+/**
+ * Charge the calling thread's block transfers and cache lookups to the
+ * specified account (in addition to the disk's own counters).
+ *
+ * Transfers are charged to the account's current class, which is set with
+ * disk_account_class.  Writes of dirty blocks evicted from the cache are
+ * charged to the thread that evicts them.
+ *
+ * @param       account     Account to charge (NULL to stop charging).
+ *
+ * @return      Account previously charged by calling thread (NULL if none).
+ **/
+DiskAccount *disk_account(DiskAccount *account) {
+
+    DiskAccount *previous = Account;
+    Account = account;
+    return previous;
+}
+
+/**
+ * Set the class the calling thread's account charges transfers to.
+ *
+ * @param       class       Class to charge.
+ *
+ * @return      Class previously charged (DISK_METADATA if no account).
+ **/
+DiskClass disk_account_class(DiskClass class) {
+
+    if(!Account) {
+        return DISK_METADATA;
+    }
+
+    DiskClass previous = Account->class;
+    Account->class = class;
+    return previous;
+}
+
+/* Internal Functions */
+
+/**
+ * Perform sanity check before read or write operation:
+ *
+ *  1. Check for valid disk.
+ *
+ *  2. Check for valid block.
+ *
+ *  3. Check for valid data.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Whether or not it is safe to perform a read/write operation
+ *              (true for safe, false for unsafe).
+ **/
+bool    disk_sanity_check(Disk *disk, size_t block, const char *data) {
+
+    if(!disk) return false;
+
+    if(block >= disk->blocks) return false;
+
+    if(!data) return false;
+
+    return true;
+}
+
+/**
+ * Perform sanity check on every block and data buffer of a vectored read or
+ * write operation.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to perform operation on.
+ * @param       data        Data buffers.
+ * @param       n           Number of blocks.
+ *
+ * @return      Whether or not it is safe to perform a read/write operation
+ *              (true for safe, false for unsafe).
+ **/
+bool    disk_sanity_checkv(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    if(!disk) return false;
+
+    if(n && (!blocks || !data)) return false;
+
+    for(size_t i = 0; i < n; i++) {
+        if(!disk_sanity_check(disk, blocks[i], data[i])) return false;
+    }
+
+    return true;
+}
+
+/**
+ * Read data from disk image at specified block into data buffer with a
+ * single pread (no separate seek).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes read.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_device_read(Disk *disk, size_t block, char *data) {
+    return disk_device_readv(disk, &block, &data, 1);
+}
+
+/**
+ * Write data to disk image at specified block from data buffer with a
+ * single pwrite (no separate seek).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to perform operation on.
+ * @param       data        Data buffer.
+ *
+ * @return      Number of bytes written.
+ *              (BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_device_write(Disk *disk, size_t block, char *data) {
+    return disk_device_writev(disk, &block, &data, 1);
+}
+
+/**
+ * Read multiple blocks from disk image into their data buffers.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to read.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to read.
+ *
+ * @return      Number of bytes read.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_device_readv(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    ssize_t result = disk->ops->io(disk, blocks, data, n, false);
+
+    if(result != DISK_FAILURE && !disk_checksum_verify(disk, blocks, data, n)) {
+        return DISK_FAILURE;
+    }
+
+    return result;
+}
+
+/**
+ * Write multiple blocks to disk image from their data buffers.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to write.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to write.
+ *
+ * @return      Number of bytes written.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_device_writev(Disk *disk, const size_t *blocks, char **data, size_t n) {
+    return disk->ops->io(disk, blocks, data, n, true);
+}
+
+/**
+ * Submit queued requests with one io_uring_enter, waiting for wait
+ * completions, then reap every available completion by marking its
+ * request done and counting the blocks it transferred.
+ *
+ * Note: Caller must hold ring lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       wait        Number of completions to wait for.
+ *
+ * @return      Number of requests reaped (DISK_FAILURE on failure).
+ **/
+ssize_t disk_uring_wait(Disk *disk, size_t wait) {
+
+    int entered = uring_enter(disk->ring, min(wait, URING_ENTRIES));
+    if(entered < 0) {
+        fprintf(stderr, "Error entering io_uring: %s\n", strerror(errno));
+        return DISK_FAILURE;
+    }
+    __atomic_add_fetch(&disk->syscalls, entered, __ATOMIC_RELAXED);
+
+    DiskRequest *r;
+    ssize_t      res;
+    ssize_t      reaped = 0;
+
+    while(uring_reap(disk->ring, (void **)&r, &res)) {
+        r->result = res < 0 ? DISK_FAILURE : res;
+        if(res > 0) {
+            disk_count(disk, r->write, res / BLOCK_SIZE);
+        }
+
+        // Only requests from disk_submit own their buffer: vectored runs
+        // are recorded and verified by disk_writev and disk_device_readv
+
+        if(r->data && res == BLOCK_SIZE && r->write) {
+            disk_checksum_record(disk, &r->block, &r->data, 1);
+        } else if(r->data && res == BLOCK_SIZE && !disk_checksum_verify(disk, &r->block, &r->data, 1)) {
+            r->result = DISK_FAILURE;
+        }
+
+        r->done = true;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+/**
+ * Find specified block in the block cache and mark it as referenced.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to look up.
+ *
+ * @return      Pointer to cache entry holding block (NULL if not cached).
+ **/
+CacheEntry *disk_cache_lookup(Disk *disk, size_t block) {
+
+    Cache *c = disk->cache;
+    size_t slot = c->slots[block];
+
+    if(slot == 0) {
+        return NULL;
+    }
+
+    CacheEntry *e = &c->entries[slot - 1];
+    e->referenced = true;
+    return e;
+}
+
+/**
+ * Reserve a cache entry for specified block by doing the following:
+ *
+ *  1. Advance CLOCK hand, clearing reference bits, until an unreferenced
+ *  entry is found.
+ *
+ *  2. Write back victim entry if it is dirty.
+ *
+ *  3. Map specified block to the entry.
+ *
+ * Note: The returned entry's data is not loaded.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to insert.
+ *
+ * @return      Pointer to reserved cache entry (NULL on failure).
+ **/
+CacheEntry *disk_cache_insert(Disk *disk, size_t block) {
+
+    Cache *c = disk->cache;
+    CacheEntry *e;
+
+    while(true) {
+        e = &c->entries[c->hand];
+        c->hand = (c->hand + 1) % c->capacity;
+
+        if(e->pinned) {
+            continue;
+        }
+
+        if(!e->valid || !e->referenced) {
+            break;
+        }
+
+        e->referenced = false;
+    }
+
+    if(e->valid) {
+        if(e->dirty && disk_device_write(disk, e->block, e->data) == DISK_FAILURE) {
+            return NULL;
+        }
+        c->slots[e->block] = 0;
+    }
+
+    e->block      = block;
+    e->valid      = true;
+    e->dirty      = false;
+    e->referenced = true;
+    e->pinned     = false;
+    c->slots[block] = (e - c->entries) + 1;
+    return e;
+}
+
+/**
+ * Read block through the block cache, loading it from the device on a miss.
+ *
+ * Note: Caller must hold disk lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to read.
+ * @param       data        Data buffer (must be BLOCK_SIZE).
+ *
+ * @return      Number of bytes read (DISK_FAILURE on failure).
+ **/
+ssize_t disk_cache_read(Disk *disk, size_t block, char *data) {
+
+    CacheEntry *e = disk_cache_lookup(disk, block);
+    disk_count_cache(disk, e != NULL);
+    if(!e) {
+        if(!(e = disk_cache_insert(disk, block))) {
+            return DISK_FAILURE;
+        }
+
+        if(disk_device_read(disk, block, e->data) == DISK_FAILURE) {
+            e->valid = false;
+            disk->cache->slots[block] = 0;
+            return DISK_FAILURE;
+        }
+    }
+
+    memcpy(data, e->data, BLOCK_SIZE);
+    return BLOCK_SIZE;
+}
+
+/**
+ * Write block into the block cache and mark it dirty.
+ *
+ * Note: Caller must hold disk lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       Block number to write.
+ * @param       data        Data buffer (must be BLOCK_SIZE).
+ *
+ * @return      Number of bytes written (DISK_FAILURE on failure).
+ **/
+ssize_t disk_cache_write(Disk *disk, size_t block, char *data) {
+
+    CacheEntry *e = disk_cache_lookup(disk, block);
+    disk_count_cache(disk, e != NULL);
+    if(!e) {
+        if(!(e = disk_cache_insert(disk, block))) {
+            return DISK_FAILURE;
+        }
+    }
+
+    memcpy(e->data, data, BLOCK_SIZE);
+    e->dirty = true;
+    return BLOCK_SIZE;
+}
+
+/**
+ * Load pinned cache entries reserved by disk_readv by doing the following:
+ *
+ *  1. Reading all of their blocks with one vectored device read.
+ *
+ *  2. Copying each block to the caller's buffer (unless copies is NULL) and
+ *  unpinning its entry.
+ *
+ * On failure the entries are dropped from the cache.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to load.
+ * @param       data        Cache entry buffers to load into.
+ * @param       copies      Caller buffers to copy loaded blocks to.
+ * @param       entries     Pinned cache entries.
+ * @param       n           Number of entries.
+ *
+ * @return      Whether or not all blocks were loaded.
+ **/
+bool    disk_cache_fill(Disk *disk, size_t *blocks, char **data, char **copies, CacheEntry **entries, size_t n) {
+
+    bool loaded = disk_device_readv(disk, blocks, data, n) != DISK_FAILURE;
+
+    for(size_t i = 0; i < n; i++) {
+        entries[i]->pinned = false;
+
+        if(!loaded) {
+            entries[i]->valid = false;
+            disk->cache->slots[blocks[i]] = 0;
+        } else if(copies) {
+            memcpy(copies[i], data[i], BLOCK_SIZE);
+        }
+    }
+
+    return loaded;
+}
+
+/**
+ * Release the block cache (if any).
+ *
+ * Note: Dirty blocks are discarded, so call disk_sync first.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void    disk_cache_release(Disk *disk) {
+
+    Cache *c = disk->cache;
+    if(!c) {
+        return;
+    }
+
+    free(c->slots);
+    free(c->entries);
+    free(c->buffer);
+    free(c);
+    disk->cache = NULL;
+}
+
+/**
+ * Drop cached copies of a range of blocks from the block cache without
+ * writing them back.
+ *
+ * Note: Caller must hold disk lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to drop.
+ * @param       count       Number of blocks to drop.
+ **/
+void    disk_cache_discard(Disk *disk, size_t block, size_t count) {
+
+    Cache *c = disk->cache;
+
+    for(size_t b = block; b < block + count; b++) {
+        if(c->slots[b]) {
+            CacheEntry *e = &c->entries[c->slots[b] - 1];
+            e->valid = false;
+            e->dirty = false;
+            c->slots[b] = 0;
+        }
+    }
+}
+
+/**
+ * Count blocks transferred to or from the disk image, charging them to the
+ * calling thread's account (if any).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       write       Whether blocks were written (true) or read.
+ * @param       n           Number of blocks transferred.
+ **/
+void    disk_count(Disk *disk, bool write, size_t n) {
+
+    __atomic_add_fetch(write ? &disk->writes : &disk->reads, n, __ATOMIC_RELAXED);
+
+    if(Account) {
+        size_t *counts = write ? Account->writes : Account->reads;
+        counts[Account->class] += n;
+    }
+}
+
+/**
+ * Count a block cache lookup, charging it to the calling thread's account
+ * (if any).
+ *
+ * Note: Caller must hold disk lock.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       hit         Whether or not the block was cached.
+ **/
+void    disk_count_cache(Disk *disk, bool hit) {
+
+    if(hit) {
+        disk->hits++;
+    } else {
+        disk->misses++;
+    }
+
+    if(Account) {
+        if(hit) {
+            Account->hits++;
+        } else {
+            Account->misses++;
+        }
+    }
+}
+
+/**
+ * Record the checksum of written blocks (see disk_checksums).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers written.
+ * @param       data        Data buffers written.
+ * @param       n           Number of blocks.
+ **/
+void    disk_checksum_record(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    if(!disk->sums) {
+        return;
+    }
+
+    bool sum = disk->sum_data || !Account || Account->class != DISK_DATA;
+
+    for(size_t i = 0; i < n; i++) {
+        uint32_t crc = sum ? crc32c(0, data[i], BLOCK_SIZE) : 0;
+        __atomic_store_n(&disk->sums[blocks[i]], crc, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Check blocks read from the disk image against their recorded checksums
+ * (see disk_checksums).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers read.
+ * @param       data        Data buffers read.
+ * @param       n           Number of blocks.
+ *
+ * @return      Whether or not every block with a checksum matched it (with
+ *              errno set to EBADMSG if not).
+ **/
+bool    disk_checksum_verify(Disk *disk, const size_t *blocks, char **data, size_t n) {
+
+    bool verified = true;
+
+    for(size_t i = 0; disk->sums && i < n; i++) {
+        uint32_t expected = __atomic_load_n(&disk->sums[blocks[i]], __ATOMIC_RELAXED);
+
+        if(expected && crc32c(0, data[i], BLOCK_SIZE) != expected) {
+            fprintf(stderr, "Checksum mismatch on block %lu\n", blocks[i]);
+            __atomic_add_fetch(&disk->corrupt, 1, __ATOMIC_RELAXED);
+            verified = false;
+        }
+    }
+
+    if(!verified) {
+        errno = EBADMSG;
+    }
+
+    return verified;
+}
+
+/**
+ * Write zeros over a range of blocks in vectored device requests of
+ * DISCARD_BATCH blocks, all sharing one zero buffer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to zero.
+ * @param       count       Number of blocks to zero.
+ *
+ * @return      Whether or not all blocks were written.
+ **/
+bool    disk_zero(Disk *disk, size_t block, size_t count) {
+
+    size_t  batch  = min(count, DISCARD_BATCH);
+    char   *zero   = calloc(1, BLOCK_SIZE);
+    size_t *blocks = malloc(batch * sizeof(size_t));
+    char  **data   = malloc(batch * sizeof(char *));
+    bool    zeroed = zero && blocks && data;
+
+    for(size_t i = 0; zeroed && i < batch; i++) {
+        data[i] = zero;
+    }
+
+    for(size_t done = 0; zeroed && done < count; done += batch) {
+        size_t n = min(batch, count - done);
+        for(size_t i = 0; i < n; i++) {
+            blocks[i] = block + done + i;
+        }
+        zeroed = disk_device_writev(disk, blocks, data, n) != DISK_FAILURE;
+    }
+
+    free(zero);
+    free(blocks);
+    free(data);
+    return zeroed;
+}
+
+/* Backend Functions */
+
+/**
+ * Open the disk image file at specified path by doing the following:
+ *
+ *  1. Opens file descriptor to specified path.
+ *
+ *  2. Truncates file to desired file size (blocks * BLOCK_SIZE).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image to create.
+ *
+ * @return      Whether or not the image file was opened.
+ **/
+bool    disk_file_open(Disk *disk, const char *path) {
+
+    int new_fd = open(path, O_RDWR | O_CREAT, S_IRWXU);
+    if(new_fd == -1) {
+        fprintf(stderr, "Error opening file: %s\n", strerror(errno));
+        return false;
+    }
+
+    if(ftruncate(new_fd, disk->blocks*BLOCK_SIZE) == -1) {
+        fprintf(stderr, "Error truncating file: %s\n", strerror(errno));
+        close(new_fd);
+        return false;
+    }
+
+    disk->fd = new_fd;
+    return true;
+}
+
+/**
+ * Open the disk image file and map the whole image into memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image to create.
+ *
+ * @return      Whether or not the image file was opened and mapped.
+ **/
+bool    disk_map_open(Disk *disk, const char *path) {
+
+    if(!disk_file_open(disk, path)) {
+        return false;
+    }
+
+    if(disk->blocks == 0) {
+        return true;
+    }
+
+    char *map = mmap(NULL, disk->blocks*BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping file: %s\n", strerror(errno));
+        close(disk->fd);
+        return false;
+    }
+
+    disk->map = map;
+    return true;
+}
+
+/**
+ * Open the disk image file and set up an io_uring submission ring, falling
+ * back to the file backend if the kernel does not allow it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Path to disk image to create.
+ *
+ * @return      Whether or not the image file was opened.
+ **/
+bool    disk_uring_open(Disk *disk, const char *path) {
+
+    if(!disk_file_open(disk, path)) {
+        return false;
+    }
+
+    if(!(disk->ring = uring_open(URING_ENTRIES))) {
+        fprintf(stderr, "Unable to set up io_uring (%s), using file I/O\n", strerror(errno));
+        disk->ops = &FileOps;
+    }
+
+    return true;
+}
+
+/**
+ * Allocate zeroed memory to hold every block of a RAM disk (no image file
+ * is created, so the contents are lost on disk_close).
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       path        Unused.
+ *
+ * @return      Whether or not the memory was allocated.
+ **/
+bool    disk_memory_open(Disk *disk, const char *path) {
+
+    (void)path;
+
+    if(disk->blocks == 0) {
+        return true;
+    }
+
+    if(!(disk->map = calloc(disk->blocks, BLOCK_SIZE))) {
+        fprintf(stderr, "Error allocating memory disk: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Perform vectored I/O on the disk image file by doing the following:
+ *
+ *  1. Group each run of adjacent block numbers (up to IOV_MAX blocks).
+ *
+ *  2. Issue one preadv or pwritev at the run's offset.
+ *
+ *  3. Count every block transferred and every system call made.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to transfer.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to transfer.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_file_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write) {
+
+    struct iovec iov[IOV_MAX];
+
+    for(size_t i = 0; i < n; ) {
+        size_t run = 0;
+
+        do {
+            iov[run].iov_base = data[i + run];
+            iov[run].iov_len  = BLOCK_SIZE;
+            run++;
+        } while(i + run < n && run < IOV_MAX && blocks[i + run] == blocks[i] + run);
+
+        off_t   offset = blocks[i] * BLOCK_SIZE;
+        ssize_t result = write ? pwritev(disk->fd, iov, run, offset)
+                               : preadv(disk->fd, iov, run, offset);
+        __atomic_add_fetch(&disk->syscalls, 1, __ATOMIC_RELAXED);
+
+        if(result != (ssize_t)(run * BLOCK_SIZE)) {
+            fprintf(stderr, "Error %s file: %s\n", write ? "writing to" : "reading from",
+                result < 0 ? strerror(errno) : "short transfer");
+            return DISK_FAILURE;
+        }
+
+        disk_count(disk, write, run);
+        i += run;
+    }
+
+    return n * BLOCK_SIZE;
+}
+
+/**
+ * Perform vectored I/O on the disk image through the submission ring by
+ * doing the following:
+ *
+ *  1. Group each run of adjacent block numbers (up to IOV_MAX blocks) into
+ *  one vectored request.
+ *
+ *  2. Queue every run, so they are all in flight at once (up to
+ *  URING_ENTRIES), and submit them with one io_uring_enter.
+ *
+ *  3. Wait until every run has completed and check that each transferred
+ *  all of its blocks.
+ *
+ * Note: The ring is held for the whole transfer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to transfer.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to transfer.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred.
+ *              (n * BLOCK_SIZE on success, DISK_FAILURE on failure).
+ **/
+ssize_t disk_uring_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write) {
+
+    struct iovec *iov  = malloc(max(n, 1) * sizeof(struct iovec));
+    DiskRequest  *runs = malloc(max(n, 1) * sizeof(DiskRequest));
+    size_t       *ends = malloc(max(n, 1) * sizeof(size_t));
+    size_t        nruns = 0;
+    ssize_t       result = DISK_FAILURE;
+
+    if(!iov || !runs || !ends) {
+        goto done;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        iov[i].iov_base = data[i];
+        iov[i].iov_len  = BLOCK_SIZE;
+    }
+
+    pthread_mutex_lock(&disk->ring_lock);
+    bool success = true;
+
+    for(size_t i = 0; success && i < n; ) {
+        size_t run = 1;
+        while(i + run < n && run < IOV_MAX && blocks[i + run] == blocks[i] + run) {
+            run++;
+        }
+
+        DiskRequest *r = &runs[nruns];
+        r->block = blocks[i];
+        r->data  = NULL;
+        r->write = write;
+        r->done  = false;
+        ends[nruns++] = run;
+
+        while(success && !uring_prep(disk->ring, write ? URING_WRITEV : URING_READV, disk->fd,
+                                     &iov[i], run, blocks[i] * BLOCK_SIZE, r)) {
+            success = disk_uring_wait(disk, 1) != DISK_FAILURE;
+        }
+
+        i += run;
+    }
+
+    for(size_t r = 0; success && r < nruns; r++) {
+        while(success && !runs[r].done) {
+            success = disk_uring_wait(disk, 1) != DISK_FAILURE;
+        }
+
+        if(success && runs[r].result != (ssize_t)(ends[r] * BLOCK_SIZE)) {
+            fprintf(stderr, "Error %s file: %s\n", write ? "writing to" : "reading from",
+                runs[r].result < 0 ? "request failed" : "short transfer");
+            success = false;
+        }
+    }
+
+    // Never leave requests pointing at this stack frame in flight
+
+    for(size_t r = 0; r < nruns; r++) {
+        while(!runs[r].done && disk_uring_wait(disk, 1) != DISK_FAILURE);
+    }
+    pthread_mutex_unlock(&disk->ring_lock);
+
+    if(success) {
+        result = n * BLOCK_SIZE;
+    }
+
+done:
+    free(iov);
+    free(runs);
+    free(ends);
+    return result;
+}
+
+/**
+ * Perform vectored I/O by copying blocks to or from memory (the mapping of
+ * a DISK_MMAP image or a RAM disk), with no system calls.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       blocks      Block numbers to transfer.
+ * @param       data        Data buffers (each must be BLOCK_SIZE).
+ * @param       n           Number of blocks to transfer.
+ * @param       write       Whether to write (true) or read (false).
+ *
+ * @return      Number of bytes transferred (n * BLOCK_SIZE).
+ **/
+ssize_t disk_memory_io(Disk *disk, const size_t *blocks, char **data, size_t n, bool write) {
+
+    for(size_t i = 0; i < n; i++) {
+        char *block = disk->map + blocks[i] * BLOCK_SIZE;
+        if(write) {
+            memcpy(block, data[i], BLOCK_SIZE);
+        } else {
+            memcpy(data[i], block, BLOCK_SIZE);
+        }
+    }
+
+    disk_count(disk, write, n);
+    return n * BLOCK_SIZE;
+}
+
+/**
+ * Flush the blocks written to the image file out of the page cache to
+ * stable storage with fdatasync (the file size never changes after
+ * disk_open, so its metadata need not be flushed).
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the image file was flushed.
+ **/
+bool    disk_file_sync(Disk *disk) {
+
+    __atomic_add_fetch(&disk->syscalls, 1, __ATOMIC_RELAXED);
+    if(fdatasync(disk->fd) == -1) {
+        fprintf(stderr, "Error syncing file: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Flush the disk image mapping (if any) to the image file with msync.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Whether or not the mapping was flushed.
+ **/
+bool    disk_map_sync(Disk *disk) {
+
+    if(!disk->map) {
+        return true;
+    }
+
+    __atomic_add_fetch(&disk->syscalls, 1, __ATOMIC_RELAXED);
+    if(msync(disk->map, disk->blocks*BLOCK_SIZE, MS_SYNC) == -1) {
+        fprintf(stderr, "Error syncing file: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Discard a range of blocks in the disk image file by doing the following:
+ *
+ *  1. Punching a hole over the range with fallocate, which frees the file
+ *  space without writing anything (the mapping of a DISK_MMAP image sees
+ *  the zeros too).
+ *
+ *  2. Writing zero blocks in large vectored requests if the file system
+ *  holding the image cannot punch holes.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to discard.
+ * @param       count       Number of blocks to discard.
+ *
+ * @return      Whether or not the blocks were discarded.
+ **/
+bool    disk_file_discard(Disk *disk, size_t block, size_t count) {
+
+    __atomic_add_fetch(&disk->syscalls, 1, __ATOMIC_RELAXED);
+    if(fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block*BLOCK_SIZE, count*BLOCK_SIZE) == 0) {
+        return true;
+    }
+
+    if(errno != EOPNOTSUPP && errno != ENOSYS) {
+        fprintf(stderr, "Error discarding blocks: %s\n", strerror(errno));
+        return false;
+    }
+
+    return disk_zero(disk, block, count);
+}
+
+/**
+ * Flush nothing: a RAM disk has no store behind its memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ *
+ * @return      Always true.
+ **/
+bool    disk_memory_sync(Disk *disk) {
+    (void)disk;
+    return true;
+}
+
+/**
+ * Discard a range of RAM disk blocks by zeroing their memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       block       First block to discard.
+ * @param       count       Number of blocks to discard.
+ *
+ * @return      Always true.
+ **/
+bool    disk_memory_discard(Disk *disk, size_t block, size_t count) {
+
+    memset(disk->map + block * BLOCK_SIZE, 0, count * BLOCK_SIZE);
+    return true;
+}
+
+/**
+ * Close the disk image file.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void    disk_file_close(Disk *disk) {
+
+    if(close(disk->fd) == -1) {
+        fprintf(stderr, "Error closing file: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Unmap and close the disk image file.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void    disk_map_close(Disk *disk) {
+
+    if(disk->map && munmap(disk->map, disk->blocks*BLOCK_SIZE) == -1) {
+        fprintf(stderr, "Error unmapping file: %s\n", strerror(errno));
+    }
+
+    disk_file_close(disk);
+}
+
+/**
+ * Wait for submitted requests, close the submission ring and close the
+ * disk image file.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void    disk_uring_close(Disk *disk) {
+
+    if(disk_complete(disk, SIZE_MAX) == DISK_FAILURE) {
+        fprintf(stderr, "Error completing requests: %s\n", strerror(errno));
+    }
+    uring_close(disk->ring);
+    disk->ring = NULL;
+
+    disk_file_close(disk);
+}
+
+/**
+ * Release the memory of a RAM disk.
+ *
+ * @param       disk        Pointer to Disk structure.
+ **/
+void    disk_memory_close(Disk *disk) {
+    free(disk->map);
+    disk->map = NULL;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
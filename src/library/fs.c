@@ -1,11 +1,189 @@
 /* fs.c: SimpleFS file system */
 
+#include "sfs/bitmap.h"
+#include "sfs/crc32c.h"
 #include "sfs/fs.h"
 #include "sfs/logging.h"
 #include "sfs/utils.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+/* File System Constants */
+
+#define MOUNT_THREADS   (4)                 /* Workers scanning Inode table on mount */
+#define MOUNT_BATCH     (32)                /* Indirect blocks read per request on mount */
+#define FORMAT_BATCH    (256)               /* Zero blocks written per request on format */
+#define LEAF_LOADED     (0x1)               /* BlockMap leaf has been loaded */
+#define LEAF_DIRTY      (0x2)               /* BlockMap leaf must be written */
+#define JOURNAL_BLOCKS  (1024)              /* Largest journal reserved on format */
+#define JOURNAL_MIN     (64)                /* Smallest journal reserved on format */
+#define JOURNAL_ROOM    (16)                /* Fewest blocks a transaction may stage */
+#define DEFRAG_BATCH    (64)                /* Data blocks copied per request on defrag */
+
+/* Mount Structures */
+
+typedef struct MountWorker MountWorker;
+struct MountWorker {
+    Disk       *disk;                       /* Disk being mounted */
+    Inode      *inodes;                     /* Resident Inode table */
+    uint32_t    first;                      /* First Inode block to scan */
+    uint32_t    last;                       /* One past last Inode block to scan */
+    uint64_t   *used;                       /* Blocks referenced by scanned Inodes */
+    uint64_t   *free_inodes;                /* Free Inode bitmap (shared by workers) */
+    bool        scan;                       /* Whether or not to mark referenced blocks */
+    bool        dindirect;                  /* Whether or not indirect blocks lead to double indirect blocks */
+    bool        extents;                    /* Whether or not Inodes map blocks with extents */
+    bool        inline_data;                /* Whether or not small files are stored in their Inode */
+    bool        success;                    /* Whether or not scan succeeded */
+};
+
+/* Mapping Structures */
+
+typedef struct BlockMap BlockMap;
+struct BlockMap {
+    Inode      *inode;                      /* Inode being mapped (may be a copy) */
+    File       *file;                       /* Open File of Inode (NULL if not open) */
+    Block      *indirect;                   /* Indirect block (NULL if range does not reach it) */
+    Block       local;                      /* Indirect block if Inode is not open */
+    bool        indirect_dirty;             /* Whether or not indirect block must be written */
+    Block      *dindirect;                  /* Double indirect block (NULL if range does not reach it) */
+    Block       dlocal;                     /* Double indirect block if Inode is not open */
+    bool        dindirect_dirty;            /* Whether or not double indirect block must be written */
+    size_t      first_leaf;                 /* Double indirect slot of first leaf in range */
+    size_t      nleaves;                    /* Number of leaves in range */
+    Block      *leaves;                     /* Leaves in range (loaded on first use) */
+    uint8_t    *leaf_state;                 /* LEAF_* flags of each leaf */
+};
+
+/* Journal Structures */
+
+struct Journal {
+    size_t      blocks;                     /* Number of blocks in file system */
+    uint32_t    start;                      /* First journal block */
+    uint32_t    slot_blocks;                /* Blocks in each of the two transaction slots */
+    uint32_t    sequence;                   /* Sequence number of next transaction */
+    size_t      capacity;                   /* Blocks operations may stage per transaction */
+    size_t      threshold;                  /* Staged blocks that trigger a commit when an operation ends */
+    size_t      chunk_inodes;               /* Most Inodes fs_create_many allocates per transaction */
+    size_t      chunk_bytes;                /* Most bytes fs_write writes per transaction */
+    size_t      count;                      /* Number of staged blocks */
+    size_t      reserved;                   /* Dirty mapping blocks of open Files (staged on commit) */
+    size_t     *targets;                    /* Home block of each staged block */
+    Block      *staged;                     /* Contents of each staged block */
+    uint32_t   *slots;                      /* Staged index plus one of each Disk block (0 if not staged) */
+    uint64_t   *released;                   /* Blocks freed in running transaction (reused after commit) */
+    char       *committed;                  /* Contents of bitmap blocks as of last commit */
+    size_t      active;                     /* Operations in progress */
+    bool        committing;                 /* Whether or not a commit is waiting or running */
+    pthread_mutex_t lock;                   /* Guards staged blocks and operation counts */
+    pthread_cond_t  idle;                   /* Signaled when no operations are in progress */
+    pthread_cond_t  resume;                 /* Signaled when a commit finishes */
+};
+
+/* Statistics Structures */
+
+typedef struct OpTimer OpTimer;
+struct OpTimer {
+    struct timespec start;                  /* When operation started */
+    DiskAccount     account;                /* Disk transfers made by operation */
+    DiskAccount    *previous;               /* Account charged before operation */
+};
+
+/* Internal Prototypes */
+
+Inode * fs_inode(FileSystem *fs, size_t inode_number);
+void    fs_inode_dirty(FileSystem *fs, size_t inode_number);
+bool    fs_format_disk(FileSystem *fs, Disk *disk, uint32_t features, uint32_t ratio, bool wipe);
+uint32_t fs_inode_blocks(uint32_t blocks, uint32_t ratio);
+bool    fs_zero_blocks(Disk *disk, size_t start, size_t count);
+bool    fs_debug_extents(Disk *disk, Inode *inode, uint64_t *unused, size_t nblocks, size_t *extents, size_t *count);
+void    fs_debug_use(uint64_t *unused, size_t nblocks, size_t block);
+void    fs_debug_file(size_t count, size_t extents);
+size_t  fs_largest_run(const uint64_t *bitmap, size_t bits, size_t *runs);
+size_t  fs_block_runs(const size_t *blocks, size_t count, size_t *allocated);
+ssize_t fs_defrag_range(FileSystem *fs, size_t inode_number, File *file, size_t first, size_t count);
+bool    fs_defrag_copy(FileSystem *fs, const size_t *from, const size_t *to, size_t n);
+void *  fs_mount_worker(void *arg);
+bool    fs_mount_scan(MountWorker *w);
+bool    fs_mount_dindirect(MountWorker *w, Block *ind, size_t n);
+void    fs_mount_extents(MountWorker *w, Extent *extents, size_t n);
+bool    fs_bitmap_load(Disk *disk, SuperBlock *super, uint64_t *bitmap);
+bool    fs_bitmap_store(FileSystem *fs);
+bool    fs_super_write(Disk *disk, SuperBlock *super);
+bool    fs_checksum_load(Disk *disk, SuperBlock *super, uint32_t *checksums);
+bool    fs_checksum_store(FileSystem *fs);
+bool    fs_inode_flush(FileSystem *fs);
+Inode * fs_inode_lock(FileSystem *fs, size_t inode_number, bool write);
+void    fs_inode_unlock(FileSystem *fs, size_t inode_number);
+ssize_t fs_read_locked(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+ssize_t fs_write_locked(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset);
+ssize_t fs_read_blocks(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+ssize_t fs_write_blocks(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+ssize_t fs_write_layout(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+ssize_t fs_write_pointers(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+ssize_t fs_write_inline(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+bool    fs_write_mapped(FileSystem *fs, size_t *blocks, char **bufs, bool *fresh, size_t nmapped, char *data, size_t length, size_t byte_start);
+File *  fs_file(FileSystem *fs, size_t inode_number);
+size_t  fs_file_size(Inode *inode, File *file);
+bool    fs_file_writeback(FileSystem *fs, File *file);
+File *  fs_file_find(FileSystem *fs, size_t inode_number);
+bool    fs_file_flush(FileSystem *fs, File *file);
+void    fs_file_dirty(FileSystem *fs, File *file, bool dirty, bool ddirty);
+void    fs_file_forget(FileSystem *fs, File *file);
+Block * fs_load_indirect(FileSystem *fs, size_t inode_number, File *file, Block *local);
+Block * fs_load_dindirect(FileSystem *fs, File *file, uint32_t block, Block *local);
+bool    fs_release_dindirect(FileSystem *fs, File *file, uint32_t block);
+void    fs_readahead(FileSystem *fs, File *file, size_t offset, size_t length);
+bool    fs_has_dindirect(const SuperBlock *super);
+bool    fs_has_extents(const SuperBlock *super);
+bool    fs_is_inline(const SuperBlock *super, const Inode *inode);
+bool    fs_has_inline(const SuperBlock *super);
+bool    fs_has_checksums(const SuperBlock *super);
+size_t  fs_indirect_pointers(const SuperBlock *super);
+size_t  fs_max_size(FileSystem *fs);
+bool    fs_map_init(FileSystem *fs, BlockMap *map, Inode *inode, size_t inode_number, File *file, size_t first, size_t count);
+uint32_t *fs_map_pointer(FileSystem *fs, BlockMap *map, size_t block);
+Block * fs_map_leaf(FileSystem *fs, BlockMap *map, size_t leaf);
+void    fs_map_dirty(FileSystem *fs, BlockMap *map, size_t block);
+void    fs_map_cache(BlockMap *map, size_t leaf, Block *b);
+bool    fs_map_flush(FileSystem *fs, BlockMap *map);
+void    fs_map_release(BlockMap *map);
+size_t  fs_map_blocks(FileSystem *fs, Inode *inode, size_t inode_number, File *file, size_t first, size_t count, size_t *blocks);
+Extent *fs_extent(Inode *inode, Block *eblock, size_t i);
+size_t  fs_extent_blocks(Inode *inode, Block *eblock);
+size_t  fs_extent_lookup(Inode *inode, Block *eblock, size_t first, size_t count, size_t *blocks);
+bool    fs_extent_append(FileSystem *fs, Inode *inode, Block *eblock, size_t start, size_t length, bool *dirty);
+ssize_t fs_write_extents(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset);
+void    fs_release_run(FileSystem *fs, size_t start, size_t length);
+bool    fs_release_extents(FileSystem *fs, Inode *inode, Block *eblock, size_t *lowest);
+void    fs_buffers(char **bufs, size_t count, char *data, size_t length, size_t byte_start, Block *head, Block *tail);
+size_t  fs_holes(size_t *blocks, char **bufs, size_t count);
+bool    fs_sparse_hole(FileSystem *fs, const char *data, size_t length, size_t byte_start, size_t i);
+size_t  fs_allocate_extent(FileSystem *fs, size_t count, size_t *start);
+void    fs_release_block(FileSystem *fs, size_t block);
+ssize_t fs_remove_group(FileSystem *fs, const size_t *group, size_t n, Block *indirects);
+int     fs_compare_numbers(const void *a, const void *b);
+void    fs_stats_begin(OpTimer *timer);
+void    fs_stats_end(FileSystem *fs, FsOp op, OpTimer *timer, bool success);
+bool    fs_remove_inode(FileSystem *fs, size_t inode_number);
+bool    fs_release_inode(FileSystem *fs, size_t inode_number, File *file);
+ssize_t fs_create_inodes(FileSystem *fs, size_t *inode_numbers, size_t n);
+uint64_t *fs_released(FileSystem *fs);
+bool    fs_meta_read(FileSystem *fs, size_t block, char *data);
+bool    fs_meta_readv(FileSystem *fs, size_t *blocks, char **bufs, size_t n);
+bool    fs_meta_write(FileSystem *fs, size_t block, char *data);
+bool    fs_meta_writev(FileSystem *fs, size_t *blocks, char **bufs, size_t n);
+Journal *fs_journal_open(SuperBlock *super, uint64_t *bitmap, uint32_t sequence);
+void    fs_journal_close(Journal *journal);
+bool    fs_journal_replay(Disk *disk, SuperBlock *super, bool recover, uint32_t *sequence);
+uint32_t fs_journal_checksum(const Block *descriptor, Block *blocks, size_t count);
+bool    fs_journal_stage(Journal *journal, size_t block, const char *data, size_t limit);
+void    fs_journal_reserve(Journal *journal, ssize_t blocks);
+void    fs_journal_begin(FileSystem *fs);
+bool    fs_journal_end(FileSystem *fs);
+bool    fs_journal_commit(FileSystem *fs, size_t minimum);
 
 /* External Functions */
 
@@ -16,6 +194,12 @@
  *
  *  2. Read Inode Table and report information about each Inode.
  *
+ *  3. Report fragmentation of data blocks across all Inodes (and the
+ *  number of extents of each).
+ *
+ *  4. Report free space left by the blocks the Inodes and meta data use,
+ *  including the largest run of free blocks.
+ *
  * @param       disk        Pointer to Disk structure.
  **/
 void    fs_debug(Disk *disk) {
@@ -26,33 +210,103 @@ void    fs_debug(Disk *disk) {
         return;
     }
 
+    SuperBlock super = block.super;
+
     printf("SuperBlock:\n");
-    if(block.super.magic_number == MAGIC_NUMBER) {
+    if(super.magic_number == MAGIC_NUMBER) {
         printf("    magic number is valid\n");
     } else {
         printf("    magic number is invalid\n");
 
     }
-    printf("    %u blocks\n"         , block.super.blocks);
-    printf("    %u inode blocks\n"   , block.super.inode_blocks);
-    printf("    %u inodes\n"         , block.super.inodes);
+    printf("    %u blocks\n"         , super.blocks);
+    printf("    %u inode blocks\n"   , super.inode_blocks);
+    printf("    %u inodes\n"         , super.inodes);
+
+    if(super.version == FS_VERSION) {
+        printf("    %u bitmap blocks\n", super.bitmap_blocks);
+        printf("    %s\n", super.clean ? "clean" : "dirty");
+    }
+
+    if(fs_has_extents(&super)) {
+        printf("    extents\n");
+    }
+
+    if(fs_has_inline(&super)) {
+        printf("    inline data\n");
+    }
+
+    if(super.version == FS_VERSION && (super.features & FS_FEATURE_JOURNAL)) {
+        printf("    %u journal blocks\n", super.journal_blocks);
+    }
+
+    if(fs_has_checksums(&super)) {
+        printf("    %u checksum blocks%s\n", super.checksum_blocks, (super.features & FS_FEATURE_DATA_SUMS) ? " (with data)" : "");
+    }
 
     /* Read Inodes */
 
-    for(int j=1; j <= block.super.inode_blocks; j++) {
+    size_t    files   = 0;
+    size_t    data    = 0;
+    size_t    extents = 0;
+    size_t    nblocks = min(super.blocks, disk->blocks);
+    uint64_t *unused  = bitmap_create(nblocks, true);
+
+    if(!unused) {
+        return;
+    }
+
+    size_t meta = 1 + super.inode_blocks;
+    if(super.version == FS_VERSION) {
+        meta += super.bitmap_blocks + ((super.features & FS_FEATURE_JOURNAL) ? super.journal_blocks : 0);
+        meta += fs_has_checksums(&super) ? super.checksum_blocks : 0;
+    }
+
+    for(size_t b = 0; b < min(meta, nblocks); b++) {
+        bitmap_clear(unused, b);
+    }
+
+    for(uint32_t j=1; j <= super.inode_blocks && j < disk->blocks; j++) {
         
         if (disk_read(disk, j, block.data) == DISK_FAILURE) {
-            return;
+            goto done;
         }
 
         for(uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
         
             if(block.inodes[i].valid == 1) {
-                printf("Inode %u:\n", i);
+                size_t last = 0;
+                size_t count = 0;
+                size_t first = extents;
+
+                printf("Inode %u:\n", (j - 1) * INODES_PER_BLOCK + i);
                 printf("    size: %u bytes\n", block.inodes[i].size);
+
+                if(fs_is_inline(&super, &block.inodes[i])) {
+                    printf("    inline data\n");
+                    continue;
+                }
+
+                if(fs_has_extents(&super)) {
+                    if(!fs_debug_extents(disk, &block.inodes[i], unused, nblocks, &extents, &count)) {
+                        goto done;
+                    }
+
+                    fs_debug_file(count, extents - first);
+                    files += count > 0;
+                    data  += count;
+                    continue;
+                }
+
                 printf("    direct blocks:"); 
                 for(uint32_t q = 0; q < POINTERS_PER_INODE; q++) {
-                    if(block.inodes[i].direct[q]) printf(" %d", block.inodes[i].direct[q]);
+                    if(block.inodes[i].direct[q]) {
+                        printf(" %d", block.inodes[i].direct[q]);
+                        fs_debug_use(unused, nblocks, block.inodes[i].direct[q]);
+                        extents += block.inodes[i].direct[q] != last + 1;
+                        last = block.inodes[i].direct[q];
+                        count++;
+                    }
                 }
                 printf("\n");
  
@@ -61,33 +315,107 @@ void    fs_debug(Disk *disk) {
                     Block ind;
 
                     printf("    indirect block: %d\n", block.inodes[i].indirect);
+                    fs_debug_use(unused, nblocks, block.inodes[i].indirect);
 
                     if (disk_read(disk, block.inodes[i].indirect, ind.data) == DISK_FAILURE) {
-                        return;
+                        goto done;
                     }  
 
                     printf("    indirect data blocks:");
 
-                    for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
-                        if(ind.pointers[q] != 0) printf(" %d", ind.pointers[q]);
+                    for(size_t q = 0; q < fs_indirect_pointers(&super); q++) {
+                        if(ind.pointers[q] != 0) {
+                            printf(" %d", ind.pointers[q]);
+                            fs_debug_use(unused, nblocks, ind.pointers[q]);
+                            extents += ind.pointers[q] != last + 1;
+                            last = ind.pointers[q];
+                            count++;
+                        }
                     }
 
                     printf("\n");
+
+                    if(fs_has_dindirect(&super) && ind.pointers[DINDIRECT_POINTER]) {
+
+                        Block dind;
+
+                        printf("    double indirect block: %d\n", ind.pointers[DINDIRECT_POINTER]);
+                        fs_debug_use(unused, nblocks, ind.pointers[DINDIRECT_POINTER]);
+
+                        if (disk_read(disk, ind.pointers[DINDIRECT_POINTER], dind.data) == DISK_FAILURE) {
+                            goto done;
+                        }
+
+                        printf("    double indirect data blocks:");
+
+                        for(int l = 0; l < POINTERS_PER_BLOCK; l++) {
+                            if(dind.pointers[l] == 0) {
+                                continue;
+                            }
+
+                            fs_debug_use(unused, nblocks, dind.pointers[l]);
+
+                            if (disk_read(disk, dind.pointers[l], ind.data) == DISK_FAILURE) {
+                                goto done;
+                            }
+
+                            for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
+                                if(ind.pointers[q] != 0) {
+                                    printf(" %d", ind.pointers[q]);
+                                    fs_debug_use(unused, nblocks, ind.pointers[q]);
+                                    extents += ind.pointers[q] != last + 1;
+                                    last = ind.pointers[q];
+                                    count++;
+                                }
+                            }
+                        }
+
+                        printf("\n");
+                    }
                 }
+
+                fs_debug_file(count, extents - first);
+                files += count > 0;
+                data  += count;
             }
 
         }
     }
 
+    /* Report Fragmentation */
+
+    printf("Fragmentation:\n");
+    printf("    %lu data blocks in %lu extents across %lu files\n", data, extents, files);
+    printf("    %.1f%% fragmented\n", data > files ? 100.0 * (extents - files) / (data - files) : 0.0);
+
+    /* Report Free Space */
+
+    size_t runs    = 0;
+    size_t largest = fs_largest_run(unused, nblocks, &runs);
+
+    printf("Free space:\n");
+    printf("    %lu free blocks in %lu runs\n", bitmap_count(unused, nblocks), runs);
+    printf("    largest free run: %lu blocks\n", largest);
+
+done:
+    free(unused);
 }
 
 /**
  * Format Disk by doing the following:
  *
  *  1. Write SuperBlock (with appropriate magic number, number of blocks,
- *  number of inode blocks, and number of inodes).
+ *  number of inode blocks, and number of inodes, plus FS_VERSION, the
+ *  number of bitmap blocks and supported features).
+ *
+ *  2. Clear the Inode table with large vectored writes.
  *
- *  2. Clear all remaining blocks.
+ *  3. Discard the data blocks (see disk_discard), so they are neither read
+ *  nor written.
+ *
+ *  4. Store free blocks bitmap after the Inode table and mark image clean.
+ *
+ * Use fs_format_wipe to write zeros over the data blocks instead.
  *
  * Note: Do not format a mounted Disk!
  *
@@ -96,32 +424,54 @@ void    fs_debug(Disk *disk) {
  * @return      Whether or not all disk operations were successful.
  **/
 bool    fs_format(FileSystem *fs, Disk *disk) {
+    return fs_format_features(fs, disk, FS_FEATURE_DINDIRECT);
+}
 
-    if(fs->disk != NULL) { 
-        return false;
-    }
-
-    Block s;
-
-    s.super.magic_number = MAGIC_NUMBER;
-    s.super.blocks = disk->blocks;
-    
-    if(disk->blocks % 10 == 0) {
-        s.super.inode_blocks = disk->blocks / 10;
-    } else {
-        s.super.inode_blocks = (disk->blocks / 10) + 1;
-    }
-
-    s.super.inodes = s.super.inode_blocks * INODES_PER_BLOCK;
-
-    if(disk_write(disk, 0, s.data) == DISK_FAILURE) return false;
+/**
+ * Format Disk (see fs_format) with the specified FS_FEATURE_* flags, such
+ * as FS_FEATURE_EXTENTS for extent Inodes or FS_FEATURE_JOURNAL for a meta
+ * data journal.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       features    FS_FEATURE_* flags to record in SuperBlock.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_features(FileSystem *fs, Disk *disk, uint32_t features) {
+    return fs_format_disk(fs, disk, features, INODE_RATIO, false);
+}
 
-    Block ib;
-    for(uint32_t i = 1; i < disk->blocks; i++) {
-        if(disk_write(disk, i, ib.data) == DISK_FAILURE) return false;
-    }
+/**
+ * Format Disk (see fs_format_features), writing zeros over every data
+ * block instead of discarding them, for images whose file system cannot
+ * punch holes or that must be scrubbed block by block.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       features    FS_FEATURE_* flags to record in SuperBlock.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_wipe(FileSystem *fs, Disk *disk, uint32_t features) {
+    return fs_format_disk(fs, disk, features, INODE_RATIO, true);
+}
 
-    return true;
+/**
+ * Format Disk (see fs_format_features) with one Inode block for every
+ * ratio Disk blocks instead of every INODE_RATIO, so images holding a few
+ * large files spend less space (and mount time) on an Inode table, and
+ * images holding many small files do not run out of Inodes.
+ *
+ * The ratio is stored in the SuperBlock and checked by fs_mount.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       features    FS_FEATURE_* flags to record in SuperBlock.
+ * @param       ratio       Disk blocks per Inode block (not 0).
+ * @param       wipe        Whether to write zeros over data blocks.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_density(FileSystem *fs, Disk *disk, uint32_t features, uint32_t ratio, bool wipe) {
+    return fs_format_disk(fs, disk, features, ratio, wipe);
 }
 
 /**
@@ -133,7 +483,22 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  *
  *  3. Copy SuperBlock to FileSystem meta data attribute
  *
- *  4. Initialize FileSystem free blocks bitmap.
+ *  4. Load Inode table into memory.
+ *
+ *  5. Initialize FileSystem free blocks and free Inodes bitmaps.
+ *
+ * Steps 4 and 5 are split across MOUNT_THREADS workers, each reading its
+ * share of Inode blocks in one vectored request and marking the blocks its
+ * Inodes reference in a private bitmap that is merged afterwards.
+ *
+ * If the image stores its bitmap (FS_VERSION) and was cleanly unmounted,
+ * the bitmap is instead loaded with one vectored request and indirect
+ * blocks are not read.  Either way the image is then marked dirty.
+ *
+ * With FS_FEATURE_JOURNAL, the last committed transaction is replayed
+ * first if the image was not cleanly unmounted (reading at most the
+ * journal), after which the stored bitmap is current and Inodes are never
+ * scanned.
  *
  * Note: Do not mount a Disk that has already been mounted!
  *
@@ -143,6 +508,10 @@ bool    fs_format(FileSystem *fs, Disk *disk) {
  **/
 bool    fs_mount(FileSystem *fs, Disk *disk) {
 
+    if(fs->disk) {      // no double mount
+        return false;
+    }
+
     Block s;
     if(disk_read(disk, 0, s.data) == DISK_FAILURE) { // read data into block
         return false;
@@ -156,373 +525,836 @@ bool    fs_mount(FileSystem *fs, Disk *disk) {
         return false;
     }
 
-    if((s.super.inode_blocks != (disk->blocks / 10 )) && (s.super.inode_blocks != (disk->blocks / 10 ) + 1)) {
+    // Original images have no on-disk bitmap (or reliable fields past inodes)
+
+    if(s.super.version != FS_VERSION) {
+        s.super.version       = 0;
+        s.super.bitmap_blocks = 0;
+        s.super.clean         = false;
+        s.super.features      = 0;
+        s.super.inode_ratio   = 0;
+    } else if(s.super.bitmap_blocks != (disk->blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK) {
+        return false;
+    } else if(s.super.features & ~FS_FEATURES) {
         return false;
     }
 
-    if(fs->disk) {      // no double mount
+    // Images that predate the stored ratio have one Inode block per
+    // INODE_RATIO blocks (rounded either way)
+
+    if(s.super.inode_ratio) {
+        if(s.super.inode_blocks != fs_inode_blocks(disk->blocks, s.super.inode_ratio)) {
+            return false;
+        }
+    } else if((s.super.inode_blocks != (disk->blocks / INODE_RATIO)) && (s.super.inode_blocks != (disk->blocks / INODE_RATIO) + 1)) {
         return false;
     }
 
-    fs->disk=disk;
-    fs->meta_data=s.super;
-
-    bool *bitmap = malloc(disk->blocks * sizeof(bool));
-    memset(bitmap, 1, disk->blocks * sizeof(bool));
+    bool journaled = s.super.features & FS_FEATURE_JOURNAL;
+    if(!journaled) {
+        s.super.journal_blocks = 0;
+    } else if(s.super.journal_blocks / 2 < 1 + s.super.bitmap_blocks + JOURNAL_ROOM || s.super.journal_blocks / 2 > 1 + JOURNAL_TARGETS) {
+        return false;
+    }
 
+    bool checksummed = fs_has_checksums(&s.super);
+    if(!checksummed && s.super.version == FS_VERSION && (s.super.features & FS_FEATURE_DATA_SUMS)) {
+        return false;
+    } else if(!checksummed) {
+        s.super.checksum_blocks = 0;
+    } else if(s.super.checksum_blocks != (disk->blocks + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK) {
+        return false;
+    }
 
-    for(int i=0; i < s.super.inode_blocks + 1; i++) bitmap[i]=0; 
+    uint32_t meta_blocks = 1 + s.super.inode_blocks + s.super.bitmap_blocks + s.super.journal_blocks + s.super.checksum_blocks;
+    if(meta_blocks > disk->blocks) {
+        return false;
+    }
 
-    Block table;
-    Block ind;
+    // Replay the last committed transaction before anything is loaded
 
-    for(int q=1; q <= s.super.inode_blocks; q++) {
+    uint32_t sequence = 0;
+    if(journaled && !fs_journal_replay(disk, &s.super, !s.super.clean, &sequence)) {
+        return false;
+    }
 
-        if (disk_read(disk, q, table.data) == DISK_FAILURE) {
-            return false;
-        } 
+    // Verify everything loaded from here on (checksums stored on a clean
+    // unmount are all that can be trusted)
 
-        for(uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
+    uint32_t *checksums = checksummed ? calloc(s.super.checksum_blocks, BLOCK_SIZE) : NULL;
+    if(checksummed && (!checksums || (s.super.clean && !fs_checksum_load(disk, &s.super, checksums)))) {
+        free(checksums);
+        return false;
+    }
+    disk_checksums(disk, checksums, s.super.features & FS_FEATURE_DATA_SUMS);
+
+    Inode *inodes = malloc(s.super.inode_blocks * BLOCK_SIZE);
+    bool  *dirty  = calloc(s.super.inode_blocks, sizeof(bool));
+    uint64_t *bitmap = bitmap_create(disk->blocks, true);
+    uint64_t *free_inodes = bitmap_create(s.super.inodes, false);
+    pthread_rwlock_t *locks = malloc(s.super.inodes * sizeof(pthread_rwlock_t));
+    if(!inodes || !dirty || !bitmap || !free_inodes || !locks) {
+        goto failure;
+    }
 
-            if(table.inodes[i].valid == 1) { 
+    // Scan Inode blocks in parallel (only load them after a clean unmount)
+
+    size_t      nworkers = max(min(MOUNT_THREADS, s.super.inode_blocks), 1);
+    MountWorker workers[MOUNT_THREADS];
+    pthread_t   threads[MOUNT_THREADS];
+    bool        started[MOUNT_THREADS] = {false};
+    bool        success = true;
+
+    for(size_t t = 0; t < nworkers; t++) {
+        workers[t] = (MountWorker){
+            .disk   = disk,
+            .inodes = inodes,
+            .first  = s.super.inode_blocks * t / nworkers,
+            .last   = s.super.inode_blocks * (t + 1) / nworkers,
+            .used   = bitmap_create(disk->blocks, false),
+            .free_inodes = free_inodes,
+            .scan   = !s.super.clean && !journaled,
+            .dindirect = fs_has_dindirect(&s.super),
+            .extents   = fs_has_extents(&s.super),
+            .inline_data = fs_has_inline(&s.super),
+        };
+
+        success = success && workers[t].used;
+        if(workers[t].used && t > 0) {
+            started[t] = pthread_create(&threads[t], NULL, fs_mount_worker, &workers[t]) == 0;
+        }
+    }
 
-                // Check Direct pointers
+    if(workers[0].used) {
+        fs_mount_scan(&workers[0]);
+    }
 
-                for(int q = 0; q < POINTERS_PER_INODE; q++) {
-                    bitmap[table.inodes[i].direct[q]]=0;
-                }
+    for(size_t t = 0; t < nworkers; t++) {
+        if(started[t]) {
+            pthread_join(threads[t], NULL);
+        } else if(t > 0 && workers[t].used) {
+            fs_mount_scan(&workers[t]);
+        }
 
-                // Check Indirect pointers
+        success = success && workers[t].success;
 
-                if(table.inodes[i].indirect) {
+        // Merge referenced blocks into free blocks bitmap
 
-                    bitmap[table.inodes[i].indirect]=0;
+        for(size_t w = 0; workers[t].used && w < BITMAP_WORDS(disk->blocks); w++) {
+            bitmap[w] &= ~workers[t].used[w];
+        }
+        free(workers[t].used);
+    }
 
-                    if (disk_read(disk, table.inodes[i].indirect, ind.data) == DISK_FAILURE) {
-                        return false;
-                    } 
+    if(!success || ((s.super.clean || journaled) && !fs_bitmap_load(disk, &s.super, bitmap))) {
+        goto failure;
+    }
 
-                    for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
-                        bitmap[ind.pointers[q]]=0;
-                    }
-                }
+    for(uint32_t i = 0; i < meta_blocks; i++) bitmap_clear(bitmap, i); 
 
-            }
+    // Mark image dirty until it is cleanly unmounted
 
+    if(s.super.version == FS_VERSION) {
+        s.super.clean = false;
+        if(!fs_super_write(disk, &s.super)) {
+            goto failure;
         }
+    }
 
+    Journal *journal = NULL;
+    if(journaled && !(journal = fs_journal_open(&s.super, bitmap, sequence))) {
+        goto failure;
     }
 
+    fs->disk=disk;
+    fs->meta_data=s.super;
+    fs->inodes=inodes;
+    fs->dirty_inodes=dirty;
     fs->free_blocks=bitmap;
+    fs->free_hint=0;
+    fs->free_inodes=free_inodes;
+    fs->free_inode_hint=0;
+    fs->files=NULL;
+    fs->inode_locks=locks;
+    fs->journal=journal;
+    fs->checksums=checksums;
+
+    for(uint32_t i = 0; i < s.super.inodes; i++) {
+        pthread_rwlock_init(&locks[i], NULL);
+    }
+    pthread_mutex_init(&fs->lock, NULL);
 
     return true;
+
+failure:
+    disk_checksums(disk, NULL, false);
+    free(checksums);
+    free(inodes);
+    free(dirty);
+    free(bitmap);
+    free(free_inodes);
+    free(locks);
+    return false;
 }
 
 /**
  * Unmount FileSystem from internal Disk by doing the following:
  *
- *  1. Set FileSystem disk attribute.
+ *  1. Flush open Files, dirty Inode blocks and cached blocks to Disk.
+ *
+ *  2. Store free blocks bitmap (and checksums) and mark SuperBlock clean
+ *  (FS_VERSION).
  *
- *  2. Release free blocks bitmap.
+ *  3. Set FileSystem disk attribute.
+ *
+ *  4. Release open Files, Inode table, free bitmaps, journal and locks.
  *
  * @param       fs      Pointer to FileSystem structure.
  **/
 void    fs_unmount(FileSystem *fs) {
 
+    if(!fs->disk) {
+        return;
+    }
+
+    if(!fs_sync(fs)) {
+        error("Unable to sync file system on unmount");
+    } else if(fs->meta_data.version == FS_VERSION) {
+        fs->meta_data.clean = true;
+        if(!fs_bitmap_store(fs) || !fs_checksum_store(fs) || !fs_super_write(fs->disk, &fs->meta_data) || !disk_sync(fs->disk)) {
+            error("Unable to mark file system clean on unmount");
+        }
+    }
+
+    disk_checksums(fs->disk, NULL, false);
+    free(fs->checksums);
+    fs->checksums=NULL;
+
+    while(fs->files) {
+        File *next = fs->files->next;
+        pthread_mutex_destroy(&fs->files->lock);
+        free(fs->files->pending);
+        free(fs->files);
+        fs->files = next;
+    }
+
+    for(uint32_t i = 0; i < fs->meta_data.inodes; i++) {
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
+    }
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->inode_locks);
+    fs->inode_locks=NULL;
+
     fs->disk=NULL;
+    free(fs->inodes);
+    fs->inodes=NULL;
+    free(fs->dirty_inodes);
+    fs->dirty_inodes=NULL;
     free(fs->free_blocks);
     fs->free_blocks=NULL;
+    free(fs->free_inodes);
+    fs->free_inodes=NULL;
+    fs_journal_close(fs->journal);
+    fs->journal=NULL;
 
 }
 
 /**
- * Allocate an Inode in the FileSystem Inode table by doing the following:
- *
- *  1. Search Inode table for free inode.
- *
- *  2. Reserve free inode in Inode table.
+ * Flush all pending FileSystem updates to the Disk image.
  *
- * Note: Be sure to record updates to Inode table to Disk.
+ * With FS_FEATURE_JOURNAL, each open File is flushed as an operation of
+ * its own, so a transaction that fills up commits between Files.
  *
  * @param       fs      Pointer to FileSystem structure.
- * @return      Inode number of allocated Inode.
+ * @return      Whether or not all pending updates were written.
  **/
-ssize_t fs_create(FileSystem *fs) {
+bool    fs_sync(FileSystem *fs) {
 
-    Block table;
-    bool not_found = true;
-    int inum = 0;
-    int blocknum=0;
+    if(!fs->disk) {
+        return false;
+    }
 
-    for(int q=1; (q <= fs->meta_data.inode_blocks) && not_found; q++) {
+    OpTimer timer;
+    fs_stats_begin(&timer);
 
-        if (disk_read(fs->disk, q, table.data) == DISK_FAILURE) {
-            return -1;
-        } 
+    // Snapshot open Inodes, since flushing a File needs its Inode lock
+    // (for writing, as buffered data may still need blocks)
 
-        for(uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
+    pthread_mutex_lock(&fs->lock);
+    size_t nfiles = 0;
+    for(File *file = fs->files; file; file = file->next) {
+        nfiles++;
+    }
 
-            if(table.inodes[i].valid == 0) { 
-                inum = i;
-                table.inodes[inum].valid = 1;
-                table.inodes[inum].size = 0;
+    size_t *open = malloc(max(nfiles, 1) * sizeof(size_t));
+    nfiles = 0;
+    for(File *file = fs->files; open && file; file = file->next) {
+        open[nfiles++] = file->inode_number;
+    }
+    pthread_mutex_unlock(&fs->lock);
 
-                for(int j = 0; j < POINTERS_PER_INODE; j++) {
-                    table.inodes[inum].direct[j]=0;
-                }
+    bool synced = open != NULL;
 
-                table.inodes[inum].indirect=0;
-                not_found = false;
-                blocknum=q;
-                break;
-            }
+    for(size_t i = 0; synced && i < nfiles; i++) {
+        fs_journal_begin(fs);
+        fs_inode_lock(fs, open[i], true);
+        File *file = fs_file(fs, open[i]);
+        synced = !file || (fs_file_writeback(fs, file) && fs_file_flush(fs, file));
+        fs_inode_unlock(fs, open[i]);
+        synced = fs_journal_end(fs) && synced;
+    }
+    free(open);
 
-        }
+    // A commit writes the Inode table and syncs the Disk itself
 
-    }
+    if(fs->journal) {
+        synced = synced && fs_journal_commit(fs, 0);
+    } else {
+        pthread_mutex_lock(&fs->lock);
+        synced = synced && fs_inode_flush(fs);
+        pthread_mutex_unlock(&fs->lock);
 
-    if(not_found) {
-        return -1;
+        synced = synced && disk_sync(fs->disk);
     }
 
-    if (disk_write(fs->disk, blocknum, table.data) == DISK_FAILURE) {
-            return -1;
-    }
+    fs_stats_end(fs, FS_OP_SYNC, &timer, synced);
+    return synced;
+}
 
-    return inum;
+/**
+ * Enable or disable sparse writes: in sparse mode, fs_write leaves blocks of
+ * a pointer mapped file unallocated when the data written to them is all
+ * zero (reads of unallocated blocks return zeroes without disk I/O in
+ * either mode).
+ *
+ * Note: Must not run concurrently with writes.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       sparse  Whether or not to leave all-zero blocks unallocated.
+ **/
+void    fs_sparse(FileSystem *fs, bool sparse) {
+    fs->sparse = sparse;
 }
 
 /**
- * Remove Inode and associated data from FileSystem by doing the following:
+ * Allocate an Inode in the FileSystem Inode table (see fs_create_many).
  *
- *  1. Load and check status of Inode.
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Inode number of allocated Inode (-1 on failure).
+ **/
+ssize_t fs_create(FileSystem *fs) {
+
+    size_t inode_number;
+    return fs_create_many(fs, &inode_number, 1) == 1 ? (ssize_t)inode_number : -1;
+}
+
+/**
+ * Allocate many Inodes in the FileSystem Inode table by doing the
+ * following:
  *
- *  2. Release any direct blocks.
+ *  1. Find lowest free inodes in free Inodes bitmap (from free Inode hint).
  *
- *  3. Release any indirect blocks.
+ *  2. Reserve each free inode in Inode table.
  *
- *  4. Mark Inode as free in Inode table.
+ *  3. Write the dirty Inode table blocks once for all of them.
+ *
+ * With FS_FEATURE_JOURNAL, Inodes are allocated in chunks small enough for
+ * one transaction each.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to remove.
- * @return      Whether or not removing the specified Inode was successful.
+ * @param       inode_numbers   Set to Inode numbers of allocated Inodes.
+ * @param       n               Number of Inodes to allocate.
+ * @return      Number of Inodes allocated (fewer if the table fills up, -1
+ *              on failure).
  **/
-bool    fs_remove(FileSystem *fs, size_t inode_number) {
+ssize_t fs_create_many(FileSystem *fs, size_t *inode_numbers, size_t n) {
 
-    Block b;
-    if (disk_read(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-            return false;
+    if(!fs->disk) {
+        return -1;
     }
 
-    size_t i_num = inode_number % INODES_PER_BLOCK;
+    OpTimer timer;
+    ssize_t result = 0;
+    size_t  chunk  = fs->journal ? fs->journal->chunk_inodes : n;
+    fs_stats_begin(&timer);
 
-    if(b.inodes[i_num].valid == 1) { 
+    while((size_t)result < n) {
+        size_t wanted = min(n - result, chunk);
 
-        // Release Direct pointers
+        fs_journal_begin(fs);
+        ssize_t created = fs_create_inodes(fs, inode_numbers + result, wanted);
+        if(!fs_journal_end(fs) || created < 0) {
+            result = -1;
+            break;
+        }
 
-        for(int q = 0; q < POINTERS_PER_INODE; q++) {
-            fs->free_blocks[b.inodes[i_num].direct[q]]=1;
+        result += created;
+        if((size_t)created < wanted) {
+            break;
         }
+    }
+
+    fs_stats_end(fs, FS_OP_CREATE, &timer, result == (ssize_t)n);
+    return result;
+}
 
-        // Release Indirect pointer 
+/**
+ * Allocate many Inodes in the FileSystem Inode table (see fs_create_many).
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_numbers   Set to Inode numbers of allocated Inodes.
+ * @param       n               Number of Inodes to allocate (not 0).
+ * @return      Number of Inodes allocated (fewer if the table fills up, -1
+ *              on failure).
+ **/
+ssize_t fs_create_inodes(FileSystem *fs, size_t *inode_numbers, size_t n) {
 
-        if(b.inodes[i_num].indirect) {
+    size_t  created = 0;
 
-            Block ind;
+    pthread_mutex_lock(&fs->lock);
+    size_t  inodes = fs->meta_data.inodes;
+    ssize_t inum   = bitmap_find(fs->free_inodes, inodes, fs->free_inode_hint);
 
-            fs->free_blocks[b.inodes[i_num].indirect]=1;
+    fs->free_inode_hint = inum < 0 ? inodes : (size_t)inum;
 
-            if (disk_read(fs->disk, b.inodes[i_num].indirect, ind.data) == DISK_FAILURE) {
-                return false;
-            } 
+    for(; inum >= 0 && created < n; inum = bitmap_find(fs->free_inodes, inodes, inum + 1)) {
 
-            for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
-                fs->free_blocks[ind.pointers[q]]=1;
+        Inode *inode = &fs->inodes[inum];
+
+        // Skip free Inodes another thread is still looking at (the ones
+        // reserved here stay locked until the Inode table is written)
+
+        if(pthread_rwlock_trywrlock(&fs->inode_locks[inum]) == 0) { 
+            memset(inode, 0, sizeof(Inode));
+            inode->valid = 1;
+
+            bitmap_clear(fs->free_inodes, inum);
+            if((size_t)inum == fs->free_inode_hint) {
+                fs->free_inode_hint = inum + 1;
             }
 
+            fs_inode_dirty(fs, inum);
+            inode_numbers[created++] = inum;
         }
 
-    } else {
-        return false;
-    } 
-
-    b.inodes[i_num].valid = 0;
-    b.inodes[i_num].size = 0;
+    }
 
-    for(int q = 0; q < POINTERS_PER_INODE; q++) {
-        b.inodes[i_num].direct[q]=0;
+    bool flushed = fs_inode_flush(fs);
+    for(size_t i = 0; i < created; i++) {
+        pthread_rwlock_unlock(&fs->inode_locks[inode_numbers[i]]);
     }
+    pthread_mutex_unlock(&fs->lock);
 
-    b.inodes[i_num].indirect=0;
+    return flushed ? (ssize_t)created : -1;
+}
 
-    if (disk_write(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-            return false;
-    }
+/**
+ * Remove Inode and associated data from FileSystem by doing the following:
+ *
+ *  1. Load and check status of Inode.
+ *
+ *  2. Release any direct blocks (or extents), unless data is inline.
+ *
+ *  3. Release any indirect blocks (and double indirect blocks).
+ *
+ *  4. Mark Inode as free in Inode table.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Whether or not removing the specified Inode was successful.
+ **/
+bool    fs_remove(FileSystem *fs, size_t inode_number) {
 
-    return true;
+    OpTimer timer;
+    fs_stats_begin(&timer);
+    fs_journal_begin(fs);
+
+    bool removed = fs_remove_inode(fs, inode_number);
+    removed = fs_journal_end(fs) && removed;
+    fs_stats_end(fs, FS_OP_REMOVE, &timer, removed);
+    return removed;
 }
 
 /**
- * Return size of specified Inode.
+ * Remove Inode and associated data from FileSystem (see fs_remove).
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to remove.
- * @return      Size of specified Inode (-1 if does not exist).
+ * @return      Whether or not removing the specified Inode was successful.
  **/
-ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
+bool    fs_remove_inode(FileSystem *fs, size_t inode_number) {
 
-    Block b;
-    if (disk_read(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-            return -1;
+    Inode *inode = fs_inode_lock(fs, inode_number, true);
+
+    if(!inode) {
+        return false;
+    }
+
+    if(inode->valid != 1) {
+        fs_inode_unlock(fs, inode_number);
+        return false;
+    }
+
+    File *file   = fs_file(fs, inode_number);
+    bool  mapped = !fs_is_inline(&fs->meta_data, inode);
+
+    if(mapped && !fs_release_inode(fs, inode_number, file)) {
+        fs_inode_unlock(fs, inode_number);
+        return false;
     }
 
-    size_t i_num = inode_number % INODES_PER_BLOCK;
+    pthread_mutex_lock(&fs->lock);
+    memset(inode, 0, sizeof(Inode));
+
+    bitmap_set(fs->free_inodes, inode_number);
+    fs->free_inode_hint = min(fs->free_inode_hint, inode_number);
+
+    // Forget resident indirect block of open File (its blocks are freed)
 
-    if(b.inodes[i_num].valid) {
-        return b.inodes[i_num].size;
+    if(file) {
+        fs_file_forget(fs, file);
     }
 
-    return -1;
+    fs_inode_dirty(fs, inode_number);
+    bool flushed = fs_inode_flush(fs);
+    pthread_mutex_unlock(&fs->lock);
 
+    fs_inode_unlock(fs, inode_number);
+    return flushed;
 }
 
 /**
- * Read from the specified Inode into the data buffer exactly length bytes
- * beginning from the specified offset by doing the following:
+ * Release the data blocks and mapping blocks of the specified Inode by
+ * doing the following:
  *
- *  1. Load Inode information.
+ *  1. Release its Extents and extent block.
  *
- *  2. Continuously read blocks and copy data to buffer.
+ *  2. Or release its direct pointers, then its indirect and double
+ *  indirect pointers along with the blocks holding them.
  *
- *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ * Note: Caller must hold the Inode's lock for writing.  The Inode itself
+ * is left unchanged, so the caller clears or restores it.
  *
  * @param       fs              Pointer to FileSystem structure.
- * @param       inode_number    Inode to read data from.
- * @param       data            Buffer to copy data to.
- * @param       length          Number of bytes to read.
- * @param       offset          Byte offset from which to begin reading.
- * @return      Number of bytes read (-1 on error).
+ * @param       inode_number    Inode whose blocks to release.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @return      Whether or not the mapping blocks could be loaded.
  **/
-ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
-    
-    if(length == 0) {
-        return 0;
-    }
+bool    fs_release_inode(FileSystem *fs, size_t inode_number, File *file) {
 
-    Block b;
-    if (disk_read(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-            return -1;
-    }
+    Inode *inode = &fs->inodes[inode_number];
 
-    size_t i_num = inode_number % INODES_PER_BLOCK;
-    size_t d_num = offset / BLOCK_SIZE; 
-    size_t b_read = 0;
+    // Release Extents and extent block
 
-    if(b.inodes[i_num].valid == 0) {
-       return -1;
-    } 
+    if(fs_has_extents(&fs->meta_data)) {
 
-    // Reset length if trying to read too much
+        Block  local;
+        Block *eblock = inode->indirect ? fs_load_indirect(fs, inode_number, file, &local) : NULL;
+        size_t lowest = fs->meta_data.blocks;
+
+        if(!fs_release_extents(fs, inode, eblock, &lowest)) {
+            return false;
+        }
 
-    if(length + offset > b.inodes[i_num].size) {
-        length = b.inodes[i_num].size - offset;
+        fs_release_block(fs, lowest);
+        return true;
     }
 
-//    printf("length: %lu\n", length);
-    
-    int ind_num = 0;
-    if(d_num > 5) {
-        ind_num = offset / BLOCK_SIZE - 5;
+    // Release Direct pointers
+
+    for(int q = 0; q < POINTERS_PER_INODE; q++) {
+        fs_release_block(fs, inode->direct[q]);
     }
 
-    while(b_read < length) {
+    // Release Indirect pointer 
 
-        // Read directs
+    if(inode->indirect) {
 
-        if(d_num < POINTERS_PER_INODE) {
+        Block  local;
+        Block *ind = fs_load_indirect(fs, inode_number, file, &local);
 
- //           printf("\ndirect num: %lu\n", d_num);
+        if (!ind) {
+            return false;
+        } 
 
-            Block d;
-            size_t byte_start = offset % BLOCK_SIZE;
-            size_t read_size = BLOCK_SIZE - byte_start;
+        // Release Double Indirect pointers (the block itself is freed below)
 
-            if (disk_read(fs->disk, b.inodes[i_num].direct[d_num], d.data + offset) == DISK_FAILURE) {
-                return -1;
-            }
+        if(fs_has_dindirect(&fs->meta_data) && !fs_release_dindirect(fs, file, ind->pointers[DINDIRECT_POINTER])) {
+            return false;
+        }
 
-            if(b_read + read_size > length) {
-                memcpy(data+b_read, &d.data[byte_start], length - b_read);
-                b_read=length;
-  //              printf("total b_read: %lu\n", b_read);
-  //              fflush(stdout);
-            } else {
-                memcpy(data+b_read, &d.data[byte_start], read_size);
-                b_read+= read_size;
-   //             printf("total b_read: %lu\n", b_read);
-   //             fflush(stdout);
-            }
+        fs_release_block(fs, inode->indirect);
 
-            d_num++;
+        for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
+            fs_release_block(fs, ind->pointers[q]);
+        }
 
-        } else {
+    }
 
-        // Read Indirect pointer 
+    return true;
+}
 
-            if(b.inodes[i_num].indirect) {
+/**
+ * Remove many Inodes and their data from FileSystem by doing the following:
+ *
+ *  1. Sort the Inode numbers and group them by Inode block.
+ *
+ *  2. Remove each group with fs_remove_group, so every Inode table block
+ *  is written once no matter how many of its Inodes are removed.
+ *
+ * Note: Duplicate, out of range and free Inodes are skipped.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_numbers   Inodes to remove.
+ * @param       n               Number of Inodes to remove.
+ * @return      Number of Inodes removed (-1 on failure).
+ **/
+ssize_t fs_remove_many(FileSystem *fs, const size_t *inode_numbers, size_t n) {
 
-                if(ind_num < POINTERS_PER_BLOCK) {
+    if(!fs->disk) {
+        return -1;
+    }
 
-  //                  printf("\nind block: %d\n", ind_num);
+    OpTimer timer;
+    fs_stats_begin(&timer);
 
-                    Block ind;
+    size_t *sorted    = malloc(n * sizeof(size_t));
+    size_t *group     = malloc(min(n, INODES_PER_BLOCK) * sizeof(size_t));
+    Block  *indirects = malloc(min(n, INODES_PER_BLOCK) * sizeof(Block));
+    ssize_t removed   = -1;
 
-                    if (disk_read(fs->disk, b.inodes[i_num].indirect, ind.data) == DISK_FAILURE) {
-                        return -1;
-                    } 
+    if(n == 0 || !sorted || !group || !indirects) {
+        removed = n == 0 ? 0 : -1;
+        goto cleanup;
+    }
 
-                    Block i_data;
+    memcpy(sorted, inode_numbers, n * sizeof(size_t));
+    qsort(sorted, n, sizeof(size_t), fs_compare_numbers);
 
-                    if(disk_read(fs->disk, ind.pointers[ind_num], i_data.data) == DISK_FAILURE) {
-                        return -1;
-                    }
+    removed = 0;
+    for(size_t q = 0; q < n && sorted[q] < fs->meta_data.inodes;) {
 
-                    size_t byte_start = offset % BLOCK_SIZE;
-                    size_t read_size = BLOCK_SIZE - byte_start;
-
-                    if(b_read + read_size > length) {
-                        memcpy(data+b_read, &i_data.data[byte_start], length - b_read);
-                        b_read=length;
-      //                  printf("final b_read: %lu\n", b_read);
-      //                  fflush(stdout);
-                    } else {
-                        memcpy(data+b_read, &i_data.data[byte_start], read_size);
-                        b_read+=read_size;
-      //                  printf("total b_read: %lu\n", b_read);
-      //                  fflush(stdout);
-                    }
+        // Collect distinct Inodes sharing one Inode block
 
-                    ind_num++;
-                }
+        size_t block  = sorted[q] / INODES_PER_BLOCK;
+        size_t ngroup = 0;
 
+        for(; q < n && sorted[q] < fs->meta_data.inodes && sorted[q] / INODES_PER_BLOCK == block; q++) {
+            if(!ngroup || group[ngroup - 1] != sorted[q]) {
+                group[ngroup++] = sorted[q];
             }
- 
         }
 
+        fs_journal_begin(fs);
+        ssize_t count = fs_remove_group(fs, group, ngroup, indirects);
+        if(!fs_journal_end(fs) || count < 0) {
+            removed = -1;
+            break;
+        }
+
+        removed += count;
     }
 
-    return b_read;
+cleanup:
+    free(sorted);
+    free(group);
+    free(indirects);
+    fs_stats_end(fs, FS_OP_REMOVE, &timer, removed >= 0);
+    return removed;
 }
 
 /**
- * Write to the specified Inode from the data buffer exactly length bytes
+ * Return size of specified Inode.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to remove.
+ * @return      Size of specified Inode (-1 if does not exist).
+ **/
+ssize_t fs_stat(FileSystem *fs, size_t inode_number) {
+
+    OpTimer timer;
+    fs_stats_begin(&timer);
+
+    Inode  *inode = fs_inode_lock(fs, inode_number, false);
+    ssize_t size  = -1;
+
+    if(inode) {
+        if(inode->valid) {
+            size = fs_file_size(inode, fs_file(fs, inode_number));
+        }
+
+        fs_inode_unlock(fs, inode_number);
+    }
+
+    fs_stats_end(fs, FS_OP_STAT, &timer, size >= 0);
+    return size;
+
+}
+
+/**
+ * Open specified Inode by doing the following:
+ *
+ *  1. Check that Inode is valid.
+ *
+ *  2. Add a reference to its open File (allocating it if needed).
+ *
+ * While open, the Inode's indirect block stays resident and updates to it
+ * and to the Inode table are written once by fs_close.  Sequential writes
+ * are collected in a delayed allocation buffer of up to DELALLOC_MAX blocks.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to open.
+ * @return      Whether or not the Inode was opened.
+ **/
+bool    fs_open(FileSystem *fs, size_t inode_number) {
+
+    OpTimer timer;
+    fs_stats_begin(&timer);
+
+    Inode *inode = fs_inode_lock(fs, inode_number, false);
+    bool   opened = false;
+
+    if(!inode) {
+        fs_stats_end(fs, FS_OP_OPEN, &timer, false);
+        return false;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    File *file = inode->valid ? fs_file_find(fs, inode_number) : NULL;
+    if(inode->valid && !file && (file = calloc(1, sizeof(File)))) {
+        pthread_mutex_init(&file->lock, NULL);
+        file->inode_number = inode_number;
+        file->next = fs->files;
+        fs->files = file;
+    }
+
+    if(file) {
+        file->references++;
+        opened = true;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    fs_inode_unlock(fs, inode_number);
+    fs_stats_end(fs, FS_OP_OPEN, &timer, opened);
+    return opened;
+}
+
+/**
+ * Close specified Inode by doing the following:
+ *
+ *  1. Drop a reference to its open File.
+ *
+ *  2. Write back data held in the delayed allocation buffer.
+ *
+ *  3. On the last reference, write the indirect block (if dirty) and the
+ *  Inode table, then release the File.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to close.
+ * @return      Whether or not the Inode was open and its updates written.
+ **/
+bool    fs_close(FileSystem *fs, size_t inode_number) {
+
+    OpTimer timer;
+    fs_stats_begin(&timer);
+
+    if(!fs_inode(fs, inode_number)) {
+        fs_stats_end(fs, FS_OP_CLOSE, &timer, false);
+        return false;
+    }
+
+    fs_journal_begin(fs);
+    fs_inode_lock(fs, inode_number, true);
+
+    // Buffered data is written back before taking the FileSystem lock,
+    // since allocating its blocks updates the Inode table
+
+    File *file    = fs_file(fs, inode_number);
+    bool  flushed = file && fs_file_writeback(fs, file);
+
+    pthread_mutex_lock(&fs->lock);
+    if(file && --file->references == 0) {
+        flushed = flushed && fs_file_flush(fs, file) && fs_inode_flush(fs);
+
+        File **link = &fs->files;
+        while(*link != file) {
+            link = &(*link)->next;
+        }
+        *link = file->next;
+        fs_journal_reserve(fs->journal, -(ssize_t)(file->dirty + file->ddirty));
+        pthread_mutex_destroy(&file->lock);
+        free(file->pending);
+        free(file);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    fs_inode_unlock(fs, inode_number);
+    flushed = fs_journal_end(fs) && flushed;
+    fs_stats_end(fs, FS_OP_CLOSE, &timer, flushed);
+    return flushed;
+}
+
+/**
+ * Read from the specified Inode into the data buffer exactly length bytes
  * beginning from the specified offset by doing the following:
  *
- *  1. Load Inode information.
+ *  1. Load Inode information (and indirect block if needed).
  *
- *  2. Continuously copy data from buffer to blocks.
+ *  2. Map every block in the range and read them in one vectored request
+ *  (prefetching ahead into the block cache for sequential reads of open
+ *  Inodes).
+ *
+ *  3. Copy requested bytes to buffer.
  *
  *  Note: Data is read from direct blocks first, and then from indirect blocks.
+ *  The Inode is locked for reading, so reads of one Inode run in parallel.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read.
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+    
+    if(length == 0) {
+        return 0;
+    }
+
+    OpTimer timer;
+    ssize_t result = -1;
+    fs_stats_begin(&timer);
+
+    if(fs_inode_lock(fs, inode_number, false)) {
+        result = fs_read_locked(fs, inode_number, data, length, offset);
+        fs_inode_unlock(fs, inode_number);
+    }
+
+    fs_stats_end(fs, FS_OP_READ, &timer, result >= 0);
+    return result;
+}
+
+/**
+ * Write to the specified Inode from the data buffer exactly length bytes
+ * beginning from the specified offset by doing the following:
+ *
+ *  1. Load Inode information (and indirect block if needed).
+ *
+ *  2. Reserve contiguous extents for every unallocated block in the range.
+ *
+ *  3. Read any partially overwritten blocks and copy data from buffer.
+ *
+ *  4. Write every block in one vectored request.
+ *
+ *  5. Record updates to Inode, indirect block, and Inode table (deferred
+ *  to fs_close if the Inode is open).
+ *
+ *  Note: Data is written to direct blocks first, and then to indirect blocks.
+ *  The Inode is locked for writing for the whole operation.  Small writes
+ *  to an open Inode are buffered instead, and their blocks are allocated
+ *  when fs_close or fs_sync writes the buffer back.  With FS_FEATURE_JOURNAL,
+ *  writes larger than a transaction allows are made in chunks.
  *
  * @param       fs              Pointer to FileSystem structure.
  * @param       inode_number    Inode to write data to.
@@ -537,162 +1369,3791 @@ ssize_t fs_write(FileSystem *fs, size_t inode_number, char *data, size_t length,
         return 0;
     }
 
-    Block b;
-    if (disk_read(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-            return -1;
+    OpTimer timer;
+    ssize_t result = -1;
+    size_t  chunk  = fs->journal ? fs->journal->chunk_bytes : length;
+    fs_stats_begin(&timer);
+
+    // Journaled writes commit at most chunk bytes per transaction (the
+    // Inode is unlocked in between, as a commit waits for the chunk)
+
+    for(size_t written = 0; written < length && fs_inode(fs, inode_number);) {
+        size_t  wanted = min(length - written, chunk);
+
+        fs_journal_begin(fs);
+        fs_inode_lock(fs, inode_number, true);
+        ssize_t part = fs_write_locked(fs, inode_number, data + written, wanted, offset + written);
+        fs_inode_unlock(fs, inode_number);
+
+        if(!fs_journal_end(fs) || part < 0) {
+            result = written ? (ssize_t)written : -1;
+            break;
+        }
+
+        written += part;
+        result   = written;
+
+        if((size_t)part < wanted) {
+            break;
+        }
     }
 
-    size_t i_num = inode_number % INODES_PER_BLOCK;
+    fs_stats_end(fs, FS_OP_WRITE, &timer, result >= 0);
+    return result;
+}
 
-    // Reset length if trying to write too much
+/**
+ * Return number of extents (contiguous runs of data blocks) of specified
+ * Inode, as fs_debug reports them.
+ *
+ * Note: Data still buffered by an open File is not counted.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to examine.
+ * @return      Number of extents (0 for empty or inline files, -1 on error).
+ **/
+ssize_t fs_fragments(FileSystem *fs, size_t inode_number) {
+
+    Inode *inode = fs_inode_lock(fs, inode_number, false);
 
-    if(length + offset > (BLOCK_SIZE * 5 + BLOCK_SIZE * 128)) {
-        length = BLOCK_SIZE * 5 + BLOCK_SIZE * 128;
+    if(!inode) {
+        return -1;
     }
 
-   // printf("length: %lu\n", length);
+    size_t  count  = fs_is_inline(&fs->meta_data, inode) ? 0 : (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t *blocks = malloc(max(count, 1) * sizeof(size_t));
+    ssize_t result = -1;
 
-    size_t d_num = offset / BLOCK_SIZE; 
-    size_t b_write = 0;
-    
-    int ind_num = 0;
-    if(d_num > 5) {
-        ind_num = offset / BLOCK_SIZE - 5;
+    if(inode->valid == 1 && blocks) {
+        File *file = fs_file(fs, inode_number);
+
+        if(count == 0 || fs_map_blocks(fs, inode, inode_number, file, 0, count, blocks) == count) {
+            size_t allocated;
+            result = fs_block_runs(blocks, count, &allocated);
+        }
     }
 
-    while(b_write < length) {
+    fs_inode_unlock(fs, inode_number);
+    free(blocks);
+    return result;
+}
 
-        // Write to directs
+/**
+ * Defragment specified Inode by doing the following:
+ *
+ *  1. Write back the delayed allocation buffer of an open File.
+ *
+ *  2. Move the data blocks into as few contiguous runs as the free space
+ *  allows, unless they already form fewer (see fs_defrag_range).
+ *
+ *  3. Free the old blocks once the Inode and its mapping blocks point at
+ *  the new ones (with FS_FEATURE_JOURNAL, once that has committed).
+ *
+ * With FS_FEATURE_JOURNAL, a pointer mapped file is moved a chunk at a
+ * time, so the mapping blocks of each chunk fit in one transaction.
+ * Holes stay holes, and indirect blocks are not moved.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to defragment.
+ * @return      Number of data blocks moved (-1 on error).
+ **/
+ssize_t fs_defrag(FileSystem *fs, size_t inode_number) {
 
-        if(d_num < POINTERS_PER_INODE) {
+    if(!fs_inode(fs, inode_number)) {
+        return -1;
+    }
 
-  //          printf("\ndirect num: %lu\n", d_num);
+    OpTimer timer;
+    ssize_t result = 0;
+    size_t  chunk  = SIZE_MAX;
+    fs_stats_begin(&timer);
 
-            Block d;
+    if(fs->journal && !fs_has_extents(&fs->meta_data)) {
+        chunk = fs->journal->chunk_bytes / BLOCK_SIZE;
+    }
 
-            size_t byte_start = offset % BLOCK_SIZE;
-            size_t write_size = BLOCK_SIZE - byte_start;
+    for(size_t first = 0; result >= 0; first += chunk) {
+        fs_journal_begin(fs);
+        Inode  *inode = fs_inode_lock(fs, inode_number, true);
+        File   *file  = fs_file(fs, inode_number);
+        ssize_t moved = -1;
+        size_t  count = 0;
 
-            if(b_write + write_size > length) {
-                memcpy(&d.data[byte_start], data+b_write, length - b_write);
-                b_write=length;
-    //            printf("total b_write: %lu\n", b_write);
-      //          fflush(stdout);
-            } else {
-                memcpy(&d.data[byte_start], data+b_write, write_size);
-                b_write+= write_size;
-        //        printf("total b_write: %lu\n", b_write);
-          //      fflush(stdout);
-            } 
+        if(inode->valid == 1 && (!file || fs_file_writeback(fs, file))) {
+            count = fs_is_inline(&fs->meta_data, inode) ? 0 : (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            moved = first < count ? fs_defrag_range(fs, inode_number, file, first, min(chunk, count - first)) : 0;
+        }
 
-            // write to first free block in bitmap
-            int index = 0;
-            while(fs->free_blocks[index] == 0) index++;
+        fs_inode_unlock(fs, inode_number);
 
-            if (disk_write(fs->disk, index, d.data) == DISK_FAILURE) {
-                return -1;
-            }
+        if(!fs_journal_end(fs) || moved < 0) {
+            result = -1;
+        } else {
+            result += moved;
+        }
 
-            b.inodes[i_num].size = b_write;
-            b.inodes[i_num].direct[d_num] = index;
-            fs->free_blocks[b.inodes[i_num].direct[d_num]]=0; // maybe 0
+        if(first >= count || count - first <= chunk) {
+            break;
+        }
+    }
 
-// another write to update inode table
+    fs_stats_end(fs, FS_OP_DEFRAG, &timer, result >= 0);
+    return result;
+}
 
-            if (disk_write(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-                return -1;
-            }
+/**
+ * Take a snapshot of the FileSystem's operation statistics (and the
+ * counters of its Disk, if mounted).
+ *
+ * Each operation's disk transfers are split into meta data (SuperBlock,
+ * Inode table, bitmap, indirect and extent blocks) and file data.  With a
+ * block cache, writes are charged to the operation that evicts or syncs
+ * them rather than the one that dirtied them.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       stats   Set to current statistics.
+ **/
+void    fs_stats(FileSystem *fs, FsStats *stats) {
 
-            d_num++;
+    // OpStats only holds size_t counters, so copy them one word at a time
 
-        } else {
+    size_t *from = (size_t *)fs->stats;
+    size_t *to   = (size_t *)stats->ops;
+
+    for(size_t i = 0; i < sizeof(fs->stats) / (sizeof(size_t)); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+
+    memset(&stats->disk, 0, sizeof(stats->disk));
+    if(fs->disk) {
+        disk_stats(fs->disk, &stats->disk);
+    }
+}
 
-            // Create Indirect Block if we need to
+/**
+ * Clear the FileSystem's operation statistics.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void    fs_stats_reset(FileSystem *fs) {
 
-            if(!b.inodes[i_num].indirect) {
+    size_t *counters = (size_t *)fs->stats;
 
-                // write to first free block in bitmap
-                int index = 0;
-                while(fs->free_blocks[index] == 0) index++;
+    for(size_t i = 0; i < sizeof(fs->stats) / (sizeof(size_t)); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
 
-                b.inodes[i_num].indirect = index;
-                fs->free_blocks[index] = 0;
+/**
+ * Return name of specified operation.
+ *
+ * @param       op      Operation to name.
+ * @return      Name of operation (without the fs_ prefix).
+ **/
+const char *fs_stats_name(FsOp op) {
+
+    static const char *NAMES[] = {
+        [FS_OP_CREATE] = "create",
+        [FS_OP_REMOVE] = "remove",
+        [FS_OP_STAT]   = "stat",
+        [FS_OP_OPEN]   = "open",
+        [FS_OP_CLOSE]  = "close",
+        [FS_OP_READ]   = "read",
+        [FS_OP_WRITE]  = "write",
+        [FS_OP_SYNC]   = "sync",
+        [FS_OP_DEFRAG] = "defrag",
+    };
+
+    return op < FS_OPS ? NAMES[op] : "unknown";
+}
 
-                if (disk_write(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-                    return -1;
-                }
+/**
+ * Estimate specified latency percentile of an operation from its
+ * histogram.
+ *
+ * @param       stats   Pointer to statistics of operation.
+ * @param       p       Percentile to estimate (between 0 and 1).
+ * @return      Upper bound of histogram bucket holding the percentile in
+ *              microseconds (largest latency for the unbounded bucket, 0 if
+ *              there were no calls).
+ **/
+double  fs_stats_percentile(const OpStats *stats, double p) {
 
-            }
+    size_t total = 0;
+    for(size_t i = 0; i < STATS_BUCKETS; i++) {
+        total += stats->histogram[i];
+    }
 
-            if(ind_num < POINTERS_PER_BLOCK) {
+    if(total == 0) {
+        return 0.0;
+    }
 
-      //      printf("ind_block = %d\n", b.inodes[i_num].indirect);
-    //        printf("\nind pointer: %d\n", ind_num);
-     //       fflush(stdout);
+    size_t rank = p * total;
+    size_t seen = 0;
 
-                Block ind;
+    if(rank == 0 || rank < p * total) {
+        rank++;
+    }
 
-                Block i_data;
+    for(size_t i = 0; i < STATS_BUCKETS - 1; i++) {
+        seen += stats->histogram[i];
+        if(seen >= rank) {
+            return (double)(1ull << i);
+        }
+    }
 
-                size_t byte_start = offset % BLOCK_SIZE;
-                size_t write_size = BLOCK_SIZE - byte_start;
+    return stats->max_nsecs / 1e3;
+}
 
-                if(b_write + write_size > length) {
-                    memcpy(&i_data.data[byte_start], data+b_write, length - b_write);
-                    b_write=length;
-  //                      printf("total b_write: %lu\n", b_write);
-  //                      fflush(stdout);
-                } else {
-                    memcpy(&i_data.data[byte_start], data+b_write, write_size);
-                    b_write+= write_size;
-//                        printf("total b_write: %lu\n", b_write);
-  //                      fflush(stdout);
-                } 
+/* Internal Functions */
 
-//                printf("fail on writing to indirect pointer block\n");
+/**
+ * Format Disk for fs_format_features, fs_format_wipe and fs_format_density
+ * by doing the following:
+ *
+ *  1. Write SuperBlock.
+ *
+ *  2. Write zeros over the Inode table (and journal and data blocks if
+ *  wipe is set).
+ *
+ *  3. Discard the journal and data blocks (unless wipe is set).
+ *
+ *  4. Store free blocks bitmap with only meta data blocks in use.
+ *
+ * With FS_FEATURE_JOURNAL, a sixteenth of the Disk (between JOURNAL_MIN and
+ * JOURNAL_BLOCKS blocks) is reserved for the journal after the bitmap.
+ * With FS_FEATURE_CHECKSUMS (implied by FS_FEATURE_DATA_SUMS), one checksum
+ * block for every SUMS_PER_BLOCK blocks follows the journal.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       disk        Pointer to Disk structure.
+ * @param       features    FS_FEATURE_* flags to record in SuperBlock.
+ * @param       ratio       Disk blocks per Inode block (not 0).
+ * @param       wipe        Whether to write zeros over data blocks.
+ * @return      Whether or not all disk operations were successful.
+ **/
+bool    fs_format_disk(FileSystem *fs, Disk *disk, uint32_t features, uint32_t ratio, bool wipe) {
 
-                // write to first free block in bitmap
-                int index2 = 0;
-                while(fs->free_blocks[index2] == 0) {
-//                    printf("free_blocks[%d] == %d\n", index2, fs->free_blocks[index2]);
-                    index2++;
-                }
+    if(fs->disk != NULL || (features & ~FS_FEATURES) || ratio == 0) { 
+        return false;
+    }
 
-//                printf("new id pointed to block: %d\n", index2);
-//                fflush(stdout);
+    if(features & FS_FEATURE_DATA_SUMS) {
+        features |= FS_FEATURE_CHECKSUMS;
+    }
 
-                if (disk_write(fs->disk, index2, i_data.data) == DISK_FAILURE) {
-                    return -1;
-                }
+    Block s;
+    memset(s.data, 0, BLOCK_SIZE);
 
- //               printf("fail on writing to indirect blokc\n");
+    s.super.magic_number = MAGIC_NUMBER;
+    s.super.blocks = disk->blocks;
+    s.super.inode_blocks = fs_inode_blocks(disk->blocks, ratio);
+    s.super.inode_ratio = ratio;
+    s.super.inodes = s.super.inode_blocks * INODES_PER_BLOCK;
+    s.super.version = FS_VERSION;
+    s.super.bitmap_blocks = (disk->blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    s.super.clean = true;
+    s.super.features = features;
+
+    if(features & FS_FEATURE_JOURNAL) {
+        s.super.journal_blocks = min(JOURNAL_BLOCKS, max(JOURNAL_MIN, disk->blocks / 16));
+        if(s.super.journal_blocks / 2 < 1 + s.super.bitmap_blocks + JOURNAL_ROOM) return false;
+    }
 
-                // Update indirect block
+    if(features & FS_FEATURE_CHECKSUMS) {
+        s.super.checksum_blocks = (disk->blocks + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK;
+    }
 
-                ind.pointers[ind_num] = index2;
+    if(1 + s.super.inode_blocks + s.super.bitmap_blocks + s.super.journal_blocks + s.super.checksum_blocks > disk->blocks) return false;
 
-                if (disk_write(fs->disk, b.inodes[i_num].indirect, ind.data) == DISK_FAILURE) {
-                    return -1;
-                }
+    if(disk_write(disk, 0, s.data) == DISK_FAILURE) return false;
 
-                // Update original inode
+    uint32_t bitmap_start  = 1 + s.super.inode_blocks;
+    uint32_t journal_start = bitmap_start + s.super.bitmap_blocks;
+    uint32_t data_start    = journal_start + s.super.journal_blocks + s.super.checksum_blocks;
 
-                fs->free_blocks[ind.pointers[ind_num]]=0; // maybe 1
+    if(!fs_zero_blocks(disk, 1, s.super.inode_blocks)) return false;
 
-                // Update inode table
+    // Clear the journal and checksums along with the data blocks, so no
+    // transaction or checksum of an earlier image is used
 
-                if (disk_write(fs->disk, inode_number / INODES_PER_BLOCK + 1, b.data) == DISK_FAILURE) {
-                    return -1;
-                }
+    if(wipe) {
+        if(!fs_zero_blocks(disk, journal_start, disk->blocks - journal_start)) return false;
+    } else if(!disk_discard(disk, journal_start, disk->blocks - journal_start)) {
+        return false;
+    }
 
-                ind_num++;
-            }
- 
+    // Store free blocks bitmap with only meta data blocks in use
+
+    FileSystem empty = {.disk = disk, .meta_data = s.super};
+    empty.free_blocks = bitmap_create(disk->blocks, true);
+    if(!empty.free_blocks) return false;
+
+    for(uint32_t i = 0; i < data_start; i++) {
+        bitmap_clear(empty.free_blocks, i);
+    }
+
+    bool stored = fs_bitmap_store(&empty);
+    free(empty.free_blocks);
+    return stored;
+}
+
+/**
+ * Return number of Inode blocks of a Disk with one Inode block for every
+ * ratio blocks (rounded up, so there is always at least one).
+ *
+ * @param       blocks      Number of blocks in Disk.
+ * @param       ratio       Disk blocks per Inode block (not 0).
+ * @return      Number of Inode blocks.
+ **/
+uint32_t fs_inode_blocks(uint32_t blocks, uint32_t ratio) {
+    return max((blocks + (uint64_t)ratio - 1) / ratio, 1);
+}
+
+/**
+ * Write zeros over a range of blocks in vectored requests of FORMAT_BATCH
+ * blocks, all sharing one zero buffer.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       start       First block to clear.
+ * @param       count       Number of blocks to clear.
+ * @return      Whether or not all blocks were written.
+ **/
+bool    fs_zero_blocks(Disk *disk, size_t start, size_t count) {
+
+    size_t  batch  = min(count, FORMAT_BATCH);
+    Block   zero;
+    size_t  blocks[FORMAT_BATCH];
+    char   *bufs[FORMAT_BATCH];
+
+    memset(zero.data, 0, BLOCK_SIZE);
+    for(size_t i = 0; i < batch; i++) {
+        bufs[i] = zero.data;
+    }
+
+    for(size_t done = 0; done < count; done += batch) {
+        size_t n = min(batch, count - done);
+        for(size_t i = 0; i < n; i++) {
+            blocks[i] = start + done + i;
         }
 
+        if(disk_writev(disk, blocks, bufs, n) == DISK_FAILURE) {
+            return false;
+        }
     }
 
-    return b_write;
+    return true;
+}
+
+/**
+ * Report the extents of an extent Inode for fs_debug.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       inode       Pointer to Inode.
+ * @param       unused      Blocks not yet seen in use (cleared as found).
+ * @param       nblocks     Number of blocks in unused.
+ * @param       extents     Incremented by number of discontiguous runs.
+ * @param       count       Set to number of data blocks.
+ * @return      Whether or not the extent block could be read.
+ **/
+bool    fs_debug_extents(Disk *disk, Inode *inode, uint64_t *unused, size_t nblocks, size_t *extents, size_t *count) {
+
+    Block  eblock;
+    size_t last = 0;
+    size_t n    = min(inode->nextents, EXTENTS_PER_INODE + EXTENTS_PER_BLOCK);
+
+    if(inode->indirect) {
+        printf("    extent block: %d\n", inode->indirect);
+        fs_debug_use(unused, nblocks, inode->indirect);
+        if (disk_read(disk, inode->indirect, eblock.data) == DISK_FAILURE) {
+            return false;
+        }
+    } else {
+        n = min(n, EXTENTS_PER_INODE);
+    }
+
+    printf("    extents:");
+    for(size_t e = 0; e < n; e++) {
+        Extent *extent = fs_extent(inode, &eblock, e);
+        if(extent->length) {
+            printf(" %u-%u", extent->start, extent->start + extent->length - 1);
+            for(size_t b = extent->start; b < (size_t)extent->start + extent->length; b++) {
+                fs_debug_use(unused, nblocks, b);
+            }
+            *extents += extent->start != last + 1;
+            last   = extent->start + extent->length - 1;
+            *count += extent->length;
+        }
+    }
+    printf("\n");
+
+    return true;
+}
+
+/**
+ * Mark a block reported by fs_debug as in use (ignoring blocks beyond the
+ * Disk).
+ *
+ * @param       unused      Blocks not yet seen in use.
+ * @param       nblocks     Number of blocks in unused.
+ * @param       block       Block in use.
+ **/
+void    fs_debug_use(uint64_t *unused, size_t nblocks, size_t block) {
+
+    if(block < nblocks) {
+        bitmap_clear(unused, block);
+    }
+}
+
+/**
+ * Report the number of extents (contiguous runs of data blocks) of an
+ * Inode for fs_debug.
+ *
+ * @param       count       Number of data blocks.
+ * @param       extents     Number of extents.
+ **/
+void    fs_debug_file(size_t count, size_t extents) {
+
+    if(count) {
+        printf("    %lu data blocks in %lu extents\n", count, extents);
+    }
+}
+
+/**
+ * Return the length of the longest run of set bits in a bitmap (the same
+ * runs fs_allocate_extent walks in the free block bitmap).
+ *
+ * @param       bitmap      Pointer to bitmap.
+ * @param       bits        Number of bits in bitmap.
+ * @param       runs        Set to number of runs.
+ * @return      Length of longest run (0 if no bits are set).
+ **/
+size_t  fs_largest_run(const uint64_t *bitmap, size_t bits, size_t *runs) {
+
+    size_t  largest = 0;
+    ssize_t run     = bitmap_find(bitmap, bits, 0);
+
+    *runs = 0;
+    while(run >= 0) {
+        size_t end = bitmap_find_clear(bitmap, bits, run);
+        largest = max(largest, end - run);
+        (*runs)++;
+        run = bitmap_find(bitmap, bits, end);
+    }
+
+    return largest;
+}
+
+/**
+ * Count the extents (contiguous runs) of a mapped range of file blocks.
+ *
+ * @param       blocks      Disk block of each file block (0 for holes).
+ * @param       count       Number of file blocks.
+ * @param       allocated   Set to number of file blocks that are not holes.
+ * @return      Number of runs.
+ **/
+size_t  fs_block_runs(const size_t *blocks, size_t count, size_t *allocated) {
+
+    size_t runs = 0;
+
+    *allocated = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(!blocks[i]) {
+            continue;
+        }
+
+        runs += i == 0 || blocks[i] != blocks[i - 1] + 1 || !blocks[i - 1];
+        (*allocated)++;
+    }
+
+    return runs;
+}
+
+/**
+ * Move a range of file blocks of the specified Inode into fewer extents
+ * (see fs_defrag) by doing the following:
+ *
+ *  1. Map the range and count its runs (nothing to do if it has one).
+ *
+ *  2. Allocate new runs for its data blocks, giving up if they are not
+ *  fewer than the old ones.
+ *
+ *  3. Copy the data with fs_defrag_copy and point the Inode copy and its
+ *  mapping blocks at the new blocks.
+ *
+ *  4. Write the mapping blocks and Inode block, then release the old data
+ *  blocks.
+ *
+ * Note: Caller must hold the Inode's lock for writing, and have written
+ * back the delayed allocation buffer of an open File.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to defragment.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       first           First file block in range.
+ * @param       count           Number of file blocks in range (not 0).
+ * @return      Number of data blocks moved (-1 on error).
+ **/
+ssize_t fs_defrag_range(FileSystem *fs, size_t inode_number, File *file, size_t first, size_t count) {
+
+    Inode  copy    = fs->inodes[inode_number];
+    Inode *inode   = &copy;
+    bool   extents = fs_has_extents(&fs->meta_data);
+    size_t base    = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+
+    BlockMap map    = {0};
+    Block    local;
+    Block   *eblock = NULL;
+
+    size_t  *old     = malloc(count * sizeof(size_t));
+    size_t  *new     = malloc(count * sizeof(size_t));
+    size_t  *starts  = malloc(count * sizeof(size_t));
+    size_t  *lengths = malloc(count * sizeof(size_t));
+    size_t   nruns   = 0;
+    size_t   got     = 0;
+    size_t   allocated;
+    ssize_t  result  = -1;
+
+    if(!old || !new || !starts || !lengths) {
+        goto done;
+    }
+
+    // Map the range through the extents or pointer blocks
+
+    if(extents) {
+        if(!(eblock = fs_load_indirect(fs, inode_number, file, &local))) {
+            goto done;
+        }
+        count = fs_extent_lookup(inode, eblock, first, min(count, fs_extent_blocks(inode, eblock)), old);
+    } else {
+        if(!fs_map_init(fs, &map, inode, inode_number, file, first, count)) {
+            goto done;
+        }
+
+        for(size_t n = first; n < first + count; n++) {
+            uint32_t *pointer = fs_map_pointer(fs, &map, n);
+            if(!pointer) {
+                goto done;
+            }
+            old[n - first] = *pointer;
+        }
+    }
+
+    size_t runs = fs_block_runs(old, count, &allocated);
+    if(runs <= 1) {
+        result = 0;
+        goto done;
+    }
+
+    // Allocate new runs (keeping the old layout unless it gets better)
+
+    while(got < allocated) {
+        size_t extent = fs_allocate_extent(fs, allocated - got, &starts[nruns]);
+        if(extent == 0) {
+            break;
+        }
+        lengths[nruns++] = extent;
+        got += extent;
+    }
+
+    if(got < allocated || nruns >= runs) {
+        result = 0;
+        goto done;
+    }
+
+    for(size_t r = 0, i = 0; r < nruns; r++) {
+        for(size_t b = starts[r]; b < starts[r] + lengths[r]; b++, i++) {
+            new[i] = b;
+        }
+    }
+
+    // Copy the data and repoint each file block that is not a hole
+
+    size_t *from = malloc(max(allocated, 1) * sizeof(size_t));
+    bool    copied = from != NULL;
+
+    for(size_t i = 0, j = 0; copied && i < count; i++) {
+        if(old[i]) {
+            from[j++] = old[i];
+        }
+    }
+
+    copied = copied && fs_defrag_copy(fs, from, new, allocated);
+    free(from);
+
+    if(!copied) {
+        goto done;
+    }
+
+    bool dirty = false;
+
+    if(extents) {
+        inode->nextents = 0;
+        for(size_t r = 0; r < nruns; r++) {
+            fs_extent_append(fs, inode, eblock, starts[r], lengths[r], &dirty);
+        }
+    } else {
+        for(size_t n = first, j = 0; n < first + count; n++) {
+            uint32_t *pointer = fs_map_pointer(fs, &map, n);
+            if(!*pointer) {
+                continue;
+            }
+
+            *pointer = new[j++];
+            if(n >= base) {
+                fs_map_dirty(fs, &map, n);
+            } else if(n >= POINTERS_PER_INODE) {
+                map.indirect_dirty = true;
+            }
+        }
+    }
+
+    // The new blocks are in use from here on, whether or not the mapping
+    // reaches Disk
+
+    nruns  = 0;
+    result = allocated;
+
+    if(extents && file) {
+        pthread_mutex_lock(&file->lock);
+        fs_file_dirty(fs, file, dirty, false);
+        pthread_mutex_unlock(&file->lock);
+    } else if(extents && dirty && !fs_meta_write(fs, inode->indirect, eblock->data)) {
+        result = -1;
+    } else if(!extents && !fs_map_flush(fs, &map)) {
+        result = -1;
+    }
+
+    // Unlike writes, open Files are flushed too, since the old blocks are
+    // freed once the Inode no longer points at them
+
+    pthread_mutex_lock(&fs->lock);
+    fs->inodes[inode_number] = copy;
+    fs_inode_dirty(fs, inode_number);
+    pthread_mutex_unlock(&fs->lock);
+
+    if(file && !fs_file_flush(fs, file)) {
+        result = -1;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    if(!fs_inode_flush(fs)) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    for(size_t i = 0; result >= 0 && i < count; i++) {
+        fs_release_block(fs, old[i]);
+    }
+
+done:
+    // Return new runs that were not used
+
+    for(size_t r = 0; r < nruns; r++) {
+        fs_release_run(fs, starts[r], lengths[r]);
+    }
+
+    fs_map_release(&map);
+    free(old);
+    free(new);
+    free(starts);
+    free(lengths);
+    return result;
+}
+
+/**
+ * Copy data blocks to new locations DEFRAG_BATCH at a time, with one
+ * vectored read and one vectored write per batch.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       from    Blocks to copy.
+ * @param       to      Block to copy each block to.
+ * @param       n       Number of blocks to copy.
+ * @return      Whether or not all blocks were copied.
+ **/
+bool    fs_defrag_copy(FileSystem *fs, const size_t *from, const size_t *to, size_t n) {
+
+    char  *buffer = malloc(DEFRAG_BATCH * BLOCK_SIZE);
+    char  *bufs[DEFRAG_BATCH];
+    bool   copied = buffer != NULL;
+
+    for(size_t b = 0; b < DEFRAG_BATCH; b++) {
+        bufs[b] = buffer + b * BLOCK_SIZE;
+    }
+
+    DiskClass class = disk_account_class(DISK_DATA);
+
+    for(size_t i = 0; copied && i < n; i += DEFRAG_BATCH) {
+        size_t batch = min(DEFRAG_BATCH, n - i);
+        copied = disk_readv(fs->disk, from + i, bufs, batch) != DISK_FAILURE &&
+                 disk_writev(fs->disk, to + i, bufs, batch) != DISK_FAILURE;
+    }
+
+    disk_account_class(class);
+    free(buffer);
+    return copied;
+}
+
+/**
+ * Read from the specified Inode (see fs_read) by doing the following:
+ *
+ *  1. Read the part of the range stored on Disk with fs_read_blocks.
+ *
+ *  2. Copy any overlapping bytes from the delayed allocation buffer of an
+ *  open File over it.
+ *
+ * Note: Caller must hold the Inode's lock for reading.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read (not 0).
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read_locked(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+
+    Inode *inode = &fs->inodes[inode_number];
+
+    if(inode->valid == 0) {
+       return -1;
+    } 
+
+    File  *file = fs_file(fs, inode_number);
+    size_t size = fs_file_size(inode, file);
+
+    if(offset >= size) {
+        return 0;
+    }
+
+    length = min(length, size - offset);
+
+    if(offset < inode->size && fs_read_blocks(fs, inode_number, file, data, min(length, inode->size - offset), offset) < 0) {
+        return -1;
+    }
+
+    // Buffered data starts at or before the Inode's size, so it covers the rest
+
+    if(file && file->pending_length) {
+        size_t start = max(offset, file->pending_offset);
+        size_t end   = min(offset + length, file->pending_offset + file->pending_length);
+        if(start < end) {
+            memcpy(data + start - offset, file->pending + start - file->pending_offset, end - start);
+        }
+    }
+
+    return length;
+}
+
+/**
+ * Read from the blocks of the specified Inode, ignoring any data buffered
+ * by an open File.
+ *
+ * Note: Caller must hold the Inode's lock for reading.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to read data from.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer to copy data to.
+ * @param       length          Number of bytes to read (not 0).
+ * @param       offset          Byte offset from which to begin reading.
+ * @return      Number of bytes read (-1 on error).
+ **/
+ssize_t fs_read_blocks(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    Inode *inode = &fs->inodes[inode_number];
+
+    if(offset >= inode->size) {
+        return 0;
+    }
+
+    // Reset length if trying to read too much
+
+    if(length + offset > inode->size) {
+        length = inode->size - offset;
+    }
+
+    if(fs_is_inline(&fs->meta_data, inode)) {
+        memcpy(data, inode->inline_data + offset, length);
+        return length;
+    }
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t count = (offset + length - 1) / BLOCK_SIZE - first + 1;
+
+    // Map and read data blocks (full blocks directly into buffer, holes are
+    // zero filled without touching the disk)
+
+    size_t *blocks = malloc(count * sizeof(size_t));
+    char  **bufs   = malloc(count * sizeof(char *));
+    size_t  byte_start = offset % BLOCK_SIZE;
+    ssize_t result = -1;
+    Block   head;
+    Block   tail;
+
+    if(blocks && bufs && fs_map_blocks(fs, inode, inode_number, file, first, count, blocks) == count) {
+
+        if(file) {
+            fs_readahead(fs, file, offset, length);
+        }
+
+        fs_buffers(bufs, count, data, length, byte_start, &head, &tail);
+
+        bool   use_head = bufs[0] == head.data;
+        bool   use_tail = count > 1 && bufs[count - 1] == tail.data;
+        size_t nread    = fs_holes(blocks, bufs, count);
+
+        DiskClass class = disk_account_class(DISK_DATA);
+        bool      read  = disk_readv(fs->disk, blocks, bufs, nread) != DISK_FAILURE;
+        disk_account_class(class);
+
+        if(read) {
+            if(use_head) {
+                memcpy(data, head.data + byte_start, min(length, BLOCK_SIZE - byte_start));
+            }
+            if(use_tail) {
+                size_t start = (count - 1) * BLOCK_SIZE - byte_start;
+                memcpy(data + start, tail.data, length - start);
+            }
+            result = length;
+        }
+    }
+
+    free(blocks);
+    free(bufs);
+    return result;
+}
+
+/**
+ * Write to the specified Inode (see fs_write) by doing the following:
+ *
+ *  1. Write directly with fs_write_blocks if the Inode is not open.
+ *
+ *  2. Append to the open File's delayed allocation buffer if the write
+ *  continues the buffered data and fits.
+ *
+ *  3. Otherwise write back the buffer and start a new one at this write,
+ *  unless the write is too large to buffer or would leave a hole.
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_locked(FileSystem *fs, size_t inode_number, char *data, size_t length, size_t offset) {
+
+    Inode *inode = &fs->inodes[inode_number];
+    File  *file  = fs_file(fs, inode_number);
+
+    if(inode->valid == 0) {
+       return -1;
+    } 
+
+    if(!file) {
+        return fs_write_blocks(fs, inode_number, NULL, data, length, offset);
+    }
+
+    // Reset length if trying to write too much
+
+    size_t max_size = fs_max_size(fs);
+    if(offset >= max_size) {
+        return 0;
+    }
+
+    if(length + offset > max_size) {
+        length = max_size - offset;
+    }
+
+    size_t capacity = DELALLOC_MAX * BLOCK_SIZE;
+    bool   extends  = file->pending_length &&
+                      offset == file->pending_offset + file->pending_length &&
+                      file->pending_length + length <= capacity;
+
+    if(!extends && !fs_file_writeback(fs, file)) {
+        return -1;
+    }
+
+    if(!extends && (length >= capacity || offset > inode->size)) {
+        return fs_write_blocks(fs, inode_number, file, data, length, offset);
+    }
+
+    if(!file->pending && !(file->pending = malloc(capacity))) {
+        return fs_write_blocks(fs, inode_number, file, data, length, offset);
+    }
+
+    if(!extends) {
+        file->pending_offset = offset;
+    }
+
+    memcpy(file->pending + file->pending_length, data, length);
+    file->pending_length += length;
+    return length;
+}
+
+/**
+ * Write to the blocks of the specified Inode, ignoring the delayed
+ * allocation buffer, by doing the following:
+ *
+ *  1. Clamp the write to the largest file size.
+ *
+ *  2. Write inline Inodes with fs_write_inline.
+ *
+ *  3. Otherwise write through the Inode's extents or pointers, allocating
+ *  any blocks that are missing.
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_blocks(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    Inode *inode = &fs->inodes[inode_number];
+
+    if(inode->valid == 0) {
+       return -1;
+    } 
+
+    // Reset length if trying to write too much
+
+    size_t max_size = fs_max_size(fs);
+    if(offset >= max_size) {
+        return 0;
+    }
+
+    if(length + offset > max_size) {
+        length = max_size - offset;
+    }
+
+    if(fs_is_inline(&fs->meta_data, inode)) {
+        return fs_write_inline(fs, inode_number, file, data, length, offset);
+    }
+
+    return fs_write_layout(fs, inode_number, file, data, length, offset);
+}
+
+/**
+ * Write through the extents or pointers of the specified Inode (see
+ * fs_write_blocks).
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0, clamped).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_layout(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    if(fs_has_extents(&fs->meta_data)) {
+        return fs_write_extents(fs, inode_number, file, data, length, offset);
+    }
+
+    return fs_write_pointers(fs, inode_number, file, data, length, offset);
+}
+
+/**
+ * Write to the pointer mapped blocks of the specified Inode, allocating
+ * any that are missing (in sparse mode, missing blocks the write leaves all
+ * zero stay holes).
+ *
+ * The Inode is updated in a private copy that is published to the Inode
+ * table under the FileSystem lock, so concurrent Inode table flushes never
+ * see it half written.
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0, clamped).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_pointers(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    Inode  copy  = fs->inodes[inode_number];
+    Inode *inode = &copy;
+
+    size_t first = offset / BLOCK_SIZE;
+    size_t count = (offset + length - 1) / BLOCK_SIZE - first + 1;
+
+    // Load mapping blocks if the range reaches them
+
+    BlockMap map;
+    size_t   base = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+
+    if(!fs_map_init(fs, &map, inode, inode_number, file, first, count)) {
+        fs_map_release(&map);
+        return -1;
+    }
+
+    // Preallocate unallocated data and mapping blocks as contiguous extents
+
+    size_t needed = (first + count > POINTERS_PER_INODE && !inode->indirect) ? 1 : 0;
+    if(first + count > base && !map.indirect->pointers[DINDIRECT_POINTER]) {
+        needed++;
+    }
+
+    for(size_t l = 0; l < map.nleaves; l++) {
+        needed += !map.dindirect->pointers[map.first_leaf + l];
+    }
+
+    size_t byte_start = offset % BLOCK_SIZE;
+
+    for(size_t n = first; n < first + count; n++) {
+        uint32_t *pointer = fs_map_pointer(fs, &map, n);
+        if(!pointer) {
+            fs_map_release(&map);
+            return -1;
+        }
+        needed += !*pointer && !fs_sparse_hole(fs, data, length, byte_start, n - first);
+    }
+
+    uint32_t *reserved  = malloc(max(needed, 1) * sizeof(uint32_t));
+    size_t   *blocks    = malloc(count * sizeof(size_t));
+    char    **bufs      = malloc(count * sizeof(char *));
+    bool     *fresh     = calloc(count, sizeof(bool));
+    size_t    nreserved = 0;
+    size_t    nused     = 0;
+    size_t    nmapped   = 0;
+    ssize_t   result    = -1;
+
+    if(!reserved || !blocks || !bufs || !fresh) {
+        goto done;
+    }
+
+    while(nreserved < needed) {
+        size_t start;
+        size_t extent = fs_allocate_extent(fs, needed - nreserved, &start);
+        if(extent == 0) {
+            break;
+        }
+        for(size_t b = start; b < start + extent; b++) {
+            reserved[nreserved++] = b;
+        }
+    }
+
+    // Map blocks, assigning reserved blocks to holes (stop if disk is full)
+    // unless a sparse write can leave them unallocated
+
+    for(size_t n = first; n < first + count; n++, nmapped++) {
+
+        if(n >= POINTERS_PER_INODE && !inode->indirect) {
+            if(nused == nreserved) {
+                break;
+            }
+            inode->indirect = reserved[nused++];
+            map.indirect_dirty = true;
+        }
+
+        if(n >= base && !map.indirect->pointers[DINDIRECT_POINTER]) {
+            if(nused == nreserved) {
+                break;
+            }
+            map.indirect->pointers[DINDIRECT_POINTER] = reserved[nused++];
+            map.indirect_dirty  = true;
+            map.dindirect_dirty = true;
+        }
+
+        // New leaves are loaded (as zeroes) before they get a block
+
+        size_t leaf = n >= base ? (n - base) / POINTERS_PER_BLOCK : 0;
+        if(n >= base && !map.dindirect->pointers[leaf]) {
+            if(nused == nreserved || !fs_map_leaf(fs, &map, leaf)) {
+                break;
+            }
+            map.dindirect->pointers[leaf] = reserved[nused++];
+            map.dindirect_dirty = true;
+            fs_map_dirty(fs, &map, n);
+        }
+
+        uint32_t *pointer = fs_map_pointer(fs, &map, n);
+
+        if(!*pointer) {
+            if(fs_sparse_hole(fs, data, length, byte_start, nmapped)) {
+                blocks[nmapped] = 0;
+                fresh[nmapped]  = true;
+                continue;
+            }
+
+            if(nused == nreserved) {
+                break;
+            }
+            *pointer = reserved[nused++];
+            fresh[nmapped] = true;
+
+            if(n >= base) {
+                fs_map_dirty(fs, &map, n);
+            } else if(n >= POINTERS_PER_INODE) {
+                map.indirect_dirty = true;
+            }
+        }
+
+        blocks[nmapped] = *pointer;
+    }
+
+    size_t b_write = min(length, nmapped * BLOCK_SIZE - byte_start);
+
+    if(nmapped == 0) {
+        result = 0;
+        goto done;
+    }
+
+    if(!fs_write_mapped(fs, blocks, bufs, fresh, nmapped, data, b_write, byte_start)) {
+        goto done;
+    }
+
+    // Update original inode, indirect block, and inode table
+
+    inode->size = max(inode->size, offset + b_write);
+    result = b_write;
+
+done:
+    // Return unused reservations
+
+    while(nused < nreserved) {
+        fs_release_block(fs, reserved[nused++]);
+    }
+
+    // Open files defer indirect blocks and inode table updates to fs_close
+
+    if(!fs_map_flush(fs, &map)) {
+        result = -1;
+    }
+    fs_map_release(&map);
+
+    pthread_mutex_lock(&fs->lock);
+    fs->inodes[inode_number] = copy;
+    fs_inode_dirty(fs, inode_number);
+
+    if(!file && !fs_inode_flush(fs)) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    free(reserved);
+    free(blocks);
+    free(bufs);
+    free(fresh);
+    return result;
+}
+
+/**
+ * Write to an inline Inode by doing the following:
+ *
+ *  1. Copy the data into the Inode if the file still fits, and write its
+ *  Inode block (deferred to fs_close if the Inode is open).
+ *
+ *  2. Otherwise move the inline bytes to the first data block, along with
+ *  the part of the write that falls in it, then write the rest.
+ *
+ *  3. Release any blocks just allocated and keep the data inline if none
+ *  of the caller's bytes were written.
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0, clamped).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_inline(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    Inode *inode = &fs->inodes[inode_number];
+    size_t end   = offset + length;
+
+    if(end <= INLINE_MAX) {
+        pthread_mutex_lock(&fs->lock);
+        memcpy(inode->inline_data + offset, data, length);
+        inode->size = max(inode->size, end);
+        fs_inode_dirty(fs, inode_number);
+
+        bool flushed = file || fs_inode_flush(fs);
+        pthread_mutex_unlock(&fs->lock);
+        return flushed ? (ssize_t)length : -1;
+    }
+
+    // Clear the inline bytes so the Inode maps blocks again
+
+    Inode   saved  = *inode;
+    size_t  head   = min(end, BLOCK_SIZE);
+    size_t  inhead = offset < head ? head - offset : 0;
+    Block   first;
+    ssize_t result = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    memset(inode->inline_data, 0, INLINE_MAX);
+    pthread_mutex_unlock(&fs->lock);
+
+    if(saved.size == 0) {
+        result = fs_write_layout(fs, inode_number, file, data, length, offset);
+    } else {
+        memset(first.data, 0, head);
+        memcpy(first.data, saved.inline_data, saved.size);
+        if(inhead) {
+            memcpy(first.data + offset, data, inhead);
+        }
+
+        result = fs_write_layout(fs, inode_number, file, first.data, head, 0) == (ssize_t)head ? (ssize_t)inhead : -1;
+
+        if(result >= 0 && end > head) {
+            ssize_t rest = fs_write_layout(fs, inode_number, file, data + inhead, length - inhead, offset + inhead);
+            result = rest > 0 ? result + rest : inhead ? result : rest;
+        }
+    }
+
+    // Keep the data inline if none of it could be written
+
+    if(result <= 0 && !fs_release_inode(fs, inode_number, file)) {
+        result = -1;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    if(result <= 0) {
+        *inode = saved;
+        if(file) {
+            fs_file_forget(fs, file);
+        }
+        fs_inode_dirty(fs, inode_number);
+        if(!file && !fs_inode_flush(fs)) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    return result;
+}
+
+/**
+ * Write a byte range to the disk blocks mapped for it by doing the
+ * following:
+ *
+ *  1. Fill partially overwritten blocks with their current contents (or
+ *  zeroes if they were just allocated).
+ *
+ *  2. Write every block that is not a hole in one vectored request.
+ *
+ * Note: Holes (blocks mapped to 0) are dropped from blocks and bufs.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       blocks      Disk block of each block in range (0 for holes).
+ * @param       bufs        Buffers to use (one per block).
+ * @param       fresh       Whether or not each block was just allocated.
+ * @param       nmapped     Number of blocks in range (not 0).
+ * @param       data        Buffer with data to copy.
+ * @param       length      Number of bytes in range.
+ * @param       byte_start  Offset of range within its first block.
+ * @return      Whether or not the range was written.
+ **/
+bool    fs_write_mapped(FileSystem *fs, size_t *blocks, char **bufs, bool *fresh, size_t nmapped, char *data, size_t length, size_t byte_start) {
+
+    // Fill partially overwritten blocks with their current contents (full
+    // blocks are written directly from buffer)
+
+    Block  head;
+    Block  tail;
+    size_t last = nmapped - 1;
+    size_t partial[2];
+    char  *partial_bufs[2];
+    size_t npartial = 0;
+
+    fs_buffers(bufs, nmapped, data, length, byte_start, &head, &tail);
+
+    for(size_t i = 0; i < nmapped; i += max(last, 1)) {
+        if(bufs[i] != head.data && bufs[i] != tail.data) {
+            continue;
+        }
+
+        if(fresh[i]) {
+            memset(bufs[i], 0, BLOCK_SIZE);
+        } else {
+            partial[npartial] = blocks[i];
+            partial_bufs[npartial++] = bufs[i];
+        }
+    }
+
+    DiskClass class   = disk_account_class(DISK_DATA);
+    bool      written = disk_readv(fs->disk, partial, partial_bufs, npartial) != DISK_FAILURE;
+
+    if(written && bufs[0] == head.data) {
+        memcpy(head.data + byte_start, data, min(length, BLOCK_SIZE - byte_start));
+    }
+
+    if(written && last > 0 && bufs[last] == tail.data) {
+        size_t start = last * BLOCK_SIZE - byte_start;
+        memcpy(tail.data, data + start, length - start);
+    }
+
+    // Holes left by a sparse write have nothing to write
+
+    size_t nwrite = 0;
+    for(size_t i = 0; i < nmapped; i++) {
+        if(blocks[i]) {
+            blocks[nwrite] = blocks[i];
+            bufs[nwrite++] = bufs[i];
+        }
+    }
+
+    written = written && disk_writev(fs->disk, blocks, bufs, nwrite) != DISK_FAILURE;
+    disk_account_class(class);
+    return written;
+}
+
+/**
+ * Return pointer to specified Inode in the resident Inode table.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to look up.
+ * @return      Pointer to Inode (NULL if not mounted or out of range).
+ **/
+Inode * fs_inode(FileSystem *fs, size_t inode_number) {
+
+    if(!fs->disk || inode_number >= fs->meta_data.inodes) {
+        return NULL;
+    }
+
+    return &fs->inodes[inode_number];
+}
+
+/**
+ * Lock specified Inode for reading or writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to lock.
+ * @param       write           Whether to lock for writing (else reading).
+ * @return      Pointer to locked Inode (NULL if not mounted or out of range).
+ **/
+Inode * fs_inode_lock(FileSystem *fs, size_t inode_number, bool write) {
+
+    Inode *inode = fs_inode(fs, inode_number);
+
+    if(inode && write) {
+        pthread_rwlock_wrlock(&fs->inode_locks[inode_number]);
+    } else if(inode) {
+        pthread_rwlock_rdlock(&fs->inode_locks[inode_number]);
+    }
+
+    return inode;
+}
+
+/**
+ * Unlock specified Inode locked by fs_inode_lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to unlock.
+ **/
+void    fs_inode_unlock(FileSystem *fs, size_t inode_number) {
+    pthread_rwlock_unlock(&fs->inode_locks[inode_number]);
+}
+
+/**
+ * Thread entry point for fs_mount_scan.
+ *
+ * @param       arg     Pointer to MountWorker structure.
+ * @return      NULL.
+ **/
+void *  fs_mount_worker(void *arg) {
+    fs_mount_scan(arg);
+    return NULL;
+}
+
+/**
+ * Scan a range of Inode blocks during mount by doing the following:
+ *
+ *  1. Read the Inode blocks into the resident Inode table with one vectored
+ *  request and mark invalid Inodes as free.
+ *
+ *  2. Mark direct and indirect blocks (or extents) of valid Inodes as used.
+ *
+ *  3. Read indirect blocks MOUNT_BATCH at a time and mark the data blocks
+ *  they point to as used (and the blocks reached through their double
+ *  indirect blocks, or the extents of extent blocks).
+ *
+ * Only step 1 is done if the worker is not asked to scan.
+ *
+ * @param       w       Pointer to MountWorker structure.
+ * @return      Whether or not the scan succeeded (also stored in worker).
+ **/
+bool    fs_mount_scan(MountWorker *w) {
+
+    size_t  blocks  = w->disk->blocks;
+    size_t  count   = w->last - w->first;
+    size_t *numbers = malloc(max(count, MOUNT_BATCH) * sizeof(size_t));
+    char  **bufs    = malloc(max(count, MOUNT_BATCH) * sizeof(char *));
+    Block  *ind     = malloc(MOUNT_BATCH * sizeof(Block));
+
+    w->success = numbers && bufs && ind;
+
+    // Read Inode blocks
+
+    for(size_t q = 0; w->success && q < count; q++) {
+        numbers[q] = w->first + q + 1;
+        bufs[q]    = (char *)(w->inodes + (w->first + q) * INODES_PER_BLOCK);
+    }
+
+    w->success = w->success && disk_readv(w->disk, numbers, bufs, count) != DISK_FAILURE;
+
+    for(size_t i = 0; w->success && i < count * INODES_PER_BLOCK; i++) {
+        if(w->inodes[w->first * INODES_PER_BLOCK + i].valid == 0) {
+            bitmap_set(w->free_inodes, w->first * INODES_PER_BLOCK + i);
+        }
+    }
+
+    if(!w->scan) {
+        free(numbers);
+        free(bufs);
+        free(ind);
+        return w->success;
+    }
+
+    // Check Direct pointers, batching Indirect blocks
+
+    Inode *table = w->inodes + w->first * INODES_PER_BLOCK;
+    size_t owners[MOUNT_BATCH];
+    size_t pending = 0;
+
+    for(size_t i = 0; w->success && i <= count * INODES_PER_BLOCK; i++) {
+
+        bool last = i == count * INODES_PER_BLOCK;
+
+        if(!last && table[i].valid == 1 && !(w->inline_data && table[i].size <= INLINE_MAX)) {
+            if(w->extents) {
+                fs_mount_extents(w, table[i].extents, min(table[i].nextents, EXTENTS_PER_INODE));
+            }
+
+            for(int q = 0; !w->extents && q < POINTERS_PER_INODE; q++) {
+                if(table[i].direct[q] < blocks) {
+                    bitmap_set(w->used, table[i].direct[q]);
+                }
+            }
+
+            if(table[i].indirect && table[i].indirect < blocks) {
+                bitmap_set(w->used, table[i].indirect);
+                numbers[pending] = table[i].indirect;
+                bufs[pending]    = ind[pending].data;
+                owners[pending]  = i;
+                pending++;
+            }
+        }
+
+        // Check Indirect pointers
+
+        if(pending == MOUNT_BATCH || (last && pending)) {
+            if(disk_readv(w->disk, numbers, bufs, pending) == DISK_FAILURE) {
+                w->success = false;
+                break;
+            }
+
+            for(size_t b = 0; w->extents && b < pending; b++) {
+                size_t nextents = table[owners[b]].nextents;
+                if(nextents > EXTENTS_PER_INODE) {
+                    fs_mount_extents(w, ind[b].extents, min(nextents - EXTENTS_PER_INODE, EXTENTS_PER_BLOCK));
+                }
+            }
+
+            for(size_t b = 0; !w->extents && b < pending; b++) {
+                for(int q = 0; q < POINTERS_PER_BLOCK; q++) {
+                    if(ind[b].pointers[q] < blocks) {
+                        bitmap_set(w->used, ind[b].pointers[q]);
+                    }
+                }
+            }
+
+            if(w->dindirect && !fs_mount_dindirect(w, ind, pending)) {
+                w->success = false;
+                break;
+            }
+
+            pending = 0;
+        }
+    }
+
+    free(numbers);
+    free(bufs);
+    free(ind);
+    return w->success;
+}
+
+/**
+ * Mark the blocks of a list of extents as used.
+ *
+ * @param       w           Pointer to MountWorker structure.
+ * @param       extents     Extents to mark.
+ * @param       n           Number of extents.
+ **/
+void    fs_mount_extents(MountWorker *w, Extent *extents, size_t n) {
+
+    size_t blocks = w->disk->blocks;
+
+    for(size_t i = 0; i < n; i++) {
+        for(size_t b = extents[i].start; b < (size_t)extents[i].start + extents[i].length && b < blocks; b++) {
+            bitmap_set(w->used, b);
+        }
+    }
+}
+
+/**
+ * Mark blocks reached through the double indirect blocks of a batch of
+ * indirect blocks as used by doing the following:
+ *
+ *  1. Read the double indirect blocks of the batch with one vectored
+ *  request and mark the leaves they point to as used.
+ *
+ *  2. Read the leaves of each double indirect block MOUNT_BATCH at a time
+ *  and mark the data blocks they point to as used.
+ *
+ * Note: The indirect blocks in ind are overwritten with leaves.
+ *
+ * @param       w       Pointer to MountWorker structure.
+ * @param       ind     Batch of indirect blocks (room for MOUNT_BATCH).
+ * @param       n       Number of indirect blocks in batch.
+ * @return      Whether or not all blocks could be read.
+ **/
+bool    fs_mount_dindirect(MountWorker *w, Block *ind, size_t n) {
+
+    size_t  blocks = w->disk->blocks;
+    size_t  numbers[MOUNT_BATCH];
+    char   *bufs[MOUNT_BATCH];
+    Block  *dind   = malloc(MOUNT_BATCH * sizeof(Block));
+    size_t  ndind  = 0;
+    bool    success = dind != NULL;
+
+    for(size_t b = 0; success && b < n; b++) {
+        uint32_t pointer = ind[b].pointers[DINDIRECT_POINTER];
+        if(pointer && pointer < blocks) {
+            numbers[ndind] = pointer;
+            bufs[ndind]    = dind[ndind].data;
+            ndind++;
+        }
+    }
+
+    success = success && disk_readv(w->disk, numbers, bufs, ndind) != DISK_FAILURE;
+
+    for(size_t d = 0; success && d < ndind; d++) {
+        size_t pending = 0;
+
+        for(size_t q = 0; success && q <= POINTERS_PER_BLOCK; q++) {
+            uint32_t pointer = q < POINTERS_PER_BLOCK ? dind[d].pointers[q] : 0;
+
+            if(pointer && pointer < blocks) {
+                bitmap_set(w->used, pointer);
+                numbers[pending] = pointer;
+                bufs[pending]    = ind[pending].data;
+                pending++;
+            }
+
+            if(pending == MOUNT_BATCH || (q == POINTERS_PER_BLOCK && pending)) {
+                success = disk_readv(w->disk, numbers, bufs, pending) != DISK_FAILURE;
+
+                for(size_t l = 0; success && l < pending; l++) {
+                    for(int p = 0; p < POINTERS_PER_BLOCK; p++) {
+                        if(ind[l].pointers[p] < blocks) {
+                            bitmap_set(w->used, ind[l].pointers[p]);
+                        }
+                    }
+                }
+
+                pending = 0;
+            }
+        }
+    }
+
+    free(dind);
+    return success;
+}
+
+/**
+ * Load free blocks bitmap stored after the Inode table with one vectored
+ * request.
+ *
+ * @param       disk    Pointer to Disk structure.
+ * @param       super   Pointer to SuperBlock of image.
+ * @param       bitmap  Bitmap to load (BITMAP_WORDS(blocks) words).
+ * @return      Whether or not the bitmap was loaded.
+ **/
+bool    fs_bitmap_load(Disk *disk, SuperBlock *super, uint64_t *bitmap) {
+
+    size_t  n      = super->bitmap_blocks;
+    char   *buffer = malloc(n * BLOCK_SIZE);
+    size_t *blocks = malloc(n * sizeof(size_t));
+    char  **bufs   = malloc(n * sizeof(char *));
+    bool    loaded = buffer && blocks && bufs;
+
+    for(size_t b = 0; loaded && b < n; b++) {
+        blocks[b] = 1 + super->inode_blocks + b;
+        bufs[b]   = buffer + b * BLOCK_SIZE;
+    }
+
+    if(loaded && disk_readv(disk, blocks, bufs, n) != DISK_FAILURE) {
+        size_t words = BITMAP_WORDS(super->blocks);
+        memcpy(bitmap, buffer, words * sizeof(uint64_t));
+
+        if(super->blocks % BITS_PER_WORD) {
+            bitmap[words - 1] &= (UINT64_C(1) << (super->blocks % BITS_PER_WORD)) - 1;
+        }
+    } else {
+        loaded = false;
+    }
+
+    free(buffer);
+    free(blocks);
+    free(bufs);
+    return loaded;
+}
+
+/**
+ * Store free blocks bitmap in the blocks after the Inode table with one
+ * vectored request.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the bitmap was stored.
+ **/
+bool    fs_bitmap_store(FileSystem *fs) {
+
+    SuperBlock *super  = &fs->meta_data;
+    size_t      n      = super->bitmap_blocks;
+    char       *buffer = calloc(n, BLOCK_SIZE);
+    size_t     *blocks = malloc(n * sizeof(size_t));
+    char      **bufs   = malloc(n * sizeof(char *));
+    bool        stored = buffer && blocks && bufs;
+
+    if(stored) {
+        memcpy(buffer, fs->free_blocks, BITMAP_WORDS(super->blocks) * sizeof(uint64_t));
+
+        for(size_t b = 0; b < n; b++) {
+            blocks[b] = 1 + super->inode_blocks + b;
+            bufs[b]   = buffer + b * BLOCK_SIZE;
+        }
+
+        stored = disk_writev(fs->disk, blocks, bufs, n) != DISK_FAILURE;
+    }
+
+    free(buffer);
+    free(blocks);
+    free(bufs);
+    return stored;
+}
+
+/**
+ * Write SuperBlock to block 0 of Disk.
+ *
+ * @param       disk    Pointer to Disk structure.
+ * @param       super   Pointer to SuperBlock to write.
+ * @return      Whether or not the SuperBlock was written.
+ **/
+bool    fs_super_write(Disk *disk, SuperBlock *super) {
+
+    Block block;
+    memset(block.data, 0, BLOCK_SIZE);
+    block.super = *super;
+
+    return disk_write(disk, 0, block.data) != DISK_FAILURE;
+}
+
+/**
+ * Read the checksum table stored after the journal into memory.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       super       Pointer to SuperBlock of file system.
+ * @param       checksums   Buffer of checksum_blocks blocks to fill.
+ * @return      Whether or not the checksum table was read.
+ **/
+bool    fs_checksum_load(Disk *disk, SuperBlock *super, uint32_t *checksums) {
+
+    size_t  n      = super->checksum_blocks;
+    size_t *blocks = malloc(n * sizeof(size_t));
+    char  **bufs   = malloc(n * sizeof(char *));
+    bool    loaded = blocks && bufs;
+
+    for(size_t b = 0; loaded && b < n; b++) {
+        blocks[b] = 1 + super->inode_blocks + super->bitmap_blocks + super->journal_blocks + b;
+        bufs[b]   = (char *)checksums + b * BLOCK_SIZE;
+    }
+
+    loaded = loaded && disk_readv(disk, blocks, bufs, n) != DISK_FAILURE;
+
+    free(blocks);
+    free(bufs);
+    return loaded;
+}
+
+/**
+ * Write the in-memory checksum table to the blocks after the journal by
+ * doing the following:
+ *
+ *  1. Detach the table from the Disk, so writing it does not change it.
+ *
+ *  2. Clear the entries of the SuperBlock and of the table itself (both are
+ *  read before the table is attached on mount).
+ *
+ *  3. Write the table.
+ *
+ * Note: Caller must store every other block first (the table is not
+ * updated any more once detached).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not the checksum table was written.
+ **/
+bool    fs_checksum_store(FileSystem *fs) {
+
+    SuperBlock *super = &fs->meta_data;
+    if(!fs->checksums) {
+        return true;
+    }
+
+    disk_checksums(fs->disk, NULL, false);
+
+    size_t  n      = super->checksum_blocks;
+    size_t  start  = 1 + super->inode_blocks + super->bitmap_blocks + super->journal_blocks;
+    size_t *blocks = malloc(n * sizeof(size_t));
+    char  **bufs   = malloc(n * sizeof(char *));
+    bool    stored = blocks && bufs;
+
+    fs->checksums[0] = 0;
+    memset(fs->checksums + start, 0, n * sizeof(uint32_t));
+
+    for(size_t b = 0; stored && b < n; b++) {
+        blocks[b] = start + b;
+        bufs[b]   = (char *)fs->checksums + b * BLOCK_SIZE;
+    }
+
+    stored = stored && disk_writev(fs->disk, blocks, bufs, n) != DISK_FAILURE;
+
+    free(blocks);
+    free(bufs);
+    return stored;
+}
+
+/**
+ * Mark the Inode block holding specified Inode as dirty.
+ *
+ * Note: Caller must hold FileSystem lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode that was modified.
+ **/
+void    fs_inode_dirty(FileSystem *fs, size_t inode_number) {
+    fs->dirty_inodes[inode_number / INODES_PER_BLOCK] = true;
+}
+
+/**
+ * Write every dirty Inode block in the resident Inode table to Disk (see
+ * fs_meta_write).
+ *
+ * Note: Caller must hold FileSystem lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not all dirty Inode blocks were written.
+ **/
+bool    fs_inode_flush(FileSystem *fs) {
+
+    for(uint32_t q = 0; q < fs->meta_data.inode_blocks; q++) {
+
+        if(!fs->dirty_inodes[q]) {
+            continue;
+        }
+
+        if(!fs_meta_write(fs, q + 1, (char *)(fs->inodes + q * INODES_PER_BLOCK))) {
+            return false;
+        }
+
+        fs->dirty_inodes[q] = false;
+    }
+
+    return true;
+}
+
+/**
+ * Return open File for specified Inode.
+ *
+ * Note: The File stays open while the caller holds the Inode's lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to look up.
+ * @return      Pointer to open File (NULL if Inode is not open).
+ **/
+File *  fs_file(FileSystem *fs, size_t inode_number) {
+
+    pthread_mutex_lock(&fs->lock);
+    File *file = fs_file_find(fs, inode_number);
+    pthread_mutex_unlock(&fs->lock);
+    return file;
+}
+
+/**
+ * Search open File list for specified Inode.
+ *
+ * Note: Caller must hold FileSystem lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to look up.
+ * @return      Pointer to open File (NULL if Inode is not open).
+ **/
+File *  fs_file_find(FileSystem *fs, size_t inode_number) {
+
+    for(File *file = fs->files; file; file = file->next) {
+        if(file->inode_number == inode_number) {
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return size of specified Inode including data buffered by its open File.
+ *
+ * Note: Caller must hold the Inode's lock.
+ *
+ * @param       inode   Pointer to Inode.
+ * @param       file    Open File of Inode (NULL if not open).
+ * @return      Size of file in bytes.
+ **/
+size_t  fs_file_size(Inode *inode, File *file) {
+
+    if(!file || !file->pending_length) {
+        return inode->size;
+    }
+
+    return max(inode->size, file->pending_offset + file->pending_length);
+}
+
+/**
+ * Write back the delayed allocation buffer of an open File, allocating
+ * blocks for the buffered range as contiguous extents.
+ *
+ * The buffer is empty while its blocks are written, and afterwards only
+ * the written prefix is dropped, so data that failed to write stays
+ * buffered for a later fs_sync or fs_close to retry.
+ *
+ * Note: Caller must hold the Inode's lock for writing, but not the
+ * FileSystem lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Pointer to open File.
+ * @return      Whether or not all buffered data was written.
+ **/
+bool    fs_file_writeback(FileSystem *fs, File *file) {
+
+    size_t length = file->pending_length;
+
+    if(length == 0) {
+        return true;
+    }
+
+    file->pending_length = 0;
+    ssize_t written = fs_write_blocks(fs, file->inode_number, file, file->pending, length, file->pending_offset);
+
+    if(written == (ssize_t)length) {
+        return true;
+    }
+
+    if(written > 0) {
+        memmove(file->pending, file->pending + written, length - written);
+        file->pending_offset += written;
+        length -= written;
+    }
+
+    file->pending_length = length;
+    return false;
+}
+
+/**
+ * Write resident indirect and double indirect blocks of open File to Disk
+ * if they are dirty.
+ *
+ * Note: Caller must hold the Inode's lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Pointer to open File.
+ * @return      Whether or not the indirect blocks were written (if needed).
+ **/
+bool    fs_file_flush(FileSystem *fs, File *file) {
+
+    Inode *inode   = &fs->inodes[file->inode_number];
+    bool   flushed = true;
+
+    size_t staged  = 0;
+
+    pthread_mutex_lock(&file->lock);
+    if(file->ddirty) {
+        flushed = fs_meta_write(fs, file->indirect.pointers[DINDIRECT_POINTER], file->dindirect.data);
+        file->ddirty = !flushed;
+        staged += flushed;
+    }
+
+    if(flushed && file->dirty) {
+        flushed = fs_meta_write(fs, inode->indirect, file->indirect.data);
+        file->dirty = !flushed;
+        staged += flushed;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    fs_journal_reserve(fs->journal, -(ssize_t)staged);
+    return flushed;
+}
+
+/**
+ * Mark resident mapping blocks of open File dirty.  With FS_FEATURE_JOURNAL,
+ * each block that was clean is reserved in the running transaction, so
+ * operations that only dirty open Files still make it commit (the blocks
+ * are staged when the File is flushed).
+ *
+ * Note: Caller must hold the File's lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Pointer to open File.
+ * @param       dirty   Whether or not the indirect block was modified.
+ * @param       ddirty  Whether or not the double indirect block was modified.
+ **/
+void    fs_file_dirty(FileSystem *fs, File *file, bool dirty, bool ddirty) {
+
+    size_t added = (dirty && !file->dirty) + (ddirty && !file->ddirty);
+
+    file->dirty  |= dirty;
+    file->ddirty |= ddirty;
+    fs_journal_reserve(fs->journal, added);
+}
+
+/**
+ * Forget resident mapping blocks and buffered data of open File whose
+ * Inode was removed (dropping what it reserved in the running transaction).
+ *
+ * Note: Caller must hold FileSystem lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Pointer to open File.
+ **/
+void    fs_file_forget(FileSystem *fs, File *file) {
+
+    fs_journal_reserve(fs->journal, -(ssize_t)(file->dirty + file->ddirty));
+
+    file->loaded         = false;
+    file->dirty          = false;
+    file->dloaded        = false;
+    file->ddirty         = false;
+    file->leaf_index     = 0;
+    file->ra_offset      = 0;
+    file->ra_window      = 0;
+    file->pending_length = 0;
+}
+
+/**
+ * Load indirect block of specified Inode by doing the following:
+ *
+ *  1. Return the resident copy if the Inode is open and it is loaded.
+ *
+ *  2. Otherwise read it from Disk (or zero it if the Inode has none yet)
+ *  into the open File, or into local if the Inode is not open.
+ *
+ * Note: Caller must hold the Inode's lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode whose indirect block to load.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       local           Block to use if the Inode is not open.
+ * @return      Pointer to loaded indirect block (NULL on failure).
+ **/
+Block * fs_load_indirect(FileSystem *fs, size_t inode_number, File *file, Block *local) {
+
+    Inode *inode = &fs->inodes[inode_number];
+    Block *ind   = local;
+
+    if(file) {
+        pthread_mutex_lock(&file->lock);
+        ind = &file->indirect;
+    }
+
+    if(!file || !file->loaded) {
+        if(!inode->indirect) {
+            memset(ind->data, 0, BLOCK_SIZE);
+        } else if(!fs_meta_read(fs, inode->indirect, ind->data)) {
+            ind = NULL;
+        }
+    }
+
+    if(file) {
+        file->loaded = ind != NULL;
+        pthread_mutex_unlock(&file->lock);
+    }
+
+    return ind;
+}
+
+/**
+ * Map a range of file blocks to disk blocks, through the Inode's extents
+ * or its pointer blocks (holes map to 0).
+ *
+ * Note: Caller must hold the Inode's lock.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode           Inode whose blocks are mapped.
+ * @param       inode_number    Inode number of mapped Inode.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       first           First file block in range.
+ * @param       count           Number of file blocks in range.
+ * @param       blocks          Set to disk block of each file block.
+ * @return      Number of file blocks mapped from the start of the range.
+ **/
+size_t  fs_map_blocks(FileSystem *fs, Inode *inode, size_t inode_number, File *file, size_t first, size_t count, size_t *blocks) {
+
+    if(fs_has_extents(&fs->meta_data)) {
+        Block  local;
+        Block *eblock = NULL;
+
+        if(inode->nextents > EXTENTS_PER_INODE && !(eblock = fs_load_indirect(fs, inode_number, file, &local))) {
+            return 0;
+        }
+
+        return fs_extent_lookup(inode, eblock, first, count, blocks);
+    }
+
+    BlockMap map;
+    size_t   mapped = 0;
+
+    if(fs_map_init(fs, &map, inode, inode_number, file, first, count)) {
+        for(; mapped < count; mapped++) {
+            uint32_t *pointer = fs_map_pointer(fs, &map, first + mapped);
+            if(!pointer) {
+                break;
+            }
+            blocks[mapped] = *pointer;
+        }
+    }
+
+    fs_map_release(&map);
+    return mapped;
+}
+
+/**
+ * Return pointer to specified extent of an extent Inode (the first
+ * EXTENTS_PER_INODE are in the Inode, the rest in its extent block).
+ *
+ * @param       inode   Pointer to Inode.
+ * @param       eblock  Pointer to loaded extent block (if needed).
+ * @param       i       Index of extent.
+ * @return      Pointer to extent.
+ **/
+Extent *fs_extent(Inode *inode, Block *eblock, size_t i) {
+
+    if(i < EXTENTS_PER_INODE) {
+        return &inode->extents[i];
+    }
+
+    return &eblock->extents[i - EXTENTS_PER_INODE];
+}
+
+/**
+ * Return number of file blocks mapped by the extents of an extent Inode.
+ *
+ * @param       inode   Pointer to Inode.
+ * @param       eblock  Pointer to loaded extent block (if needed).
+ * @return      Number of mapped file blocks.
+ **/
+size_t  fs_extent_blocks(Inode *inode, Block *eblock) {
+
+    size_t total = 0;
+
+    for(size_t i = 0; i < min(inode->nextents, EXTENTS_PER_INODE + EXTENTS_PER_BLOCK); i++) {
+        total += fs_extent(inode, eblock, i)->length;
+    }
+
+    return total;
+}
+
+/**
+ * Map a range of file blocks through the extents of an extent Inode.
+ *
+ * Extents cover the file in order, so each one maps the file blocks that
+ * follow the previous one; runs inside an extent are computed rather than
+ * looked up one pointer at a time.
+ *
+ * @param       inode   Pointer to Inode.
+ * @param       eblock  Pointer to loaded extent block (if needed).
+ * @param       first   First file block in range.
+ * @param       count   Number of file blocks in range.
+ * @param       blocks  Set to disk block of each file block.
+ * @return      Number of file blocks mapped from the start of the range.
+ **/
+size_t  fs_extent_lookup(Inode *inode, Block *eblock, size_t first, size_t count, size_t *blocks) {
+
+    size_t logical = 0;
+    size_t end     = first + count;
+    size_t mapped  = 0;
+
+    for(size_t i = 0; i < min(inode->nextents, EXTENTS_PER_INODE + EXTENTS_PER_BLOCK) && logical < end; i++) {
+        Extent *e    = fs_extent(inode, eblock, i);
+        size_t  from = max(first, logical);
+        size_t  to   = min(end, logical + e->length);
+
+        for(size_t b = from; b < to; b++) {
+            blocks[b - first] = e->start + (b - logical);
+        }
+
+        mapped  += to > from ? to - from : 0;
+        logical += e->length;
+    }
+
+    return mapped;
+}
+
+/**
+ * Append a run of disk blocks to the end of an extent Inode by doing the
+ * following:
+ *
+ *  1. Grow the last extent if the run continues it.
+ *
+ *  2. Otherwise add an extent, allocating the extent block when the
+ *  Inode's own extents are used up.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       inode   Pointer to Inode (may be a copy).
+ * @param       eblock  Pointer to loaded extent block.
+ * @param       start   First disk block of run.
+ * @param       length  Number of disk blocks in run.
+ * @param       dirty   Set if the extent block must be written.
+ * @return      Whether or not the run was appended (false if no room).
+ **/
+bool    fs_extent_append(FileSystem *fs, Inode *inode, Block *eblock, size_t start, size_t length, bool *dirty) {
+
+    size_t n = inode->nextents;
+
+    if(n) {
+        Extent *last = fs_extent(inode, eblock, n - 1);
+        if(last->start + last->length == start && last->length + length <= UINT32_MAX) {
+            last->length += length;
+            *dirty |= n > EXTENTS_PER_INODE;
+            return true;
+        }
+    }
+
+    if(n >= EXTENTS_PER_INODE + EXTENTS_PER_BLOCK) {
+        return false;
+    }
+
+    if(n == EXTENTS_PER_INODE && !inode->indirect) {
+        size_t block;
+        if(fs_allocate_extent(fs, 1, &block) == 0) {
+            return false;
+        }
+        inode->indirect = block;
+    }
+
+    *fs_extent(inode, eblock, n) = (Extent){start, length};
+    inode->nextents++;
+    *dirty |= n >= EXTENTS_PER_INODE;
+    return true;
+}
+
+/**
+ * Write to the blocks of the specified extent Inode (see fs_write_pointers)
+ * by doing the following:
+ *
+ *  1. Allocate contiguous runs for the blocks past the end of the file and
+ *  append them as extents.
+ *
+ *  2. Zero any new blocks between the old end of the file and the write.
+ *
+ *  3. Map the range through the extents and write it with fs_write_mapped.
+ *
+ *  4. Record updates to the Inode, extent block, and Inode table (deferred
+ *  to fs_close if the Inode is open).
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       inode_number    Inode to write data to.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       data            Buffer with data to copy
+ * @param       length          Number of bytes to write (not 0).
+ * @param       offset          Byte offset from which to begin writing.
+ * @return      Number of bytes write (-1 on error).
+ **/
+ssize_t fs_write_extents(FileSystem *fs, size_t inode_number, File *file, char *data, size_t length, size_t offset) {
+
+    Inode  copy  = fs->inodes[inode_number];
+    Inode *inode = &copy;
+    size_t first = offset / BLOCK_SIZE;
+    size_t count = (offset + length - 1) / BLOCK_SIZE - first + 1;
+
+    Block  local;
+    Block *eblock = fs_load_indirect(fs, inode_number, file, &local);
+    bool   dirty  = false;
+
+    if(!eblock) {
+        return -1;
+    }
+
+    // Append extents for blocks past the end of the file
+
+    size_t old   = fs_extent_blocks(inode, eblock);
+    size_t total = old;
+
+    while(total < first + count) {
+        size_t start;
+        size_t extent = fs_allocate_extent(fs, first + count - total, &start);
+        if(extent == 0) {
+            break;
+        }
+
+        if(!fs_extent_append(fs, inode, eblock, start, extent, &dirty)) {
+            fs_release_run(fs, start, extent);
+            break;
+        }
+        total += extent;
+    }
+
+    size_t  gap     = first > old ? min(first, total) - old : 0;
+    size_t *blocks  = malloc(max(count, gap) * sizeof(size_t));
+    char  **bufs    = malloc(max(count, gap) * sizeof(char *));
+    bool   *fresh   = calloc(count, sizeof(bool));
+    size_t  nmapped = 0;
+    ssize_t result  = -1;
+    Block   zero;
+
+    if(!blocks || !bufs || !fresh) {
+        goto done;
+    }
+
+    // Zero new blocks the write skips over
+
+    if(gap) {
+        memset(zero.data, 0, BLOCK_SIZE);
+        fs_extent_lookup(inode, eblock, old, gap, blocks);
+        for(size_t i = 0; i < gap; i++) {
+            bufs[i] = zero.data;
+        }
+
+        DiskClass class  = disk_account_class(DISK_DATA);
+        bool      zeroed = disk_writev(fs->disk, blocks, bufs, gap) != DISK_FAILURE;
+        disk_account_class(class);
+
+        if(!zeroed) {
+            goto done;
+        }
+    }
+
+    nmapped = fs_extent_lookup(inode, eblock, first, count, blocks);
+    for(size_t i = 0; i < nmapped; i++) {
+        fresh[i] = first + i >= old;
+    }
+
+    size_t byte_start = offset % BLOCK_SIZE;
+    size_t b_write    = min(length, nmapped * BLOCK_SIZE - byte_start);
+
+    if(nmapped == 0) {
+        result = 0;
+        goto done;
+    }
+
+    if(!fs_write_mapped(fs, blocks, bufs, fresh, nmapped, data, b_write, byte_start)) {
+        goto done;
+    }
+
+    inode->size = max(inode->size, offset + b_write);
+    result = b_write;
+
+done:
+    // Open files defer extent block and inode table updates to fs_close
+
+    if(file) {
+        pthread_mutex_lock(&file->lock);
+        fs_file_dirty(fs, file, dirty, false);
+        pthread_mutex_unlock(&file->lock);
+    } else if(dirty && !fs_meta_write(fs, inode->indirect, eblock->data)) {
+        result = -1;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    fs->inodes[inode_number] = copy;
+    fs_inode_dirty(fs, inode_number);
+
+    if(!file && !fs_inode_flush(fs)) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    free(blocks);
+    free(bufs);
+    free(fresh);
+    return result;
+}
+
+/**
+ * Load double indirect block, like fs_load_indirect.
+ *
+ * Note: Caller must hold the Inode's lock.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Open File of Inode (NULL if not open).
+ * @param       block   Double indirect block number (0 if none yet).
+ * @param       local   Block to use if the Inode is not open.
+ * @return      Pointer to loaded double indirect block (NULL on failure).
+ **/
+Block * fs_load_dindirect(FileSystem *fs, File *file, uint32_t block, Block *local) {
+
+    Block *dind = local;
+
+    if(file) {
+        pthread_mutex_lock(&file->lock);
+        dind = &file->dindirect;
+    }
+
+    if(!file || !file->dloaded) {
+        if(!block) {
+            memset(dind->data, 0, BLOCK_SIZE);
+        } else if(!fs_meta_read(fs, block, dind->data)) {
+            dind = NULL;
+        }
+    }
+
+    if(file) {
+        file->dloaded = dind != NULL;
+        pthread_mutex_unlock(&file->lock);
+    }
+
+    return dind;
+}
+
+/**
+ * Release a double indirect block, its leaves and their data blocks.
+ *
+ * Note: Caller must hold the Inode's lock for writing.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Open File of Inode (NULL if not open).
+ * @param       block   Double indirect block number (0 if none).
+ * @return      Whether or not the leaves could be read.
+ **/
+bool    fs_release_dindirect(FileSystem *fs, File *file, uint32_t block) {
+
+    Block  local;
+    Block *dind = block && block < fs->meta_data.blocks ? fs_load_dindirect(fs, file, block, &local) : NULL;
+
+    if(!dind) {
+        return !block || block >= fs->meta_data.blocks;
+    }
+
+    size_t *numbers = malloc(POINTERS_PER_BLOCK * sizeof(size_t));
+    char  **bufs    = malloc(POINTERS_PER_BLOCK * sizeof(char *));
+    Block  *leaves  = malloc(POINTERS_PER_BLOCK * sizeof(Block));
+    size_t  n       = 0;
+    bool    success = numbers && bufs && leaves;
+
+    for(size_t q = 0; success && q < POINTERS_PER_BLOCK; q++) {
+        if(dind->pointers[q] && dind->pointers[q] < fs->meta_data.blocks) {
+            numbers[n] = dind->pointers[q];
+            bufs[n]    = leaves[n].data;
+            n++;
+        }
+    }
+
+    success = success && fs_meta_readv(fs, numbers, bufs, n);
+
+    for(size_t l = 0; success && l < n; l++) {
+        for(size_t q = 0; q < POINTERS_PER_BLOCK; q++) {
+            fs_release_block(fs, leaves[l].pointers[q]);
+        }
+        fs_release_block(fs, numbers[l]);
+    }
+
+    fs_release_block(fs, block);
+
+    free(numbers);
+    free(bufs);
+    free(leaves);
+    return success;
+}
+
+/**
+ * Prefetch upcoming blocks of an open File into the block cache by doing
+ * the following:
+ *
+ *  1. Detect sequential access (read starts at the byte the previous one
+ *  ended at, even within a block); any other access resets the readahead
+ *  window.
+ *
+ *  2. Grow the window (doubling up to READAHEAD_MAX) while streaming.
+ *
+ *  3. Load the requested blocks and the window past them with one batched
+ *  disk_prefetch, so the following disk_readv hits the cache.
+ *
+ * Note: Readahead is advisory, so failures are ignored.  Without a block
+ * cache this does nothing.  The prefetch runs synchronously in the read
+ * that triggers it: disk_submit transfers into caller buffers rather than
+ * the block cache, so it cannot fill the cache in the background.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       file    Pointer to open File being read.
+ * @param       offset  Byte offset the read starts at.
+ * @param       length  Number of bytes in the read (not 0).
+ **/
+void    fs_readahead(FileSystem *fs, File *file, size_t offset, size_t length) {
+
+    Inode *inode = &fs->inodes[file->inode_number];
+    size_t first = offset / BLOCK_SIZE;
+    size_t count = (offset + length - 1) / BLOCK_SIZE - first + 1;
+    size_t window;
+
+    pthread_mutex_lock(&file->lock);
+    if(offset == file->ra_offset) {
+        file->ra_window = file->ra_window ? min(file->ra_window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+    } else {
+        file->ra_window = 0;
+    }
+    file->ra_offset = offset + length;
+    window = file->ra_window;
+    pthread_mutex_unlock(&file->lock);
+
+    if(!fs->disk->cache || window == 0) {
+        return;
+    }
+
+    size_t end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    end = min(end, first + count + window);
+
+    if(!fs_has_extents(&fs->meta_data) && end > POINTERS_PER_INODE && !inode->indirect) {
+        end = min(end, POINTERS_PER_INODE);
+    }
+
+    if(end <= first) {
+        return;
+    }
+
+    size_t *blocks = malloc((end - first) * sizeof(size_t));
+    size_t  n      = 0;
+
+    if(!blocks) {
+        return;
+    }
+
+    size_t mapped = fs_map_blocks(fs, inode, file->inode_number, file, first, end - first, blocks);
+    for(size_t b = 0; b < mapped; b++) {
+        if(blocks[b]) {
+            blocks[n++] = blocks[b];
+        }
+    }
+
+    DiskClass class = disk_account_class(DISK_DATA);
+    disk_prefetch(fs->disk, blocks, n);
+    disk_account_class(class);
+    free(blocks);
+}
+
+/**
+ * Return number of data pointers in an indirect block of the specified
+ * file system (the last one leads to the double indirect block if the
+ * image has FS_FEATURE_DINDIRECT).
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @return      Number of data pointers per indirect block.
+ **/
+size_t  fs_indirect_pointers(const SuperBlock *super) {
+    return fs_has_dindirect(super) ? DINDIRECT_POINTER : POINTERS_PER_BLOCK;
+}
+
+/**
+ * Return whether or not the specified file system maps blocks past the
+ * indirect block through a double indirect block.
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @return      Whether or not FS_FEATURE_DINDIRECT is enabled.
+ **/
+bool    fs_has_dindirect(const SuperBlock *super) {
+    return super->version == FS_VERSION && (super->features & FS_FEATURE_DINDIRECT) && !fs_has_extents(super);
+}
+
+/**
+ * Return whether or not Inodes of the specified file system map their
+ * blocks with extents.
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @return      Whether or not FS_FEATURE_EXTENTS is enabled.
+ **/
+bool    fs_has_extents(const SuperBlock *super) {
+    return super->version == FS_VERSION && (super->features & FS_FEATURE_EXTENTS);
+}
+
+/**
+ * Return whether or not the specified Inode stores its data inline (which
+ * all files of up to INLINE_MAX bytes do with FS_FEATURE_INLINE).
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @param       inode   Pointer to Inode.
+ * @return      Whether or not the Inode holds its data.
+ **/
+bool    fs_is_inline(const SuperBlock *super, const Inode *inode) {
+    return fs_has_inline(super) && inode->size <= INLINE_MAX;
+}
+
+/**
+ * Return whether or not the specified file system stores small files in
+ * their Inodes.
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @return      Whether or not FS_FEATURE_INLINE is enabled.
+ **/
+bool    fs_has_inline(const SuperBlock *super) {
+    return super->version == FS_VERSION && (super->features & FS_FEATURE_INLINE);
+}
+
+/**
+ * Return whether or not the specified file system stores block checksums.
+ *
+ * @param       super   Pointer to SuperBlock structure.
+ * @return      Whether or not FS_FEATURE_CHECKSUMS is enabled.
+ **/
+bool    fs_has_checksums(const SuperBlock *super) {
+    return super->version == FS_VERSION && (super->features & FS_FEATURE_CHECKSUMS);
+}
+
+/**
+ * Return largest file size in bytes the specified file system can map
+ * (limited by the 32-bit Inode size).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Largest file size in bytes.
+ **/
+size_t  fs_max_size(FileSystem *fs) {
+
+    uint64_t blocks = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+
+    if(fs_has_extents(&fs->meta_data)) {
+        return UINT32_MAX;
+    }
+
+    if(fs_has_dindirect(&fs->meta_data)) {
+        blocks += (uint64_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    }
+
+    return min(blocks * BLOCK_SIZE, (uint64_t)UINT32_MAX);
+}
+
+/**
+ * Prepare mapping of a range of file blocks by doing the following:
+ *
+ *  1. Load the indirect block if the range reaches it.
+ *
+ *  2. Load the double indirect block if the range reaches past the
+ *  indirect block, and reserve room for the leaf blocks it covers (which
+ *  are loaded on first use).
+ *
+ * Missing indirect, double indirect and leaf blocks are loaded as zeroes
+ * so holes map to pointer 0.
+ *
+ * Note: Caller must hold the Inode's lock and release the map with
+ * fs_map_release.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       map             Pointer to BlockMap structure to prepare.
+ * @param       inode           Inode whose blocks are mapped (may be a copy).
+ * @param       inode_number    Inode number of mapped Inode.
+ * @param       file            Open File of Inode (NULL if not open).
+ * @param       first           First file block in range.
+ * @param       count           Number of file blocks in range.
+ * @return      Whether or not the map was prepared.
+ **/
+bool    fs_map_init(FileSystem *fs, BlockMap *map, Inode *inode, size_t inode_number, File *file, size_t first, size_t count) {
+
+    size_t end  = first + count;
+    size_t base = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+
+    map->inode           = inode;
+    map->file            = file;
+    map->indirect        = NULL;
+    map->indirect_dirty  = false;
+    map->dindirect       = NULL;
+    map->dindirect_dirty = false;
+    map->first_leaf      = 0;
+    map->nleaves         = 0;
+    map->leaves          = NULL;
+    map->leaf_state      = NULL;
+
+    if(end > POINTERS_PER_INODE && !(map->indirect = fs_load_indirect(fs, inode_number, file, &map->local))) {
+        return false;
+    }
+
+    if(end <= base) {
+        return true;
+    }
+
+    if(!(map->dindirect = fs_load_dindirect(fs, file, map->indirect->pointers[DINDIRECT_POINTER], &map->dlocal))) {
+        return false;
+    }
+
+    map->first_leaf = first > base ? (first - base) / POINTERS_PER_BLOCK : 0;
+    map->nleaves    = (end - 1 - base) / POINTERS_PER_BLOCK - map->first_leaf + 1;
+    map->leaves     = malloc(map->nleaves * sizeof(Block));
+    map->leaf_state = calloc(map->nleaves, sizeof(uint8_t));
+
+    return map->leaves && map->leaf_state;
+}
+
+/**
+ * Return pointer slot of specified file block in a prepared map (in the
+ * Inode, the indirect block or a leaf of the double indirect block).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     Pointer to prepared BlockMap structure.
+ * @param       block   File block in the map's range.
+ * @return      Pointer to block pointer (NULL if its leaf could not be read).
+ **/
+uint32_t *fs_map_pointer(FileSystem *fs, BlockMap *map, size_t block) {
+
+    size_t base = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+
+    if(block < POINTERS_PER_INODE) {
+        return &map->inode->direct[block];
+    }
+
+    if(block < base) {
+        return &map->indirect->pointers[block - POINTERS_PER_INODE];
+    }
+
+    Block *leaf = fs_map_leaf(fs, map, (block - base) / POINTERS_PER_BLOCK);
+    return leaf ? &leaf->pointers[(block - base) % POINTERS_PER_BLOCK] : NULL;
+}
+
+/**
+ * Load specified leaf of the double indirect block into a prepared map,
+ * using the open File's cached leaf when it matches.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     Pointer to prepared BlockMap structure.
+ * @param       leaf    Index of leaf in the double indirect block.
+ * @return      Pointer to loaded leaf (NULL on failure).
+ **/
+Block * fs_map_leaf(FileSystem *fs, BlockMap *map, size_t leaf) {
+
+    size_t   i      = leaf - map->first_leaf;
+    uint32_t number = map->dindirect->pointers[leaf];
+    Block   *b      = &map->leaves[i];
+    File    *file   = map->file;
+
+    if(map->leaf_state[i] & LEAF_LOADED) {
+        return b;
+    }
+
+    bool cached = false;
+    if(file && number) {
+        pthread_mutex_lock(&file->lock);
+        if(file->leaf_index == leaf + 1) {
+            memcpy(b->data, file->leaf.data, BLOCK_SIZE);
+            cached = true;
+        }
+        pthread_mutex_unlock(&file->lock);
+    }
+
+    if(!cached && !number) {
+        memset(b->data, 0, BLOCK_SIZE);
+    } else if(!cached) {
+        if(!fs_meta_read(fs, number, b->data)) {
+            return NULL;
+        }
+        fs_map_cache(map, leaf, b);
+    }
+
+    map->leaf_state[i] |= LEAF_LOADED;
+    return b;
+}
+
+/**
+ * Mark leaf holding specified file block as modified.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     Pointer to prepared BlockMap structure.
+ * @param       block   File block past the indirect block.
+ **/
+void    fs_map_dirty(FileSystem *fs, BlockMap *map, size_t block) {
+    size_t base = POINTERS_PER_INODE + fs_indirect_pointers(&fs->meta_data);
+    map->leaf_state[(block - base) / POINTERS_PER_BLOCK - map->first_leaf] |= LEAF_DIRTY;
+}
+
+/**
+ * Remember specified leaf in the open File's leaf cache (if open).
+ *
+ * @param       map     Pointer to prepared BlockMap structure.
+ * @param       leaf    Index of leaf in the double indirect block.
+ * @param       b       Contents of leaf.
+ **/
+void    fs_map_cache(BlockMap *map, size_t leaf, Block *b) {
+
+    File *file = map->file;
+
+    if(!file) {
+        return;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    memcpy(file->leaf.data, b->data, BLOCK_SIZE);
+    file->leaf_index = leaf + 1;
+    pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Write modified mapping blocks by doing the following:
+ *
+ *  1. Write every dirty leaf with one vectored request.
+ *
+ *  2. Write the double indirect block and indirect block if they are dirty
+ *  (or leave them to fs_close if the Inode is open).
+ *
+ * Note: The indirect block lives at map->inode->indirect.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       map     Pointer to prepared BlockMap structure.
+ * @return      Whether or not all modified mapping blocks were written.
+ **/
+bool    fs_map_flush(FileSystem *fs, BlockMap *map) {
+
+    size_t *blocks  = malloc(max(map->nleaves, 1) * sizeof(size_t));
+    char  **bufs    = malloc(max(map->nleaves, 1) * sizeof(char *));
+    size_t  n       = 0;
+    bool    flushed = blocks && bufs;
+
+    for(size_t i = 0; flushed && i < map->nleaves; i++) {
+        if(map->leaf_state[i] & LEAF_DIRTY) {
+            blocks[n] = map->dindirect->pointers[map->first_leaf + i];
+            bufs[n++] = map->leaves[i].data;
+            fs_map_cache(map, map->first_leaf + i, &map->leaves[i]);
+            map->leaf_state[i] &= ~LEAF_DIRTY;
+        }
+    }
+
+    flushed = flushed && fs_meta_writev(fs, blocks, bufs, n);
+    free(blocks);
+    free(bufs);
+
+    if(map->file) {
+        pthread_mutex_lock(&map->file->lock);
+        fs_file_dirty(fs, map->file, map->indirect_dirty, map->dindirect_dirty);
+        pthread_mutex_unlock(&map->file->lock);
+        return flushed;
+    }
+
+    if(flushed && map->dindirect_dirty) {
+        flushed = fs_meta_write(fs, map->indirect->pointers[DINDIRECT_POINTER], map->dindirect->data);
+    }
+
+    if(flushed && map->indirect_dirty) {
+        flushed = fs_meta_write(fs, map->inode->indirect, map->indirect->data);
+    }
+
+    return flushed;
+}
+
+/**
+ * Release memory held by a prepared map.
+ *
+ * @param       map     Pointer to BlockMap structure.
+ **/
+void    fs_map_release(BlockMap *map) {
+    free(map->leaves);
+    free(map->leaf_state);
+    map->leaves     = NULL;
+    map->leaf_state = NULL;
+}
+
+/**
+ * Assign a buffer to each block of a byte range by doing the following:
+ *
+ *  1. Point blocks the range fully covers straight into the caller's data
+ *  buffer so they are transferred without an intermediate copy.
+ *
+ *  2. Point a partially covered first block at head and a partially covered
+ *  last block at tail.
+ *
+ * @param       bufs        Buffers to assign (one per block).
+ * @param       count       Number of blocks in range.
+ * @param       data        Caller's data buffer.
+ * @param       length      Number of bytes in range.
+ * @param       byte_start  Offset of range within its first block.
+ * @param       head        Bounce block for partial first block.
+ * @param       tail        Bounce block for partial last block.
+ **/
+void    fs_buffers(char **bufs, size_t count, char *data, size_t length, size_t byte_start, Block *head, Block *tail) {
+
+    for(size_t i = 0; i < count; i++) {
+        size_t start = i * BLOCK_SIZE;
+
+        if(i == 0 && (byte_start || length < BLOCK_SIZE)) {
+            bufs[i] = head->data;
+        } else if(start - byte_start + BLOCK_SIZE > length) {
+            bufs[i] = tail->data;
+        } else {
+            bufs[i] = data + start - byte_start;
+        }
+    }
+}
+
+/**
+ * Zero fill the buffers of holes (blocks mapped to 0) in a range and drop
+ * them from blocks and bufs, so only allocated blocks are transferred.
+ *
+ * @param       blocks      Disk block of each block in range (0 for holes).
+ * @param       bufs        Buffer of each block in range.
+ * @param       count       Number of blocks in range.
+ * @return      Number of allocated blocks left in blocks and bufs.
+ **/
+size_t  fs_holes(size_t *blocks, char **bufs, size_t count) {
+
+    size_t n = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        if(!blocks[i]) {
+            memset(bufs[i], 0, BLOCK_SIZE);
+            continue;
+        }
+
+        blocks[n] = blocks[i];
+        bufs[n++] = bufs[i];
+    }
+
+    return n;
+}
+
+/**
+ * Return whether or not a sparse write may leave a block of its range
+ * unallocated: the FileSystem is in sparse mode and every byte the write
+ * covers in the block is zero.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       data        Buffer with data to write.
+ * @param       length      Number of bytes in range.
+ * @param       byte_start  Offset of range within its first block.
+ * @param       i           Block within range.
+ * @return      Whether or not the block may be left a hole.
+ **/
+bool    fs_sparse_hole(FileSystem *fs, const char *data, size_t length, size_t byte_start, size_t i) {
+
+    if(!fs->sparse) {
+        return false;
+    }
+
+    size_t start = i ? i * BLOCK_SIZE - byte_start : 0;
+    size_t end   = min(length, (i + 1) * BLOCK_SIZE - byte_start);
+
+    if(start >= end) {
+        return false;
+    }
+
+    return data[start] == 0 && memcmp(data + start, data + start + 1, end - start - 1) == 0;
+}
+
+/**
+ * Allocate a run of contiguous free blocks by doing the following:
+ *
+ *  1. Walk runs of free blocks in the bitmap beginning at free hint.
+ *
+ *  2. Take the first run that holds count blocks, or else the longest run.
+ *
+ *  3. Atomically claim blocks in the run and advance free hint if the run
+ *  began there.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       count   Number of blocks wanted.
+ * @param       start   Set to first block of allocated run.
+ * @return      Number of blocks allocated (0 if disk is full).
+ **/
+size_t  fs_allocate_extent(FileSystem *fs, size_t count, size_t *start) {
+
+    size_t  blocks = fs->meta_data.blocks;
+
+    while(true) {
+        size_t  hint = __atomic_load_n(&fs->free_hint, __ATOMIC_ACQUIRE);
+        size_t  best_start  = 0;
+        size_t  best_length = 0;
+        ssize_t run = bitmap_find(fs->free_blocks, blocks, hint);
+
+        while(run >= 0 && best_length < count) {
+            size_t end = bitmap_find_clear(fs->free_blocks, blocks, run);
+
+            if(end - run > best_length) {
+                best_start  = run;
+                best_length = end - run;
+            }
+
+            run = bitmap_find(fs->free_blocks, blocks, end);
+        }
+
+        if(best_length == 0) {
+            return 0;
+        }
+
+        // Claim blocks one at a time, keeping the prefix won from other
+        // threads (rescan if another thread took the first block)
+
+        size_t claimed = 0;
+        while(claimed < min(best_length, count) && bitmap_claim(fs->free_blocks, best_start + claimed)) {
+            claimed++;
+        }
+
+        if(claimed == 0) {
+            continue;
+        }
+
+        if(best_start == hint) {
+            __atomic_compare_exchange_n(&fs->free_hint, &hint, best_start + claimed, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+
+        *start = best_start;
+        return claimed;
+    }
+}
+
+/**
+ * Mark specified block as free and pull free hint back to it if needed.
+ *
+ * Note: Block 0 (the SuperBlock) is used as the null pointer and is never
+ * released.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to release.
+ **/
+void    fs_release_block(FileSystem *fs, size_t block) {
+
+    if(block == 0 || block >= fs->meta_data.blocks) {
+        return;
+    }
+
+    bitmap_set(fs_released(fs), block);
+
+    size_t hint = __atomic_load_n(&fs->free_hint, __ATOMIC_ACQUIRE);
+    while(block < hint && !__atomic_compare_exchange_n(&fs->free_hint, &hint, block, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Mark a run of blocks as free and pull free hint back to its start.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       start   First block of run.
+ * @param       length  Number of blocks in run.
+ **/
+void    fs_release_run(FileSystem *fs, size_t start, size_t length) {
+
+    for(size_t b = start + 1; b < start + length && b < fs->meta_data.blocks; b++) {
+        bitmap_set(fs_released(fs), b);
+    }
+
+    if(length) {
+        fs_release_block(fs, start);
+    }
+}
+
+/**
+ * Release the data blocks and extent block of an extent Inode in the free
+ * block bitmap, without moving the free hint.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       inode   Pointer to Inode.
+ * @param       eblock  Pointer to loaded extent block (if needed).
+ * @param       lowest  Lowered to the lowest released block.
+ * @return      Whether or not the extents were valid.
+ **/
+bool    fs_release_extents(FileSystem *fs, Inode *inode, Block *eblock, size_t *lowest) {
+
+    size_t    blocks   = fs->meta_data.blocks;
+    size_t    nextents = min(inode->nextents, EXTENTS_PER_INODE + EXTENTS_PER_BLOCK);
+    uint64_t *released = fs_released(fs);
+
+    if(nextents > EXTENTS_PER_INODE && !eblock) {
+        return false;
+    }
+
+    for(size_t i = 0; i < nextents; i++) {
+        Extent *e = fs_extent(inode, eblock, i);
+
+        for(size_t b = e->start; b < (size_t)e->start + e->length && b < blocks; b++) {
+            if(b) {
+                bitmap_set(released, b);
+                *lowest = min(*lowest, b);
+            }
+        }
+    }
+
+    if(inode->indirect && inode->indirect < blocks) {
+        bitmap_set(released, inode->indirect);
+        *lowest = min(*lowest, inode->indirect);
+    }
+
+    return true;
+}
+
+/**
+ * Remove a group of Inodes from the same Inode block by doing the
+ * following:
+ *
+ *  1. Lock each Inode for writing (in ascending order) and skip the ones
+ *  that are not valid.
+ *
+ *  2. Read every indirect block that is not resident with one disk_readv.
+ *
+ *  3. Release all referenced blocks in one pass over the free block bitmap
+ *  and lower the free hint once (double indirect blocks are read and
+ *  released per Inode).
+ *
+ *  4. Mark the Inodes as free and write their Inode block once.
+ *
+ * @param       fs              Pointer to FileSystem structure.
+ * @param       group           Sorted, distinct Inodes in one Inode block.
+ * @param       n               Number of Inodes in group.
+ * @param       indirects       Buffer of at least n Blocks for indirect blocks.
+ * @return      Number of Inodes removed (-1 on failure).
+ **/
+ssize_t fs_remove_group(FileSystem *fs, const size_t *group, size_t n, Block *indirects) {
+
+    size_t  locked[INODES_PER_BLOCK];
+    Block  *ind[INODES_PER_BLOCK];
+    File   *files[INODES_PER_BLOCK];
+    size_t  blocks[INODES_PER_BLOCK];
+    char   *bufs[INODES_PER_BLOCK];
+    size_t  nlocked = 0;
+    size_t  nreads  = 0;
+    ssize_t removed = -1;
+
+    for(size_t q = 0; q < n; q++) {
+        Inode *inode = fs_inode_lock(fs, group[q], true);
+
+        if(inode->valid != 1) {
+            fs_inode_unlock(fs, group[q]);
+            continue;
+        }
+
+        // Use resident indirect block of open File, otherwise queue a read
+
+        File *file = fs_file(fs, group[q]);
+
+        ind[nlocked]   = NULL;
+        files[nlocked] = file;
+        if(inode->indirect && !fs_is_inline(&fs->meta_data, inode)) {
+            if(file) {
+                pthread_mutex_lock(&file->lock);
+                if(file->loaded) {
+                    ind[nlocked] = &file->indirect;
+                }
+                pthread_mutex_unlock(&file->lock);
+            }
+
+            if(!ind[nlocked]) {
+                ind[nlocked]   = &indirects[nreads];
+                blocks[nreads] = inode->indirect;
+                bufs[nreads]   = indirects[nreads].data;
+                nreads++;
+            }
+        }
+
+        locked[nlocked++] = group[q];
+    }
+
+    if(nreads && !fs_meta_readv(fs, blocks, bufs, nreads)) {
+        goto unlock;
+    }
+
+    // Release double indirect trees first, as their reads may fail
+
+    for(size_t q = 0; fs_has_dindirect(&fs->meta_data) && q < nlocked; q++) {
+        if(ind[q] && !fs_release_dindirect(fs, files[q], ind[q]->pointers[DINDIRECT_POINTER])) {
+            goto unlock;
+        }
+    }
+
+    // Release direct, indirect and indirect data blocks (or extents) in one pass
+
+    size_t    lowest   = fs->meta_data.blocks;
+    uint64_t *released = fs_released(fs);
+
+    for(size_t q = 0; q < nlocked; q++) {
+        Inode *inode = &fs->inodes[locked[q]];
+
+        if(fs_is_inline(&fs->meta_data, inode)) {
+            continue;
+        }
+
+        if(fs_has_extents(&fs->meta_data)) {
+            fs_release_extents(fs, inode, ind[q], &lowest);
+            continue;
+        }
+
+        for(int p = 0; p < POINTERS_PER_INODE; p++) {
+            if(inode->direct[p] && inode->direct[p] < fs->meta_data.blocks) {
+                bitmap_set(released, inode->direct[p]);
+                lowest = min(lowest, inode->direct[p]);
+            }
+        }
+
+        if(!ind[q] || inode->indirect >= fs->meta_data.blocks) {
+            continue;
+        }
+
+        bitmap_set(released, inode->indirect);
+        lowest = min(lowest, inode->indirect);
+
+        for(int p = 0; p < POINTERS_PER_BLOCK; p++) {
+            uint32_t block = ind[q]->pointers[p];
+            if(block && block < fs->meta_data.blocks) {
+                bitmap_set(released, block);
+                lowest = min(lowest, block);
+            }
+        }
+    }
+
+    // Releasing the lowest block again lowers the free hint
+
+    if(lowest < fs->meta_data.blocks) {
+        fs_release_block(fs, lowest);
+    }
+
+    // Free Inodes and write their Inode block once
+
+    pthread_mutex_lock(&fs->lock);
+    for(size_t q = 0; q < nlocked; q++) {
+        memset(&fs->inodes[locked[q]], 0, sizeof(Inode));
+        bitmap_set(fs->free_inodes, locked[q]);
+
+        if(files[q]) {
+            fs_file_forget(fs, files[q]);
+        }
+
+        fs_inode_dirty(fs, locked[q]);
+    }
+
+    if(nlocked) {
+        fs->free_inode_hint = min(fs->free_inode_hint, locked[0]);
+    }
+
+    removed = fs_inode_flush(fs) ? (ssize_t)nlocked : -1;
+    pthread_mutex_unlock(&fs->lock);
+
+unlock:
+    for(size_t q = 0; q < nlocked; q++) {
+        fs_inode_unlock(fs, locked[q]);
+    }
+
+    return removed;
+}
+
+/**
+ * Compare two block or Inode numbers for qsort.
+ *
+ * @param       a       Pointer to first size_t.
+ * @param       b       Pointer to second size_t.
+ * @return      Negative, zero or positive as a is less, equal or greater.
+ **/
+int     fs_compare_numbers(const void *a, const void *b) {
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Start timing an operation and charge the calling thread's disk transfers
+ * to it (as meta data until fs_stats_data says otherwise).
+ *
+ * @param       timer   Timer of operation.
+ **/
+void    fs_stats_begin(OpTimer *timer) {
+
+    memset(&timer->account, 0, sizeof(timer->account));
+    timer->previous = disk_account(&timer->account);
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+/**
+ * Stop timing an operation and add its latency and disk transfers to the
+ * FileSystem statistics.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       op      Operation that was timed.
+ * @param       timer   Timer of operation.
+ * @param       success Whether or not the operation succeeded.
+ **/
+void    fs_stats_end(FileSystem *fs, FsOp op, OpTimer *timer, bool success) {
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    disk_account(timer->previous);
+
+    size_t   nsecs  = (end.tv_sec - timer->start.tv_sec) * 1000000000ull + end.tv_nsec - timer->start.tv_nsec;
+    size_t   usecs  = nsecs / 1000;
+    size_t   bucket = usecs ? 64 - __builtin_clzll(usecs) : 0;
+    OpStats *stats  = &fs->stats[op];
+
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->failures, !success, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->nsecs, nsecs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->histogram[min(bucket, STATS_BUCKETS - 1)], 1, __ATOMIC_RELAXED);
+
+    size_t largest = __atomic_load_n(&stats->max_nsecs, __ATOMIC_RELAXED);
+    while(nsecs > largest && !__atomic_compare_exchange_n(&stats->max_nsecs, &largest, nsecs, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for(size_t c = 0; c < DISK_CLASSES; c++) {
+        __atomic_add_fetch(&stats->reads[c], timer->account.reads[c], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->writes[c], timer->account.writes[c], __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats->hits, timer->account.hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->misses, timer->account.misses, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return bitmap that released blocks are marked free in: the free blocks
+ * bitmap, or with FS_FEATURE_JOURNAL the blocks released by the running
+ * transaction (so they are not reused before the transaction commits).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Bitmap to set released blocks in.
+ **/
+uint64_t *fs_released(FileSystem *fs) {
+    return fs->journal ? fs->journal->released : fs->free_blocks;
+}
+
+/**
+ * Read a meta data block, taking the copy staged in the running
+ * transaction if there is one.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to read.
+ * @param       data    Buffer to read block into.
+ * @return      Whether or not the block was read.
+ **/
+bool    fs_meta_read(FileSystem *fs, size_t block, char *data) {
+
+    char *buf = data;
+    return fs_meta_readv(fs, &block, &buf, 1);
+}
+
+/**
+ * Read many meta data blocks, taking staged copies from the running
+ * transaction and reading the rest with one vectored request.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       blocks  Block number of each block to read.
+ * @param       bufs    Buffer to read each block into.
+ * @param       n       Number of blocks to read.
+ * @return      Whether or not all blocks were read.
+ **/
+bool    fs_meta_readv(FileSystem *fs, size_t *blocks, char **bufs, size_t n) {
+
+    Journal *journal = fs->journal;
+
+    if(!journal) {
+        return disk_readv(fs->disk, blocks, bufs, n) != DISK_FAILURE;
+    }
+
+    size_t *rest      = malloc(max(n, 1) * sizeof(size_t));
+    char  **rest_bufs = malloc(max(n, 1) * sizeof(char *));
+    size_t  nrest     = 0;
+    bool    read      = rest && rest_bufs;
+
+    pthread_mutex_lock(&journal->lock);
+    for(size_t i = 0; read && i < n; i++) {
+        uint32_t slot = blocks[i] < journal->blocks ? journal->slots[blocks[i]] : 0;
+
+        if(slot) {
+            memcpy(bufs[i], journal->staged[slot - 1].data, BLOCK_SIZE);
+        } else {
+            rest[nrest]        = blocks[i];
+            rest_bufs[nrest++] = bufs[i];
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    read = read && disk_readv(fs->disk, rest, rest_bufs, nrest) != DISK_FAILURE;
+    free(rest);
+    free(rest_bufs);
+    return read;
+}
+
+/**
+ * Write a meta data block, or with FS_FEATURE_JOURNAL stage it in the
+ * running transaction (it reaches its home block after the commit).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       block   Block number to write.
+ * @param       data    Contents of block.
+ * @return      Whether or not the block was written (or staged).
+ **/
+bool    fs_meta_write(FileSystem *fs, size_t block, char *data) {
+
+    if(fs->journal) {
+        return fs_journal_stage(fs->journal, block, data, fs->journal->capacity);
+    }
+
+    return disk_write(fs->disk, block, data) != DISK_FAILURE;
+}
+
+/**
+ * Write many meta data blocks with one vectored request (or stage them, see
+ * fs_meta_write).
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @param       blocks  Block number of each block to write.
+ * @param       bufs    Contents of each block.
+ * @param       n       Number of blocks to write.
+ * @return      Whether or not all blocks were written (or staged).
+ **/
+bool    fs_meta_writev(FileSystem *fs, size_t *blocks, char **bufs, size_t n) {
+
+    if(!fs->journal) {
+        return disk_writev(fs->disk, blocks, bufs, n) != DISK_FAILURE;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        if(!fs_journal_stage(fs->journal, blocks[i], bufs[i], fs->journal->capacity)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Allocate journal of a mounted image by doing the following:
+ *
+ *  1. Split the journal into two slots, so a torn commit never overwrites
+ *  the last transaction that committed.
+ *
+ *  2. Size transactions so the bitmap always fits next to what operations
+ *  stage, and operations into chunks that fit next to a transaction
+ *  that is due to commit.
+ *
+ *  3. Remember the stored bitmap, so commits only log the bitmap blocks
+ *  that changed.
+ *
+ * @param       super       Pointer to SuperBlock of image.
+ * @param       bitmap      Free blocks bitmap as stored on Disk.
+ * @param       sequence    Sequence number of next transaction.
+ * @return      Pointer to new Journal (NULL on failure).
+ **/
+Journal *fs_journal_open(SuperBlock *super, uint64_t *bitmap, uint32_t sequence) {
+
+    Journal *journal = calloc(1, sizeof(Journal));
+    if(!journal) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->idle, NULL);
+    pthread_cond_init(&journal->resume, NULL);
+
+    journal->blocks       = super->blocks;
+    journal->start        = 1 + super->inode_blocks + super->bitmap_blocks;
+    journal->slot_blocks  = super->journal_blocks / 2;
+    journal->sequence     = sequence;
+    journal->capacity     = journal->slot_blocks - 1 - super->bitmap_blocks;
+    journal->threshold    = journal->capacity / 2;
+    journal->chunk_inodes = max(journal->capacity / 4, 1) * INODES_PER_BLOCK;
+    journal->chunk_bytes  = max(journal->capacity / 4, 1) * POINTERS_PER_BLOCK * BLOCK_SIZE;
+    journal->targets      = malloc((journal->slot_blocks - 1) * sizeof(size_t));
+    journal->staged       = malloc((journal->slot_blocks - 1) * sizeof(Block));
+    journal->slots        = calloc(super->blocks, sizeof(uint32_t));
+    journal->released     = bitmap_create(super->blocks, false);
+    journal->committed    = calloc(super->bitmap_blocks, BLOCK_SIZE);
+
+    if(!journal->targets || !journal->staged || !journal->slots || !journal->released || !journal->committed) {
+        fs_journal_close(journal);
+        return NULL;
+    }
+
+    memcpy(journal->committed, bitmap, BITMAP_WORDS(super->blocks) * sizeof(uint64_t));
+    return journal;
+}
+
+/**
+ * Release journal (staged blocks that were not committed are lost).
+ *
+ * @param       journal     Pointer to Journal structure (NULL is ignored).
+ **/
+void    fs_journal_close(Journal *journal) {
+
+    if(!journal) {
+        return;
+    }
+
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->idle);
+    pthread_cond_destroy(&journal->resume);
+    free(journal->targets);
+    free(journal->staged);
+    free(journal->slots);
+    free(journal->released);
+    free(journal->committed);
+    free(journal);
+}
+
+/**
+ * Recover journal of an image being mounted by doing the following:
+ *
+ *  1. Read the descriptor of each slot and continue sequence numbers after
+ *  the highest one found.
+ *
+ *  2. If recovering, read and check the blocks of each transaction.
+ *
+ *  3. Write the blocks of the newest intact transaction to their home
+ *  blocks and sync the Disk.
+ *
+ * Only the newest transaction needs replaying, since every commit syncs
+ * the checkpoint of the one before it.
+ *
+ * @param       disk        Pointer to Disk structure.
+ * @param       super       Pointer to SuperBlock of image.
+ * @param       recover     Whether or not the image was not cleanly unmounted.
+ * @param       sequence    Set to sequence number of next transaction.
+ * @return      Whether or not the journal was read (and replayed).
+ **/
+bool    fs_journal_replay(Disk *disk, SuperBlock *super, bool recover, uint32_t *sequence) {
+
+    uint32_t start       = 1 + super->inode_blocks + super->bitmap_blocks;
+    uint32_t slot_blocks = super->journal_blocks / 2;
+    Block   *blocks      = malloc(2 * slot_blocks * sizeof(Block));
+    size_t  *numbers     = malloc(slot_blocks * sizeof(size_t));
+    char   **bufs        = malloc(slot_blocks * sizeof(char *));
+    ssize_t  newest      = -1;
+    bool     success     = blocks && numbers && bufs;
+
+    *sequence = 0;
+
+    for(uint32_t slot = 0; success && slot < 2; slot++) {
+        Block             *b = &blocks[slot * slot_blocks];
+        JournalDescriptor *d = &b->descriptor;
+
+        if(disk_read(disk, start + slot * slot_blocks, b->data) == DISK_FAILURE) {
+            success = false;
+            break;
+        }
+
+        if(d->magic != JOURNAL_MAGIC || d->count >= slot_blocks) {
+            continue;
+        }
+
+        *sequence = max(*sequence, d->sequence + 1);
+
+        if(!recover || (newest >= 0 && d->sequence < blocks[newest * slot_blocks].descriptor.sequence)) {
+            continue;
+        }
+
+        // Check the home blocks and contents of transaction
+
+        bool intact = true;
+        for(uint32_t i = 0; i < d->count; i++) {
+            intact  = intact && d->targets[i] && d->targets[i] < super->blocks && (d->targets[i] < start || d->targets[i] >= start + super->journal_blocks);
+            numbers[i] = start + slot * slot_blocks + 1 + i;
+            bufs[i]    = b[1 + i].data;
+        }
+
+        if(!intact || disk_readv(disk, numbers, bufs, d->count) == DISK_FAILURE) {
+            continue;
+        }
+
+        if(fs_journal_checksum(b, b + 1, d->count) == d->checksum) {
+            newest = slot;
+        }
+    }
+
+    if(success && newest >= 0) {
+        Block             *b = &blocks[newest * slot_blocks];
+        JournalDescriptor *d = &b->descriptor;
+
+        for(uint32_t i = 0; i < d->count; i++) {
+            numbers[i] = d->targets[i];
+            bufs[i]    = b[1 + i].data;
+        }
+
+        success = disk_writev(disk, numbers, bufs, d->count) != DISK_FAILURE && disk_sync(disk);
+    }
+
+    free(blocks);
+    free(numbers);
+    free(bufs);
+    return success;
+}
+
+/**
+ * Compute checksum of a journal transaction (CRC32C over the descriptor,
+ * with its checksum taken as 0, and the blocks that follow it).
+ *
+ * @param       descriptor  Descriptor block of transaction.
+ * @param       blocks      Blocks following descriptor.
+ * @param       count       Number of blocks following descriptor.
+ * @return      Checksum of transaction.
+ **/
+uint32_t fs_journal_checksum(const Block *descriptor, Block *blocks, size_t count) {
+
+    Block header = *descriptor;
+
+    header.descriptor.checksum = 0;
+
+    uint32_t crc = crc32c(0, header.data, BLOCK_SIZE);
+    for(size_t b = 0; b < count; b++) {
+        crc = crc32c(crc, blocks[b].data, BLOCK_SIZE);
+    }
+
+    return crc;
+}
+
+/**
+ * Stage contents of a meta data block in the running transaction,
+ * replacing any copy staged before.
+ *
+ * @param       journal     Pointer to Journal structure.
+ * @param       block       Home block of contents.
+ * @param       data        Contents of block.
+ * @param       limit       Most blocks the transaction may hold.
+ * @return      Whether or not the block was staged (false if the
+ *              transaction is full).
+ **/
+bool    fs_journal_stage(Journal *journal, size_t block, const char *data, size_t limit) {
+
+    if(block == 0 || block >= journal->blocks) {
+        return false;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    uint32_t slot = journal->slots[block];
+
+    if(!slot && journal->count < limit) {
+        journal->targets[journal->count] = block;
+        slot = journal->slots[block] = ++journal->count;
+    }
+
+    if(slot) {
+        memcpy(journal->staged[slot - 1].data, data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    return slot != 0;
+}
+
+/**
+ * Start an operation that modifies the image, waiting for any commit in
+ * progress (nothing to do without FS_FEATURE_JOURNAL).
+ *
+ * Note: Caller must not hold any Inode lock, as a commit waits for the
+ * operations in progress.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ **/
+void    fs_journal_begin(FileSystem *fs) {
+
+    Journal *journal = fs->journal;
+
+    if(!journal) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    while(journal->committing) {
+        pthread_cond_wait(&journal->resume, &journal->lock);
+    }
+    journal->active++;
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/**
+ * Change the number of mapping blocks open Files will stage in the running
+ * transaction (nothing to do without FS_FEATURE_JOURNAL).
+ *
+ * @param       journal     Pointer to Journal structure (NULL is ignored).
+ * @param       blocks      Blocks reserved (negative to release them).
+ **/
+void    fs_journal_reserve(Journal *journal, ssize_t blocks) {
+
+    if(!journal || blocks == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    journal->reserved += blocks;
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/**
+ * Finish an operation started by fs_journal_begin, committing the running
+ * transaction if it holds at least its threshold of staged (or reserved)
+ * blocks.
+ *
+ * @param       fs      Pointer to FileSystem structure.
+ * @return      Whether or not any commit succeeded.
+ **/
+bool    fs_journal_end(FileSystem *fs) {
+
+    Journal *journal = fs->journal;
+
+    if(!journal) {
+        return true;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    bool due = journal->count + journal->reserved >= journal->threshold;
+    if(--journal->active == 0) {
+        pthread_cond_broadcast(&journal->idle);
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    return !due || fs_journal_commit(fs, journal->threshold);
+}
+
+/**
+ * Commit the running transaction by doing the following:
+ *
+ *  1. Hold back new operations and wait for the ones in progress.
+ *
+ *  2. Stage the dirty mapping blocks of open Files, the dirty Inode blocks
+ *  and the bitmap blocks that changed since the last commit.
+ *
+ *  3. Write a descriptor and every staged block to the next slot with one
+ *  vectored request and sync the Disk once.
+ *
+ *  4. Write the staged blocks to their home blocks, and make the blocks
+ *  released by the transaction free.
+ *
+ * Operations that ended while a commit was running are grouped into the
+ * next one.  File data is not journaled: it reaches the Disk with the same
+ * sync as the transaction that maps it.
+ *
+ * @param       fs          Pointer to FileSystem structure.
+ * @param       minimum     Staged and reserved blocks needed to commit (0
+ *                          to always commit and sync).
+ * @return      Whether or not the transaction was committed.
+ **/
+bool    fs_journal_commit(FileSystem *fs, size_t minimum) {
+
+    Journal *journal = fs->journal;
+
+    pthread_mutex_lock(&journal->lock);
+    while(journal->committing) {
+        pthread_cond_wait(&journal->resume, &journal->lock);
+    }
+
+    if(minimum && journal->count + journal->reserved < minimum) {
+        pthread_mutex_unlock(&journal->lock);
+        return true;
+    }
+
+    journal->committing = true;
+    while(journal->active) {
+        pthread_cond_wait(&journal->idle, &journal->lock);
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    // Stage resident mapping blocks and Inode table
+
+    bool committed = true;
+
+    pthread_mutex_lock(&fs->lock);
+    for(File *file = fs->files; committed && file; file = file->next) {
+        committed = fs_file_flush(fs, file);
+    }
+    committed = committed && fs_inode_flush(fs);
+    pthread_mutex_unlock(&fs->lock);
+
+    // Stage changed bitmap blocks (with released blocks free, as the
+    // Inodes that held them are staged as well)
+
+    SuperBlock *super  = &fs->meta_data;
+    size_t      words  = BITMAP_WORDS(super->blocks);
+    char       *bitmap = calloc(super->bitmap_blocks, BLOCK_SIZE);
+    uint64_t   *now    = (uint64_t *)bitmap;
+
+    committed = committed && bitmap;
+
+    for(size_t w = 0; committed && w < words; w++) {
+        now[w] = __atomic_load_n(&fs->free_blocks[w], __ATOMIC_RELAXED) | __atomic_load_n(&journal->released[w], __ATOMIC_RELAXED);
+    }
+
+    for(size_t b = 0; committed && b < super->bitmap_blocks; b++) {
+        char *block = bitmap + b * BLOCK_SIZE;
+        if(memcmp(block, journal->committed + b * BLOCK_SIZE, BLOCK_SIZE)) {
+            committed = fs_journal_stage(journal, 1 + super->inode_blocks + b, block, journal->slot_blocks - 1);
+        }
+    }
+
+    // Write transaction to its slot, sync, then write its home blocks
+
+    size_t  count   = journal->count;
+    size_t *numbers = malloc((count + 1) * sizeof(size_t));
+    char  **bufs    = malloc((count + 1) * sizeof(char *));
+    Block   descriptor;
+
+    committed = committed && numbers && bufs;
+
+    if(committed && count) {
+        JournalDescriptor *d    = &descriptor.descriptor;
+        size_t             slot = journal->start + (journal->sequence % 2) * journal->slot_blocks;
+
+        memset(descriptor.data, 0, BLOCK_SIZE);
+        d->magic    = JOURNAL_MAGIC;
+        d->sequence = journal->sequence;
+        d->count    = count;
+
+        for(size_t i = 0; i <= count; i++) {
+            numbers[i] = slot + i;
+            bufs[i]    = i ? journal->staged[i - 1].data : descriptor.data;
+            if(i) {
+                d->targets[i - 1] = journal->targets[i - 1];
+            }
+        }
+        d->checksum = fs_journal_checksum(&descriptor, journal->staged, count);
+
+        committed = disk_writev(fs->disk, numbers, bufs, count + 1) != DISK_FAILURE && disk_sync(fs->disk);
+        if(committed) {
+            journal->sequence++;
+        }
+        committed = committed && disk_writev(fs->disk, journal->targets, bufs + 1, count) != DISK_FAILURE;
+    } else if(committed) {
+        committed = disk_sync(fs->disk);
+    }
+
+    // Free released blocks (lowering the free hint) and clear transaction
+
+    if(committed) {
+        size_t lowest = super->blocks;
+
+        for(size_t w = 0; w < words; w++) {
+            uint64_t bits = __atomic_exchange_n(&journal->released[w], 0, __ATOMIC_RELAXED);
+            if(bits) {
+                __atomic_or_fetch(&fs->free_blocks[w], bits, __ATOMIC_RELEASE);
+                lowest = min(lowest, w * BITS_PER_WORD + __builtin_ctzll(bits));
+            }
+        }
+
+        size_t hint = __atomic_load_n(&fs->free_hint, __ATOMIC_ACQUIRE);
+        while(lowest < hint && !__atomic_compare_exchange_n(&fs->free_hint, &hint, lowest, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        memcpy(journal->committed, bitmap, super->bitmap_blocks * BLOCK_SIZE);
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    if(committed) {
+        for(size_t i = 0; i < journal->count; i++) {
+            journal->slots[journal->targets[i]] = 0;
+        }
+        journal->count = 0;
+    }
+    journal->committing = false;
+    pthread_cond_broadcast(&journal->resume);
+    pthread_mutex_unlock(&journal->lock);
+
+    free(bitmap);
+    free(numbers);
+    free(bufs);
+    return committed;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
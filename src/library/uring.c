@@ -0,0 +1,254 @@
+/* uring.c: SimpleFS io_uring submission ring */
+
+#include "sfs/uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Ring Structures */
+
+struct Uring {
+    int         fd;         /* Ring file descriptor			*/
+    unsigned    entries;    /* Number of submission entries		*/
+    unsigned   *sq_head;    /* Submission head (kernel)		*/
+    unsigned   *sq_tail;    /* Submission tail (us)			*/
+    unsigned   *sq_mask;    /* Submission index mask		*/
+    unsigned   *sq_array;   /* Submission index array		*/
+    unsigned   *cq_head;    /* Completion head (us)			*/
+    unsigned   *cq_tail;    /* Completion tail (kernel)		*/
+    unsigned   *cq_mask;    /* Completion index mask		*/
+    struct io_uring_sqe *sqes; /* Submission entries		*/
+    struct io_uring_cqe *cqes; /* Completion entries		*/
+    void       *sq_ring;    /* Mapping of submission ring		*/
+    size_t      sq_size;    /* Size of submission ring mapping	*/
+    void       *cq_ring;    /* Mapping of completion ring		*/
+    size_t      cq_size;    /* Size of completion ring mapping	*/
+    size_t      sqes_size;  /* Size of submission entries mapping	*/
+    unsigned    queued;     /* Prepared but not yet submitted	*/
+    unsigned    inflight;   /* Submitted but not yet reaped		*/
+};
+
+/* External Functions */
+
+/**
+ * Set up an io_uring by doing the following:
+ *
+ *  1. Create the ring with io_uring_setup.
+ *
+ *  2. Map the submission ring, completion ring and submission entries.
+ *
+ * Note: The raw system calls are used, so no liburing is needed.
+ *
+ * @param       entries     Number of submission entries (rounded up to a
+ *                          power of two by the kernel).
+ *
+ * @return      Pointer to newly allocated Uring (NULL on failure, with
+ *              errno set).
+ **/
+Uring *     uring_open(unsigned entries) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    Uring *ring = calloc(1, sizeof(Uring));
+    if(!ring) {
+        return NULL;
+    }
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->entries   = params.sq_entries;
+    ring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size   = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes    = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved = errno;
+        uring_close(ring);
+        errno = saved;
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/**
+ * Unmap and close ring.
+ *
+ * Note: Requests still in flight are abandoned, so reap them first.
+ *
+ * @param       ring        Pointer to Uring structure.
+ **/
+void        uring_close(Uring *ring) {
+
+    if(!ring) {
+        return;
+    }
+
+    if(ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_size);
+    }
+
+    if(ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_size);
+    }
+
+    if(ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * Queue a read or write request on the submission ring (it is handed to
+ * the kernel by the next uring_enter).
+ *
+ * @param       ring        Pointer to Uring structure.
+ * @param       op          Operation to perform.
+ * @param       fd          File descriptor to transfer to or from.
+ * @param       addr        Buffer (or iovec array for vectored operations).
+ * @param       len         Bytes to transfer (or iovec count).
+ * @param       offset      File offset to transfer at.
+ * @param       tag         Value returned by uring_reap on completion.
+ *
+ * @return      Whether or not the request was queued (false if ring is full).
+ **/
+bool        uring_prep(Uring *ring, UringOp op, int fd, const void *addr, unsigned len, off_t offset, void *tag) {
+
+    static const uint8_t OPCODES[] = {
+        [URING_READ]   = IORING_OP_READ,
+        [URING_WRITE]  = IORING_OP_WRITE,
+        [URING_READV]  = IORING_OP_READV,
+        [URING_WRITEV] = IORING_OP_WRITEV,
+    };
+
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+
+    if(tail - head >= ring->entries || ring->queued + ring->inflight >= ring->entries) {
+        return false;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = OPCODES[op];
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)addr;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->user_data = (uintptr_t)tag;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return true;
+}
+
+/**
+ * Submit queued requests and wait for completions with one io_uring_enter.
+ *
+ * @param       ring        Pointer to Uring structure.
+ * @param       wait        Minimum number of completions to wait for
+ *                          (capped at the number of requests in flight).
+ *
+ * @return      1 if io_uring_enter was called, 0 if there was nothing to
+ *              submit or wait for (-1 on failure, with errno set).
+ **/
+int         uring_enter(Uring *ring, unsigned wait) {
+
+    unsigned submit = ring->queued;
+    unsigned flags  = 0;
+    int      result;
+
+    wait = wait < ring->queued + ring->inflight ? wait : ring->queued + ring->inflight;
+    if(wait > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if(submit == 0 && wait == 0) {
+        return 0;
+    }
+
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, NULL, 0);
+    } while(result < 0 && errno == EINTR);
+
+    if(result < 0) {
+        return -1;
+    }
+
+    ring->queued   -= result;
+    ring->inflight += result;
+    return 1;
+}
+
+/**
+ * Pop one completion from the completion ring, if any.
+ *
+ * @param       ring        Pointer to Uring structure.
+ * @param       tag         Set to tag of completed request.
+ * @param       result      Set to result of completed request (bytes
+ *                          transferred, or -errno on failure).
+ *
+ * @return      Whether or not a completion was available.
+ **/
+bool        uring_reap(Uring *ring, void **tag, ssize_t *result) {
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if(head == tail) {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *tag    = (void *)(uintptr_t)cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->inflight--;
+    return true;
+}
+
+/**
+ * Return number of requests queued or in flight but not yet reaped.
+ *
+ * @param       ring        Pointer to Uring structure.
+ *
+ * @return      Number of outstanding requests.
+ **/
+unsigned    uring_pending(const Uring *ring) {
+    return ring->queued + ring->inflight;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,5 +1,6 @@
 /* sfssh.c: SimpleFS shell */
 
+#include "sfs/bitmap.h"
 #include "sfs/disk.h"
 #include "sfs/fs.h"
 
@@ -7,83 +8,205 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 /* Macros */
 
 #define streq(a, b)	(strcmp((a), (b)) == 0)
 
+/* Transfer Constants */
+
+#define TRANSFER_BLOCKS	 (64)	/* Default blocks moved per copyin/copyout step */
+#define TRANSFER_BUFFERS (2)	/* Buffers in flight between host and SFS I/O */
+
+/* Transfer Structures */
+
+typedef ssize_t (*TransferFunc)(void *arg, char *buffer, size_t length, size_t offset);
+
+typedef struct Transfer Transfer;
+struct Transfer {
+    TransferFunc    produce;	/* Fills a buffer (bytes, 0 at end, -1 on error) */
+    TransferFunc    consume;	/* Drains a buffer (bytes, -1 on error) */
+    void           *arg;	/* Argument to both functions */
+    size_t          size;	/* Bytes per buffer (multiple of BLOCK_SIZE) */
+    char           *buffers[TRANSFER_BUFFERS];
+    size_t          lengths[TRANSFER_BUFFERS];
+    size_t          produced;	/* Number of buffers filled */
+    size_t          consumed;	/* Number of buffers drained */
+    bool            done;	/* Whether or not producer finished */
+    bool            failed;	/* Whether or not either side failed */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+/* Batch Structures */
+
+typedef enum {
+    BATCH_NONE,		/* Command is run on its own */
+    BATCH_CREATE,	/* create (grouped into fs_create_many) */
+    BATCH_REMOVE,	/* remove <inode> (grouped into fs_remove_many) */
+} BatchKind;
+
+typedef struct Batch Batch;
+struct Batch {
+    BatchKind   kind;		/* Kind of commands in group */
+    size_t      count;		/* Number of commands in group */
+    size_t      capacity;	/* Number of inodes allocated */
+    size_t     *inodes;		/* Inode of each command (BATCH_REMOVE) */
+    size_t      commands;	/* Number of commands run */
+    size_t      batched;	/* Number of commands run in a group */
+    size_t      calls;		/* Number of grouped library calls */
+};
+
+typedef struct Endpoint Endpoint;
+struct Endpoint {
+    FileSystem     *fs;		/* File system to transfer to or from */
+    size_t          inode_number; /* Inode to transfer to or from */
+    int             fd;		/* Host file to transfer to or from */
+};
+
+/* Globals */
+
+size_t TransferSize = TRANSFER_BLOCKS * BLOCK_SIZE;	/* Bytes per transfer buffer */
+uint32_t InodeRatio = INODE_RATIO;			/* Disk blocks per Inode block on format */
+
 /* Command Prototyes */
 
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_mount(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
-void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *line);
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_cat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2);
 
+/* Batch Prototypes */
+
+bool execute(Disk *disk, FileSystem *fs, char *line);
+void batch(Disk *disk, FileSystem *fs, FILE *stream);
+BatchKind batch_kind(char *line, size_t *inode_number);
+bool batch_add(Batch *b, BatchKind kind, size_t inode_number);
+void batch_flush(FileSystem *fs, Batch *b);
+double now();
+
 /* Utility Prototypes */
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path);
 bool copyin(FileSystem *fs, const char *path, size_t inode_number);
+ssize_t transfer(TransferFunc produce, TransferFunc consume, void *arg);
+void *transfer_producer(void *arg);
+ssize_t host_read(void *arg, char *buffer, size_t length, size_t offset);
+ssize_t host_write(void *arg, char *buffer, size_t length, size_t offset);
+ssize_t sfs_read(void *arg, char *buffer, size_t length, size_t offset);
+ssize_t sfs_write(void *arg, char *buffer, size_t length, size_t offset);
 
 /* Main Execution */
 
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-b bufblocks] [-c cacheblocks] [-d file|mmap|uring|memory] [-f script] [-i ratio] [-s] <diskfile> <nblocks>\n", program);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    size_t cache_blocks = 0;
+    DiskBackend backend = DISK_FILE;
+    const char *script = NULL;
+    bool sparse = false;
+    int option;
+
+    while ((option = getopt(argc, argv, "b:c:d:f:i:s")) != -1) {
+	switch (option) {
+	    case 'b':
+		if (atoi(optarg) <= 0) {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		TransferSize = atoi(optarg) * BLOCK_SIZE;
+		break;
+	    case 'c':
+		cache_blocks = atoi(optarg);
+		break;
+	    case 'd':
+		if (streq(optarg, "file")) {
+		    backend = DISK_FILE;
+		} else if (streq(optarg, "mmap")) {
+		    backend = DISK_MMAP;
+		} else if (streq(optarg, "uring")) {
+		    backend = DISK_URING;
+		} else if (streq(optarg, "memory")) {
+		    backend = DISK_MEMORY;
+		} else {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		break;
+	    case 'f':
+		script = optarg;
+		break;
+	    case 'i':
+		if (atoi(optarg) <= 0) {
+		    usage(argv[0]);
+		    return EXIT_FAILURE;
+		}
+		InodeRatio = atoi(optarg);
+		break;
+	    case 's':
+		sparse = true;
+		break;
+	    default:
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 2) {
+	usage(argv[0]);
 	return EXIT_FAILURE;
     }
 
-    Disk *disk = disk_open(argv[1], atoi(argv[2]));
+    Disk *disk = disk_open_backend(argv[optind], atoi(argv[optind + 1]), backend);
     if (!disk) {
     	return EXIT_FAILURE;
     }
 
-    FileSystem fs = {0};
-    while (true) {
-	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
-	fprintf(stderr, "sfs> ");
-	fflush(stderr);
+    if (!disk_cache(disk, cache_blocks)) {
+	fprintf(stderr, "Unable to allocate %lu block cache\n", cache_blocks);
+	disk_close(disk);
+	return EXIT_FAILURE;
+    }
 
-	if (fgets(line, BUFSIZ, stdin) == NULL) {
-	    break;
-	}
+    FILE *stream = NULL;
+    if (script && !(stream = streq(script, "-") ? stdin : fopen(script, "r"))) {
+	fprintf(stderr, "Unable to open %s: %s\n", script, strerror(errno));
+	disk_close(disk);
+	return EXIT_FAILURE;
+    }
 
-	int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
-	if (args == 0) {
-	    continue;
+    FileSystem fs = {0};
+    fs_sparse(&fs, sparse);
+    if (stream) {
+	batch(disk, &fs, stream);
+	if (stream != stdin) {
+	    fclose(stream);
 	}
+    }
 
+    while (!stream) {
+	char line[BUFSIZ];
+	fprintf(stderr, "sfs> ");
+	fflush(stderr);
 
-	if (streq(cmd, "debug")) {
-	    do_debug(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "format")) {
-	    do_format(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "mount")) {
-	    do_mount(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "create")) {
-	    do_create(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "remove")) {
-	    do_remove(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "stat")) {
-	    do_stat(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "cat")) {
-	    do_cat(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, &fs, args, arg1, arg2);
-        } else if (streq(cmd, "help")) {
-	    do_help(disk, &fs, args, arg1, arg2);
-	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
+	if (fgets(line, BUFSIZ, stdin) == NULL || !execute(disk, &fs, line)) {
 	    break;
-	} else {
-	    printf("Unknown command: %s", line);
-	    printf("Type 'help' for a list of commands.\n");
 	}
     }
 
@@ -94,6 +217,180 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
 }
 
+/* Batch Functions */
+
+bool execute(Disk *disk, FileSystem *fs, char *line) {
+    char cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
+
+    int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
+    if (args == 0) {
+	return true;
+    }
+
+    if (streq(cmd, "debug")) {
+	do_debug(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "format")) {
+	do_format(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "mount")) {
+	do_mount(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "create")) {
+	do_create(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "remove")) {
+	do_remove(disk, fs, args, arg1, line);
+    } else if (streq(cmd, "stat")) {
+	do_stat(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "copyout")) {
+	do_copyout(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "cat")) {
+	do_cat(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "copyin")) {
+	do_copyin(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "sync")) {
+	do_sync(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "defrag")) {
+	do_defrag(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "stats")) {
+	do_stats(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "help")) {
+	do_help(disk, fs, args, arg1, arg2);
+    } else if (streq(cmd, "exit") || streq(cmd, "quit")) {
+	return false;
+    } else {
+	printf("Unknown command: %s", line);
+	printf("Type 'help' for a list of commands.\n");
+    }
+
+    return true;
+}
+
+/**
+ * Run every command in stream without prompts, with stdout fully buffered,
+ * then report aggregate timing on stderr.
+ *
+ * Runs of "create" and of single inode "remove" commands are each executed
+ * with one fs_create_many or fs_remove_many call; their output is the same
+ * as running the commands one at a time.
+ **/
+void batch(Disk *disk, FileSystem *fs, FILE *stream) {
+    char   line[BUFSIZ];
+    Batch  b = {BATCH_NONE};
+    double start = now();
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+    while (fgets(line, BUFSIZ, stream)) {
+	size_t    inode_number = 0;
+	BatchKind kind = batch_kind(line, &inode_number);
+
+	b.commands++;
+	if (kind != b.kind) {
+	    batch_flush(fs, &b);
+	}
+
+	if (kind != BATCH_NONE && batch_add(&b, kind, inode_number)) {
+	    continue;
+	}
+
+	batch_flush(fs, &b);
+	if (!execute(disk, fs, line)) {
+	    break;
+	}
+    }
+    batch_flush(fs, &b);
+    free(b.inodes);
+    fflush(stdout);
+
+    double seconds = now() - start;
+    fprintf(stderr, "%lu commands (%lu in %lu batched calls) in %.6f seconds (%.0f commands/sec)\n",
+	b.commands, b.batched, b.calls, seconds, seconds > 0 ? b.commands / seconds : 0.0);
+}
+
+BatchKind batch_kind(char *line, size_t *inode_number) {
+    char cmd[BUFSIZ], arg1[BUFSIZ];
+
+    int args = sscanf(line, "%s %s", cmd, arg1);
+    if (args == 1 && streq(cmd, "create")) {
+	return BATCH_CREATE;
+    }
+
+    if (args == 2 && streq(cmd, "remove")) {
+	char extra[BUFSIZ];
+	*inode_number = atoi(arg1);
+	return sscanf(line, "%*s %*s %s", extra) == 1 ? BATCH_NONE : BATCH_REMOVE;
+    }
+
+    return BATCH_NONE;
+}
+
+bool batch_add(Batch *b, BatchKind kind, size_t inode_number) {
+    if (b->count == b->capacity) {
+	size_t  capacity = b->capacity ? 2 * b->capacity : 64;
+	size_t *grown    = realloc(b->inodes, capacity * sizeof(size_t));
+	if (!grown) {
+	    return false;
+	}
+	b->inodes   = grown;
+	b->capacity = capacity;
+    }
+
+    b->kind = kind;
+    b->inodes[b->count++] = inode_number;
+    return true;
+}
+
+void batch_flush(FileSystem *fs, Batch *b) {
+    size_t n = b->count;
+
+    if (n == 0) {
+	b->kind = BATCH_NONE;
+	return;
+    }
+
+    if (b->kind == BATCH_CREATE) {
+	ssize_t created = fs_create_many(fs, b->inodes, n);
+	for (size_t i = 0; i < n; i++) {
+	    if ((ssize_t)i < created) {
+		printf("created inode %ld.\n", b->inodes[i]);
+	    } else {
+		printf("create failed!\n");
+	    }
+	}
+    } else {
+	/* Only the first remove of each valid inode succeeds */
+	size_t    inodes = fs->disk ? fs->meta_data.inodes : 0;
+	uint64_t *unseen = bitmap_create(inodes, true);
+	bool     *valid  = calloc(n, sizeof(bool));
+	size_t   *remove = malloc(n * sizeof(size_t));
+	size_t    nremove = 0;
+
+	for (size_t i = 0; unseen && valid && remove && i < n; i++) {
+	    size_t inode_number = b->inodes[i];
+	    valid[i] = inode_number < inodes && fs_stat(fs, inode_number) >= 0 && bitmap_claim(unseen, inode_number);
+	    if (valid[i]) {
+		remove[nremove++] = inode_number;
+	    }
+	}
+
+	bool removed = unseen && valid && remove && fs_remove_many(fs, remove, nremove) == (ssize_t)nremove;
+	for (size_t i = 0; i < n; i++) {
+	    if (removed && valid[i]) {
+		printf("removed inode %ld.\n", b->inodes[i]);
+	    } else {
+		printf("remove failed!\n");
+	    }
+	}
+
+	free(unseen);
+	free(valid);
+	free(remove);
+    }
+
+    b->batched += n;
+    b->calls++;
+    b->count = 0;
+    b->kind  = BATCH_NONE;
+}
+
 /* Command Functions */
 
 void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
@@ -105,12 +402,34 @@ void do_debug(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-	printf("Usage: format\n");
+    uint32_t features = FS_FEATURE_DINDIRECT;
+    char    *options[] = {arg1, arg2};
+    bool     wipe = false;
+
+    for (int i = 0; i < args - 1; i++) {
+	if (streq(options[i], "extents")) {
+	    features = (features & ~FS_FEATURE_DINDIRECT) | FS_FEATURE_EXTENTS;
+	} else if (streq(options[i], "inline")) {
+	    features |= FS_FEATURE_INLINE;
+	} else if (streq(options[i], "journal")) {
+	    features |= FS_FEATURE_JOURNAL;
+	} else if (streq(options[i], "checksums")) {
+	    features |= FS_FEATURE_CHECKSUMS;
+	} else if (streq(options[i], "datasums")) {
+	    features |= FS_FEATURE_DATA_SUMS;
+	} else if (streq(options[i], "wipe")) {
+	    wipe = true;
+	} else {
+	    args = 0;
+	}
+    }
+
+    if (args == 0) {
+	printf("Usage: format [extents] [inline] [journal] [checksums] [datasums] [wipe]\n");
 	return;
     }
 
-    if (fs_format(fs, disk)) {
+    if (fs_format_density(fs, disk, features, InodeRatio, wipe)) {
         printf("disk formatted.\n");
     } else {
         printf("format failed!\n");
@@ -144,18 +463,48 @@ void do_create(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
-void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
-    if (args != 2) {
-        printf("Usage: remove <inode>\n");
+void do_remove(Disk *disk, FileSystem *fs, int args, char *arg1, char *line) {
+    if (args < 2) {
+        printf("Usage: remove <inode> [inode...]\n");
+        return;
+    }
+
+    if (args == 2) {
+        size_t inode_number = atoi(arg1);
+        if (fs_remove(fs, inode_number)) {
+            printf("removed inode %ld.\n", inode_number);
+        } else {
+            printf("remove failed!\n");
+        }
         return;
     }
 
-    size_t inode_number = atoi(arg1);
-    if (fs_remove(fs, inode_number)) {
-        printf("removed inode %ld.\n", inode_number);
+    /* Several inodes: remove them all with one batched call */
+    size_t  capacity = 16, n = 0;
+    size_t *inodes   = malloc(capacity * sizeof(size_t));
+    char   *save     = NULL;
+
+    strtok_r(line, " \t\n", &save);
+    for (char *token = strtok_r(NULL, " \t\n", &save); inodes && token; token = strtok_r(NULL, " \t\n", &save)) {
+        if (n == capacity) {
+            size_t *grown = realloc(inodes, (capacity *= 2) * sizeof(size_t));
+            if (!grown) {
+                free(inodes);
+                inodes = NULL;
+                break;
+            }
+            inodes = grown;
+        }
+        inodes[n++] = atoi(token);
+    }
+
+    ssize_t removed = inodes ? fs_remove_many(fs, inodes, n) : -1;
+    if (removed >= 0) {
+        printf("removed %ld of %lu inodes.\n", removed, n);
     } else {
         printf("remove failed!\n");
     }
+    free(inodes);
 }
 
 void do_stat(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
@@ -206,17 +555,104 @@ void do_copyin(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_sync(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+        printf("Usage: sync\n");
+        return;
+    }
+
+    if (fs_sync(fs)) {
+        printf("disk synced.\n");
+    } else {
+        printf("sync failed!\n");
+    }
+}
+
+void do_defrag(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+        printf("Usage: defrag <inode>\n");
+        return;
+    }
+
+    ssize_t inode_number = atoi(arg1);
+    ssize_t moved        = fs_defrag(fs, inode_number);
+    ssize_t extents      = fs_fragments(fs, inode_number);
+    if (moved >= 0 && extents >= 0) {
+        printf("defragmented inode %ld: moved %ld blocks, %ld extents.\n", inode_number, moved, extents);
+    } else {
+        printf("defrag failed!\n");
+    }
+}
+
+void do_stats(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+	printf("Usage: stats [reset]\n");
+	return;
+    }
+
+    if (args == 2) {
+	fs_stats_reset(fs);
+	printf("stats reset.\n");
+	return;
+    }
+
+    FsStats stats;
+    fs_stats(fs, &stats);
+    if (!fs->disk) {
+	disk_stats(disk, &stats.disk);
+    }
+
+    printf("Operations:\n");
+    printf("    %-8s %8s %8s %10s %10s %10s %10s %8s %8s %8s %8s\n",
+	"op", "calls", "failures", "avg_usec", "p50_usec", "p99_usec", "max_usec",
+	"meta_rd", "meta_wr", "data_rd", "data_wr");
+
+    for (FsOp op = 0; op < FS_OPS; op++) {
+	OpStats *s = &stats.ops[op];
+	if (s->calls == 0) {
+	    continue;
+	}
+
+	printf("    %-8s %8lu %8lu %10.1f %10.0f %10.0f %10.1f %8lu %8lu %8lu %8lu\n",
+	    fs_stats_name(op), s->calls, s->failures,
+	    s->nsecs / 1e3 / s->calls,
+	    fs_stats_percentile(s, 0.50),
+	    fs_stats_percentile(s, 0.99),
+	    s->max_nsecs / 1e3,
+	    s->reads[DISK_METADATA], s->writes[DISK_METADATA],
+	    s->reads[DISK_DATA], s->writes[DISK_DATA]);
+    }
+
+    printf("Disk:\n");
+    printf("    %lu block reads\n", stats.disk.reads);
+    printf("    %lu block writes\n", stats.disk.writes);
+    printf("    %lu system calls\n", stats.disk.syscalls);
+    if (stats.disk.corrupt) {
+	printf("    %lu checksum errors\n", stats.disk.corrupt);
+    }
+
+    if (stats.disk.cached) {
+	size_t lookups = stats.disk.hits + stats.disk.misses;
+	printf("    %lu block cache: %lu hits, %lu misses (%.1f%% hit ratio)\n",
+	    stats.disk.cached, stats.disk.hits, stats.disk.misses,
+	    lookups ? 100.0 * stats.disk.hits / lookups : 0.0);
+    }
+}
+
 void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [extents] [inline] [journal] [checksums] [datasums] [wipe]\n");
     printf("    mount\n");
     printf("    debug\n");
     printf("    create\n");
-    printf("    remove  <inode>\n");
+    printf("    remove  <inode> [inode...]\n");
     printf("    cat     <inode>\n");
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    sync\n");
+    printf("    defrag  <inode>\n");
+    printf("    stats   [reset]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -224,56 +660,222 @@ void do_help(Disk *disk, FileSystem *fs, int args, char *arg1, char *arg2) {
 
 /* Utility Functions */
 
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 bool copyin(FileSystem *fs, const char *path, size_t inode_number) {
-    FILE *stream = fopen(path, "r");
-    if (!stream) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
-    while (true) {
-        ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
-        if (result <= 0) {
-            break;
-        }
-        ssize_t actual = fs_write(fs, inode_number, buffer, result, offset);
-        if (actual < 0) {
-            fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
-            break;
-        }
-        offset += actual;
-        if (actual != result) {
-            fprintf(stderr, "fs_write only wrote %ld bytes, not %ld bytes\n", actual, result);
-            break;
-        }
+    bool     opened = fs_open(fs, inode_number);
+    Endpoint e      = {fs, inode_number, fd};
+    ssize_t  copied = transfer(host_read, sfs_write, &e);
+
+    if (opened && !fs_close(fs, inode_number)) {
+        fprintf(stderr, "fs_close failed\n");
     }
-    printf("%lu bytes copied\n", offset);
-    fclose(stream);
+    printf("%lu bytes copied\n", copied < 0 ? 0 : copied);
+    close(fd);
     return true;
 }
 
 bool copyout(FileSystem *fs, size_t inode_number, const char *path) {
-    FILE *stream = fopen(path, "w");
-    if (!stream) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
         fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
+    /* Data may go to our own standard output */
+    fflush(stdout);
+
+    bool     opened = fs_open(fs, inode_number);
+    Endpoint e      = {fs, inode_number, fd};
+    ssize_t  copied = transfer(sfs_read, host_write, &e);
+
+    if (opened && !fs_close(fs, inode_number)) {
+        fprintf(stderr, "fs_close failed\n");
+    }
+    printf("%lu bytes copied\n", copied < 0 ? 0 : copied);
+    close(fd);
+    return true;
+}
+
+/**
+ * Stream data from produce to consume through TRANSFER_BUFFERS block
+ * aligned buffers of TransferSize bytes, producing on a separate thread so
+ * host file I/O overlaps SFS block I/O.
+ *
+ * Every buffer except the last is filled completely, so each SFS read or
+ * write covers whole blocks and needs no read-modify-write.
+ *
+ * @return  Number of bytes consumed (up to any failure).
+ **/
+ssize_t transfer(TransferFunc produce, TransferFunc consume, void *arg) {
+    Transfer t = {produce, consume, arg, TransferSize};
+    size_t   offset = 0;
+    bool     allocated = true;
+
+    for (size_t b = 0; b < TRANSFER_BUFFERS; b++) {
+	allocated = allocated && posix_memalign((void **)&t.buffers[b], BLOCK_SIZE, t.size) == 0;
+    }
+
+    pthread_t thread;
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.cond, NULL);
+
+    if (!allocated || pthread_create(&thread, NULL, transfer_producer, &t) != 0) {
+	fprintf(stderr, "Unable to start transfer: %s\n", strerror(errno));
+	for (size_t b = 0; b < TRANSFER_BUFFERS; b++) {
+	    free(t.buffers[b]);
+	}
+	pthread_mutex_destroy(&t.lock);
+	pthread_cond_destroy(&t.cond);
+	return -1;
+    }
+
+    while (true) {
+	pthread_mutex_lock(&t.lock);
+	while (t.consumed == t.produced && !t.done && !t.failed) {
+	    pthread_cond_wait(&t.cond, &t.lock);
+	}
+	bool   empty  = t.consumed == t.produced || t.failed;
+	size_t slot   = t.consumed % TRANSFER_BUFFERS;
+	size_t length = t.lengths[slot];
+	pthread_mutex_unlock(&t.lock);
+
+	if (empty) {
+	    break;
+	}
+
+	ssize_t actual  = consume(arg, t.buffers[slot], length, offset);
+	bool    drained = actual == (ssize_t)length;
+
+	pthread_mutex_lock(&t.lock);
+	offset += actual > 0 ? actual : 0;
+	if (drained) {
+	    t.consumed++;
+	} else {
+	    t.failed = true;
+	}
+	pthread_cond_signal(&t.cond);
+	pthread_mutex_unlock(&t.lock);
+
+	if (!drained) {
+	    break;
+	}
+    }
+
+    pthread_join(thread, NULL);
+    for (size_t b = 0; b < TRANSFER_BUFFERS; b++) {
+	free(t.buffers[b]);
+    }
+    pthread_mutex_destroy(&t.lock);
+    pthread_cond_destroy(&t.cond);
+    return offset;
+}
+
+void *transfer_producer(void *arg) {
+    Transfer *t = arg;
     size_t offset = 0;
+
     while (true) {
-        ssize_t result = fs_read(fs, inode_number, buffer, sizeof(buffer), offset);
-        if (result <= 0) {
-            break;
-        }
-        fwrite(buffer, 1, result, stream);
-        offset += result;
+	pthread_mutex_lock(&t->lock);
+	while (t->produced - t->consumed == TRANSFER_BUFFERS && !t->failed) {
+	    pthread_cond_wait(&t->cond, &t->lock);
+	}
+	bool   stop = t->failed;
+	size_t slot = t->produced % TRANSFER_BUFFERS;
+	pthread_mutex_unlock(&t->lock);
+
+	if (stop) {
+	    break;
+	}
+
+	ssize_t length = t->produce(t->arg, t->buffers[slot], t->size, offset);
+
+	pthread_mutex_lock(&t->lock);
+	if (length > 0) {
+	    t->lengths[slot] = length;
+	    t->produced++;
+	    offset += length;
+	} else {
+	    t->done = true;
+	}
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	if (length <= 0) {
+	    break;
+	}
     }
-    printf("%lu bytes copied\n", offset);
-    fclose(stream);
-    return true;
+
+    return NULL;
+}
+
+ssize_t host_read(void *arg, char *buffer, size_t length, size_t offset) {
+    Endpoint *e = arg;
+    size_t    total = 0;
+
+    /* Fill whole buffer (pipes return short reads) */
+    while (total < length) {
+	ssize_t result = read(e->fd, buffer + total, length - total);
+	if (result < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (result < 0) {
+	    fprintf(stderr, "Unable to read: %s\n", strerror(errno));
+	    return total ? (ssize_t)total : -1;
+	}
+	if (result == 0) {
+	    break;
+	}
+	total += result;
+    }
+
+    return total;
+}
+
+ssize_t host_write(void *arg, char *buffer, size_t length, size_t offset) {
+    Endpoint *e = arg;
+    size_t    total = 0;
+
+    while (total < length) {
+	ssize_t result = write(e->fd, buffer + total, length - total);
+	if (result < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (result < 0) {
+	    fprintf(stderr, "Unable to write: %s\n", strerror(errno));
+	    return -1;
+	}
+	total += result;
+    }
+
+    return total;
+}
+
+ssize_t sfs_read(void *arg, char *buffer, size_t length, size_t offset) {
+    Endpoint *e = arg;
+    return fs_read(e->fs, e->inode_number, buffer, length, offset);
+}
+
+ssize_t sfs_write(void *arg, char *buffer, size_t length, size_t offset) {
+    Endpoint *e = arg;
+
+    ssize_t actual = fs_write(e->fs, e->inode_number, buffer, length, offset);
+    if (actual < 0) {
+        fprintf(stderr, "fs_write returned invalid result %ld\n", actual);
+    } else if (actual != (ssize_t)length) {
+        fprintf(stderr, "fs_write only wrote %ld bytes, not %ld bytes\n", actual, length);
+    }
+    return actual;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,167 @@
+/* unit_bitmap.c: Unit tests for SimpleFS packed bitmap */
+
+#include "sfs/bitmap.h"
+#include "sfs/logging.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define BITMAP_BITS (200)
+#define THREADS     (4)
+
+/* Functions */
+
+int test_00_bitmap_create() {
+    debug("Check all clear");
+    uint64_t *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+    assert(bitmap_count(bitmap, BITMAP_BITS) == 0);
+    assert(bitmap_find(bitmap, BITMAP_BITS, 0) == -1);
+    free(bitmap);
+
+    debug("Check all set");
+    bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+    assert(bitmap_count(bitmap, BITMAP_BITS) == BITMAP_BITS);
+    for (size_t i = 0; i < BITMAP_BITS; i++) {
+        assert(bitmap_get(bitmap, i));
+    }
+
+    debug("Check padding bits");
+    assert(bitmap[BITMAP_WORDS(BITMAP_BITS) - 1] >> (BITMAP_BITS % BITS_PER_WORD) == 0);
+    free(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_01_bitmap_set() {
+    uint64_t *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    debug("Check set and clear");
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 63);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, BITMAP_BITS - 1);
+    assert(bitmap_get(bitmap, 0));
+    assert(bitmap_get(bitmap, 63));
+    assert(bitmap_get(bitmap, 64));
+    assert(bitmap_get(bitmap, 1) == false);
+    assert(bitmap_count(bitmap, BITMAP_BITS) == 4);
+
+    bitmap_clear(bitmap, 63);
+    assert(bitmap_get(bitmap, 63) == false);
+    assert(bitmap_get(bitmap, 64));
+    assert(bitmap_count(bitmap, BITMAP_BITS) == 3);
+
+    free(bitmap);
+    return EXIT_SUCCESS;
+}
+
+int test_02_bitmap_find() {
+    uint64_t *bitmap = bitmap_create(BITMAP_BITS, false);
+    assert(bitmap);
+
+    bitmap_set(bitmap, 5);
+    bitmap_set(bitmap, 130);
+    bitmap_set(bitmap, BITMAP_BITS - 1);
+
+    debug("Check find from start");
+    assert(bitmap_find(bitmap, BITMAP_BITS, 0) == 5);
+    assert(bitmap_find(bitmap, BITMAP_BITS, 5) == 5);
+
+    debug("Check find across words");
+    assert(bitmap_find(bitmap, BITMAP_BITS, 6) == 130);
+    assert(bitmap_find(bitmap, BITMAP_BITS, 131) == BITMAP_BITS - 1);
+
+    debug("Check find clear");
+    assert(bitmap_find_clear(bitmap, BITMAP_BITS, 0) == 0);
+    assert(bitmap_find_clear(bitmap, BITMAP_BITS, 5) == 6);
+    for (size_t i = 0; i < 70; i++) {
+        bitmap_set(bitmap, i);
+    }
+    assert(bitmap_find_clear(bitmap, BITMAP_BITS, 3) == 70);
+    assert(bitmap_find_clear(bitmap, BITMAP_BITS, BITMAP_BITS - 1) == BITMAP_BITS);
+    for (size_t i = 6; i < 70; i++) {
+        bitmap_clear(bitmap, i);
+    }
+
+    debug("Check find past end");
+    assert(bitmap_find(bitmap, BITMAP_BITS, BITMAP_BITS) == -1);
+    bitmap_clear(bitmap, BITMAP_BITS - 1);
+    assert(bitmap_find(bitmap, BITMAP_BITS, 131) == -1);
+
+    free(bitmap);
+    return EXIT_SUCCESS;
+}
+
+void *claim_all(void *arg) {
+    uint64_t *bitmap = arg;
+    size_t claimed = 0;
+
+    for (size_t i = 0; i < BITMAP_BITS; i++) {
+        claimed += bitmap_claim(bitmap, i);
+    }
+
+    return (void *)claimed;
+}
+
+int test_03_bitmap_claim() {
+    uint64_t *bitmap = bitmap_create(BITMAP_BITS, true);
+    assert(bitmap);
+
+    debug("Check claim");
+    assert(bitmap_claim(bitmap, 5) == true);
+    assert(bitmap_get(bitmap, 5) == false);
+    assert(bitmap_claim(bitmap, 5) == false);
+    bitmap_set(bitmap, 5);
+
+    debug("Check concurrent claims");
+    pthread_t threads[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&threads[t], NULL, claim_all, bitmap) == 0);
+    }
+
+    size_t total = 0;
+    for (size_t t = 0; t < THREADS; t++) {
+        void *claimed;
+        assert(pthread_join(threads[t], &claimed) == 0);
+        total += (size_t)claimed;
+    }
+    assert(total == BITMAP_BITS);
+    assert(bitmap_count(bitmap, BITMAP_BITS) == 0);
+
+    free(bitmap);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test bitmap_create\n");
+        fprintf(stderr, "    1. Test bitmap_set\n");
+        fprintf(stderr, "    2. Test bitmap_find\n");
+        fprintf(stderr, "    3. Test bitmap_claim\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_bitmap_create(); break;
+        case 1:  status = test_01_bitmap_set(); break;
+        case 2:  status = test_02_bitmap_find(); break;
+        case 3:  status = test_03_bitmap_claim(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,9 +1,11 @@
 /* unit_disk.c: Unit tests for SimpleFS disk emulator */
 
+#include "sfs/crc32c.h"
 #include "sfs/disk.h"
 #include "sfs/logging.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 
@@ -102,6 +104,532 @@ int test_02_disk_write() {
 
         assert(disk->writes == b + 1);
     }
+
+    debug("Check sync flushes image file with one system call");
+    size_t syscalls = disk->syscalls;
+    assert(disk_sync(disk));
+    assert(disk->syscalls == syscalls + 1);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_03_disk_cache() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char data[BLOCK_SIZE] = {0};
+
+    debug("Check bad cache");
+    assert(disk_cache(NULL, 2) == false);
+
+    debug("Check cache attributes");
+    assert(disk_cache(disk, 2));
+    assert(disk->cache);
+    assert(disk->hits   == 0);
+    assert(disk->misses == 0);
+
+    debug("Check write-back");
+    memset(data, 1, BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    assert(disk_write(disk, 0, data) == BLOCK_SIZE);
+    assert(disk->writes == 0);
+    assert(disk->misses == 1);
+    assert(disk->hits   == 1);
+
+    memset(data, 0, BLOCK_SIZE);
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(data[0] == 1 && data[BLOCK_SIZE - 1] == 1);
+    assert(disk->reads  == 0);
+    assert(disk->hits   == 2);
+
+    debug("Check sync");
+    assert(disk_sync(disk));
+    assert(disk->writes == 1);
+    assert(disk_sync(disk));
+    assert(disk->writes == 1);
+
+    debug("Check eviction");
+    for (size_t b = 1; b < DISK_BLOCKS; b++) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+    assert(disk->writes == 2);
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == b + 1);
+    }
+
+    debug("Check disabling cache");
+    assert(disk_cache(disk, 0));
+    assert(disk->cache == NULL);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == b + 1);
+    }
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_disk_vectored() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char   buffer[DISK_BLOCKS][BLOCK_SIZE];
+    char  *data[DISK_BLOCKS];
+    size_t blocks[DISK_BLOCKS];
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(buffer[b], b, BLOCK_SIZE);
+        data[b]   = buffer[b];
+        blocks[b] = b;
+    }
+
+    debug("Check bad vectors");
+    assert(disk_writev(NULL, blocks, data, DISK_BLOCKS) == DISK_FAILURE);
+    assert(disk_writev(disk, NULL, data, DISK_BLOCKS) == DISK_FAILURE);
+    blocks[1] = DISK_BLOCKS;
+    assert(disk_writev(disk, blocks, data, DISK_BLOCKS) == DISK_FAILURE);
+    blocks[1] = 1;
+    assert(disk->writes   == 0);
+    assert(disk->syscalls == 0);
+
+    debug("Check adjacent blocks are merged");
+    assert(disk_writev(disk, blocks, data, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->writes   == DISK_BLOCKS);
+    assert(disk->syscalls == 1);
+
+    debug("Check non-adjacent blocks are split");
+    size_t order[] = {3, 0, 1};
+    memset(buffer, 0, sizeof(buffer));
+    assert(disk_readv(disk, order, data, 3) == 3*BLOCK_SIZE);
+    assert(disk->reads    == 3);
+    assert(disk->syscalls == 3);
+    assert(buffer[0][0] == 3 && buffer[1][0] == 0 && buffer[2][0] == 1);
+
+    debug("Check cached vectored read");
+    assert(disk_cache(disk, 2));
+    assert(disk_readv(disk, blocks, data, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    assert(disk->misses == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(buffer[b][0] == b && buffer[b][BLOCK_SIZE - 1] == b);
+    }
+    assert(disk->reads    == 3 + DISK_BLOCKS);
+    assert(disk->syscalls == 3 + 1 + 2);
+
+    assert(disk_readv(disk, blocks + 2, data, 2) == 2*BLOCK_SIZE);
+    assert(disk->hits == 2);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_disk_mmap() {
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_MMAP);
+    assert(disk);
+    assert(disk->map);
+
+    char data[BLOCK_SIZE] = {0};
+
+    debug("Check bad block");
+    assert(disk_read(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_write(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        debug("Check mapped write block %lu", b);
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+
+        memset(data, 0, BLOCK_SIZE);
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == b + 1 && data[BLOCK_SIZE - 1] == b + 1);
+        assert(disk->reads  == b + 1);
+        assert(disk->writes == b + 1);
+    }
+    assert(disk->syscalls == 0);
+
+    debug("Check sync to image file");
+    assert(disk_sync(disk));
+    assert(pread(disk->fd, data, BLOCK_SIZE, 2*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(data[0] == 3);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_disk_prefetch() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char   data[BLOCK_SIZE] = {0};
+    size_t blocks[DISK_BLOCKS] = {0, 1, 2, 3};
+    size_t bad[] = {1, DISK_BLOCKS};
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+    }
+
+    debug("Check bad prefetch");
+    assert(disk_prefetch(NULL, blocks, 1) == DISK_FAILURE);
+    assert(disk_prefetch(disk, bad, 2) == DISK_FAILURE);
+
+    debug("Check prefetch without cache");
+    assert(disk_prefetch(disk, blocks, DISK_BLOCKS) == 0);
+    assert(disk->reads == 0);
+
+    debug("Check prefetch loads at most half the cache");
+    assert(disk_cache(disk, DISK_BLOCKS));
+    assert(disk_prefetch(disk, blocks, DISK_BLOCKS) == 2);
+    assert(disk->reads    == 2);
+    assert(disk->syscalls == DISK_BLOCKS + 1 + 1);
+
+    debug("Check prefetch skips cached blocks");
+    assert(disk_prefetch(disk, blocks, 3) == 1);
+    assert(disk->reads    == 3);
+
+    debug("Check reads hit prefetched blocks");
+    for (size_t b = 0; b < 3; b++) {
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == b + 1);
+    }
+    assert(disk->reads  == 3);
+    assert(disk->hits   == 3);
+    assert(disk->misses == 0);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_disk_uring() {
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_URING);
+    assert(disk);
+
+    char        buffer[DISK_BLOCKS][BLOCK_SIZE];
+    DiskRequest requests[DISK_BLOCKS];
+    DiskRequest bad = {DISK_BLOCKS, buffer[0], false, 0, false};
+
+    debug("Check bad request");
+    assert(disk_submit(disk, &bad, 1) == DISK_FAILURE);
+
+    debug("Check submitted writes complete");
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(buffer[b], b + 1, BLOCK_SIZE);
+        requests[b] = (DiskRequest){b, buffer[b], true, 0, false};
+    }
+    assert(disk_submit(disk, requests, DISK_BLOCKS) == DISK_BLOCKS);
+    assert(disk_complete(disk, DISK_BLOCKS) >= 0);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(requests[b].done);
+        assert(requests[b].result == BLOCK_SIZE);
+    }
+    assert(disk->writes == DISK_BLOCKS);
+    assert(disk_complete(disk, 1) == 0);
+
+    debug("Check vectored read keeps runs in flight");
+    size_t blocks[DISK_BLOCKS] = {3, 0, 1, 2};
+    char  *data[DISK_BLOCKS];
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(buffer[b], 0, BLOCK_SIZE);
+        data[b] = buffer[b];
+    }
+
+    size_t syscalls = disk->syscalls;
+    assert(disk_readv(disk, blocks, data, DISK_BLOCKS) == DISK_BLOCKS*BLOCK_SIZE);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(buffer[b][0] == blocks[b] + 1 && buffer[b][BLOCK_SIZE - 1] == blocks[b] + 1);
+    }
+    assert(disk->reads == DISK_BLOCKS);
+    assert(disk->syscalls - syscalls <= 2);
+
+    debug("Check submitted reads");
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(buffer[b], 0, BLOCK_SIZE);
+        requests[b] = (DiskRequest){b, buffer[b], false, 0, false};
+    }
+    assert(disk_submit(disk, requests, DISK_BLOCKS) == DISK_BLOCKS);
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        while (!requests[b].done) {
+            assert(disk_complete(disk, 1) != DISK_FAILURE);
+        }
+        assert(requests[b].result == BLOCK_SIZE);
+        assert(buffer[b][0] == b + 1);
+    }
+
+    debug("Check requests go through block cache");
+    assert(disk_cache(disk, 2));
+    requests[0] = (DiskRequest){2, buffer[0], false, 0, false};
+    assert(disk_submit(disk, requests, 1) == 1);
+    assert(requests[0].done && requests[0].result == BLOCK_SIZE);
+    assert(disk->misses == 1);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_08_disk_discard() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char buffer[BLOCK_SIZE];
+    char zero[BLOCK_SIZE] = {0};
+
+    debug("Check bad ranges");
+    assert(disk_discard(disk, DISK_BLOCKS + 1, 0) == false);
+    assert(disk_discard(disk, 1, DISK_BLOCKS) == false);
+    assert(disk_discard(disk, DISK_BLOCKS, 0) == true);
+
+    debug("Check discarded blocks read as zeros");
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        memset(buffer, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, buffer) == BLOCK_SIZE);
+    }
+    size_t writes = disk->writes;
+    assert(disk_discard(disk, 1, 2) == true);
+    assert(disk->writes == writes || disk->writes == writes + 2);
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        assert(disk_read(disk, b, buffer) == BLOCK_SIZE);
+        if (b == 1 || b == 2) {
+            assert(memcmp(buffer, zero, BLOCK_SIZE) == 0);
+        } else {
+            assert(buffer[0] == b + 1 && buffer[BLOCK_SIZE - 1] == b + 1);
+        }
+    }
+
+    debug("Check discard drops cached blocks");
+    assert(disk_cache(disk, DISK_BLOCKS));
+    memset(buffer, 0x7f, BLOCK_SIZE);
+    assert(disk_write(disk, 3, buffer) == BLOCK_SIZE);
+    assert(disk_discard(disk, 3, 1) == true);
+    assert(disk_sync(disk));
+    assert(disk_read(disk, 3, buffer) == BLOCK_SIZE);
+    assert(memcmp(buffer, zero, BLOCK_SIZE) == 0);
+    assert(disk_read(disk, 0, buffer) == BLOCK_SIZE);
+    assert(buffer[0] == 1);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_disk_account() {
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    char        buffer[BLOCK_SIZE] = {0};
+    DiskAccount account = {{0}};
+    DiskStats   stats;
+
+    debug("Check class without account");
+    assert(disk_account_class(DISK_DATA) == DISK_METADATA);
+    assert(disk_account(&account) == NULL);
+
+    debug("Check transfers are charged to class");
+    assert(disk_write(disk, 0, buffer) == BLOCK_SIZE);
+    assert(disk_account_class(DISK_DATA) == DISK_METADATA);
+    assert(disk_write(disk, 1, buffer) == BLOCK_SIZE);
+    assert(disk_read(disk, 1, buffer) == BLOCK_SIZE);
+    assert(disk_account_class(DISK_METADATA) == DISK_DATA);
+    assert(account.writes[DISK_METADATA] == 1 && account.writes[DISK_DATA] == 1);
+    assert(account.reads[DISK_METADATA]  == 0 && account.reads[DISK_DATA]  == 1);
+
+    debug("Check cache lookups are charged");
+    assert(disk_cache(disk, 2));
+    assert(disk_read(disk, 2, buffer) == BLOCK_SIZE);
+    assert(disk_read(disk, 2, buffer) == BLOCK_SIZE);
+    assert(account.hits == 1 && account.misses == 1);
+
+    debug("Check transfers are not charged after account is removed");
+    assert(disk_account(NULL) == &account);
+    assert(disk_read(disk, 3, buffer) == BLOCK_SIZE);
+    assert(account.reads[DISK_METADATA] == 1 && account.misses == 1);
+
+    debug("Check disk stats");
+    disk_stats(disk, &stats);
+    assert(stats.reads  == disk->reads  && stats.reads  == 3);
+    assert(stats.writes == disk->writes && stats.writes == 2);
+    assert(stats.hits   == 1 && stats.misses == 2);
+    assert(stats.cached == 2);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_disk_memory() {
+    unlink(DISK_PATH);
+    Disk *disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_MEMORY);
+    assert(disk);
+
+    char data[BLOCK_SIZE];
+    char zero[BLOCK_SIZE] = {0};
+
+    debug("Check no image file is created");
+    assert(disk->fd == -1);
+    assert(disk->map);
+    assert(access(DISK_PATH, F_OK) == -1);
+
+    debug("Check bad block");
+    assert(disk_read(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+    assert(disk_write(disk, DISK_BLOCKS, data) == DISK_FAILURE);
+
+    debug("Check new disk reads as zeros");
+    assert(disk_read(disk, 0, data) == BLOCK_SIZE);
+    assert(memcmp(data, zero, BLOCK_SIZE) == 0);
+
+    for (size_t b = 0; b < DISK_BLOCKS; b++) {
+        debug("Check memory write block %lu", b);
+        memset(data, b + 1, BLOCK_SIZE);
+        assert(disk_write(disk, b, data) == BLOCK_SIZE);
+
+        memset(data, 0, BLOCK_SIZE);
+        assert(disk_read(disk, b, data) == BLOCK_SIZE);
+        assert(data[0] == b + 1 && data[BLOCK_SIZE - 1] == b + 1);
+    }
+    assert(disk->reads    == DISK_BLOCKS + 1);
+    assert(disk->writes   == DISK_BLOCKS);
+    assert(disk->syscalls == 0);
+
+    debug("Check discard zeros memory");
+    assert(disk_discard(disk, 1, 2));
+    assert(disk_read(disk, 2, data) == BLOCK_SIZE);
+    assert(memcmp(data, zero, BLOCK_SIZE) == 0);
+    assert(disk_read(disk, 3, data) == BLOCK_SIZE);
+    assert(data[0] == 4);
+
+    debug("Check cached writes reach memory on sync");
+    assert(disk_cache(disk, 2));
+    memset(data, 0x5a, BLOCK_SIZE);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(disk->map[BLOCK_SIZE] == 0);
+    assert(disk_sync(disk));
+    assert(disk->map[BLOCK_SIZE] == 0x5a);
+    assert(disk->syscalls == 0);
+
+    disk_close(disk);
+    assert(access(DISK_PATH, F_OK) == -1);
+    return EXIT_SUCCESS;
+}
+
+uint32_t crc32c_bitwise(const char *data, size_t length) {
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (unsigned char)data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+int test_11_disk_checksums() {
+    char data[BLOCK_SIZE];
+    char copy[BLOCK_SIZE];
+    char bad[BLOCK_SIZE];
+
+    debug("Check crc32c check value");
+    assert(crc32c(0, "123456789", 9) == 0xE3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xE3069283);
+    assert(crc32c(0, "", 0) == 0);
+
+    debug("Check crc32c against bitwise reference");
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        data[i] = (i * 7 + i / 13) % 251;
+    }
+    for (size_t length = 8; length <= BLOCK_SIZE; length += 509) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            assert(crc32c(0, data + offset, length - offset) == crc32c_bitwise(data + offset, length - offset));
+        }
+    }
+    assert(crc32c(0, data, BLOCK_SIZE) == crc32c_bitwise(data, BLOCK_SIZE));
+
+    unlink(DISK_PATH);
+    Disk *disk = disk_open(DISK_PATH, DISK_BLOCKS);
+    assert(disk);
+
+    uint32_t sums[DISK_BLOCKS] = {0};
+    memset(bad, 0xee, BLOCK_SIZE);
+
+    debug("Check writes record checksums");
+    disk_checksums(disk, sums, true);
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(sums[1] == crc32c(0, data, BLOCK_SIZE));
+    assert(disk_read(disk, 1, copy) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+
+    debug("Check unchecked blocks read without verification");
+    assert(disk_read(disk, 0, copy) == BLOCK_SIZE);
+    assert(disk->corrupt == 0);
+
+    debug("Check corrupt block fails to read");
+    disk_checksums(disk, NULL, false);
+    assert(disk_write(disk, 1, bad) == BLOCK_SIZE);
+    disk_checksums(disk, sums, true);
+    errno = 0;
+    assert(disk_read(disk, 1, copy) == DISK_FAILURE);
+    assert(errno == EBADMSG);
+    assert(disk->corrupt == 1);
+
+    DiskStats stats;
+    disk_stats(disk, &stats);
+    assert(stats.corrupt == 1);
+
+    debug("Check metadata only checksums skip data writes");
+    DiskAccount account = {0};
+    disk_checksums(disk, sums, false);
+    disk_account(&account);
+    DiskClass class = disk_account_class(DISK_DATA);
+    assert(disk_write(disk, 2, data) == BLOCK_SIZE);
+    disk_account_class(class);
+    assert(disk_write(disk, 3, data) == BLOCK_SIZE);
+    disk_account(NULL);
+    assert(sums[2] == 0);
+    assert(sums[3] == crc32c(0, data, BLOCK_SIZE));
+
+    debug("Check discard clears checksums");
+    assert(disk_discard(disk, 1, 3));
+    assert(sums[1] == 0 && sums[3] == 0);
+    assert(disk_read(disk, 1, copy) == BLOCK_SIZE);
+
+    debug("Check cache hits are not verified again");
+    assert(disk_cache(disk, 2));
+    assert(disk_write(disk, 3, data) == BLOCK_SIZE);
+    assert(disk_sync(disk));
+    assert(pwrite(disk->fd, bad, BLOCK_SIZE, 3 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(disk_read(disk, 3, copy) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+    assert(disk->corrupt == 1);
+
+    disk_checksums(disk, NULL, false);
+    disk_close(disk);
+
+    debug("Check io_uring runs and requests use checksums");
+    disk = disk_open_backend(DISK_PATH, DISK_BLOCKS, DISK_URING);
+    assert(disk);
+    memset(sums, 0, sizeof(sums));
+    disk_checksums(disk, sums, true);
+
+    assert(disk_write(disk, 1, data) == BLOCK_SIZE);
+    assert(sums[1] == crc32c(0, data, BLOCK_SIZE));
+    size_t block = 1;
+    char  *buffer = copy;
+    assert(disk_readv(disk, &block, &buffer, 1) == BLOCK_SIZE);
+    assert(memcmp(data, copy, BLOCK_SIZE) == 0);
+
+    DiskRequest request = {2, data, true, 0, false};
+    assert(disk_submit(disk, &request, 1) == 1);
+    assert(disk_complete(disk, 1) >= 0);
+    assert(request.done && request.result == BLOCK_SIZE);
+    assert(sums[2] == crc32c(0, data, BLOCK_SIZE));
+
+    assert(pwrite(disk->fd, bad, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+    request = (DiskRequest){2, copy, false, 0, false};
+    assert(disk_submit(disk, &request, 1) == 1);
+    assert(disk_complete(disk, 1) >= 0);
+    assert(request.done && request.result == DISK_FAILURE);
+    assert(disk->corrupt == 1);
+
+    disk_checksums(disk, NULL, false);
     disk_close(disk);
     return EXIT_SUCCESS;
 }
@@ -115,6 +643,15 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test disk_open\n");
         fprintf(stderr, "    1. Test disk_read\n");
         fprintf(stderr, "    2. Test disk_write\n");
+        fprintf(stderr, "    3. Test disk_cache\n");
+        fprintf(stderr, "    4. Test disk_readv and disk_writev\n");
+        fprintf(stderr, "    5. Test disk_open_backend (mmap)\n");
+        fprintf(stderr, "    6. Test disk_prefetch\n");
+        fprintf(stderr, "    7. Test disk_open_backend (io_uring)\n");
+        fprintf(stderr, "    8. Test disk_discard\n");
+        fprintf(stderr, "    9. Test disk_account and disk_stats\n");
+        fprintf(stderr, "   10. Test disk_open_backend (memory)\n");
+        fprintf(stderr, "   11. Test disk_checksums\n");
         return EXIT_FAILURE;
     }
 
@@ -127,6 +664,15 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_disk_open(); break;
         case 1:  status = test_01_disk_read(); break;
         case 2:  status = test_02_disk_write(); break;
+        case 3:  status = test_03_disk_cache(); break;
+        case 4:  status = test_04_disk_vectored(); break;
+        case 5:  status = test_05_disk_mmap(); break;
+        case 6:  status = test_06_disk_prefetch(); break;
+        case 7:  status = test_07_disk_uring(); break;
+        case 8:  status = test_08_disk_discard(); break;
+        case 9:  status = test_09_disk_account(); break;
+        case 10: status = test_10_disk_memory(); break;
+        case 11: status = test_11_disk_checksums(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 
@@ -1,11 +1,14 @@
 /* unit_fs.c: Unit tests for SimpleFS file system */
 
+#include "sfs/bitmap.h"
 #include "sfs/fs.h"
 #include "sfs/logging.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <unistd.h>
 
@@ -24,11 +27,11 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == true);
+    assert(bitmap_get(fs.free_blocks, 0) == false);
+    assert(bitmap_get(fs.free_blocks, 1) == false);
+    assert(bitmap_get(fs.free_blocks, 2) == false);
+    assert(bitmap_get(fs.free_blocks, 3) == true);
+    assert(bitmap_get(fs.free_blocks, 4) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -43,26 +46,26 @@ int test_00_fs_mount() {
     assert(fs_mount(&fs, disk));
     assert(fs.disk           == disk);
     assert(fs.free_blocks);
-    assert(fs.free_blocks[0] == false);
-    assert(fs.free_blocks[1] == false);
-    assert(fs.free_blocks[2] == false);
-    assert(fs.free_blocks[3] == true);
-    assert(fs.free_blocks[4] == false);
-    assert(fs.free_blocks[5] == false);
-    assert(fs.free_blocks[6] == false);
-    assert(fs.free_blocks[7] == false);
-    assert(fs.free_blocks[8] == false);
-    assert(fs.free_blocks[9] == false);
-    assert(fs.free_blocks[10] == false);
-    assert(fs.free_blocks[11] == false);
-    assert(fs.free_blocks[12] == false);
-    assert(fs.free_blocks[13] == false);
-    assert(fs.free_blocks[14] == false);
-    assert(fs.free_blocks[15] == true);
-    assert(fs.free_blocks[16] == true);
-    assert(fs.free_blocks[17] == true);
-    assert(fs.free_blocks[18] == true);
-    assert(fs.free_blocks[19] == true);
+    assert(bitmap_get(fs.free_blocks, 0) == false);
+    assert(bitmap_get(fs.free_blocks, 1) == false);
+    assert(bitmap_get(fs.free_blocks, 2) == false);
+    assert(bitmap_get(fs.free_blocks, 3) == true);
+    assert(bitmap_get(fs.free_blocks, 4) == false);
+    assert(bitmap_get(fs.free_blocks, 5) == false);
+    assert(bitmap_get(fs.free_blocks, 6) == false);
+    assert(bitmap_get(fs.free_blocks, 7) == false);
+    assert(bitmap_get(fs.free_blocks, 8) == false);
+    assert(bitmap_get(fs.free_blocks, 9) == false);
+    assert(bitmap_get(fs.free_blocks, 10) == false);
+    assert(bitmap_get(fs.free_blocks, 11) == false);
+    assert(bitmap_get(fs.free_blocks, 12) == false);
+    assert(bitmap_get(fs.free_blocks, 13) == false);
+    assert(bitmap_get(fs.free_blocks, 14) == false);
+    assert(bitmap_get(fs.free_blocks, 15) == true);
+    assert(bitmap_get(fs.free_blocks, 16) == true);
+    assert(bitmap_get(fs.free_blocks, 17) == true);
+    assert(bitmap_get(fs.free_blocks, 18) == true);
+    assert(bitmap_get(fs.free_blocks, 19) == true);
 
     debug("Check mounting filesystem (already mounted)");
     assert(fs_mount(&fs, disk) == false);
@@ -115,14 +118,14 @@ int test_02_fs_remove() {
 
     debug("Check removing inode 2");
     assert(fs_remove(&fs, 2));
-    assert(fs.free_blocks[4]);
-    assert(fs.free_blocks[5]);
-    assert(fs.free_blocks[6]);
-    assert(fs.free_blocks[7]);
-    assert(fs.free_blocks[8]);
-    assert(fs.free_blocks[9]);
-    assert(fs.free_blocks[13]);
-    assert(fs.free_blocks[14]);
+    assert(bitmap_get(fs.free_blocks, 4));
+    assert(bitmap_get(fs.free_blocks, 5));
+    assert(bitmap_get(fs.free_blocks, 6));
+    assert(bitmap_get(fs.free_blocks, 7));
+    assert(bitmap_get(fs.free_blocks, 8));
+    assert(bitmap_get(fs.free_blocks, 9));
+    assert(bitmap_get(fs.free_blocks, 13));
+    assert(bitmap_get(fs.free_blocks, 14));
 
     Block block;
     assert(disk_read(fs.disk, 1, block.data) != DISK_FAILURE);
@@ -156,10 +159,1580 @@ int test_03_fs_stat() {
     assert(fs_mount(&fs, disk));
 
     debug("Check stat on inode 2");
+    size_t reads = disk->reads;
     assert(fs_stat(&fs, 1) == -1);
     assert(fs_stat(&fs, 2) == 27160);
+    assert(fs_stat(&fs, fs.meta_data.inodes) == -1);
 
+    debug("Check stat uses resident inode table");
+    assert(disk->reads == reads);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_04_fs_write() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    char data[4*BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+
+    debug("Check write into contiguous extent");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    for (size_t i = 0; i < 4; i++) {
+        assert(fs.inodes[0].direct[i] == 15 + i);
+        assert(bitmap_get(fs.free_blocks, 15 + i) == false);
+    }
+
+    debug("Check partial write at offset");
+    assert(fs_write(&fs, inode_number, data, 10, sizeof(data) - 5) == 10);
+    assert(fs_stat(&fs, inode_number) == sizeof(data) + 5);
+    assert(fs.inodes[0].direct[4] == 3);
+
+    Block block;
+    assert(disk_read(disk, 3, block.data) != DISK_FAILURE);
+    assert(block.data[4] == 'a' && block.data[5] == 0);
+
+    debug("Check write past maximum size");
+    assert(fs_write(&fs, inode_number, data, 10, BLOCK_SIZE * (POINTERS_PER_INODE + POINTERS_PER_BLOCK)) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_05_fs_read() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    char data[3*BLOCK_SIZE + 100];
+    char copy[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i % 251;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    debug("Check aligned read");
+    memset(copy, 0, sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, 2*BLOCK_SIZE, BLOCK_SIZE) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data + BLOCK_SIZE, 2*BLOCK_SIZE) == 0);
+
+    debug("Check unaligned read");
+    memset(copy, 0, sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, 2*BLOCK_SIZE, 50) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data + 50, 2*BLOCK_SIZE) == 0);
+
+    debug("Check read past end of file");
+    memset(copy, 0, sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 10) == sizeof(data) - 10);
+    assert(memcmp(copy, data + 10, sizeof(data) - 10) == 0);
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), sizeof(data)) == 0);
+
+    debug("Check unaligned overwrite");
+    memset(data + BLOCK_SIZE - 7, 'x', 2*BLOCK_SIZE);
+    assert(fs_write(&fs, inode_number, data + BLOCK_SIZE - 7, 2*BLOCK_SIZE, BLOCK_SIZE - 7) == 2*BLOCK_SIZE);
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(data));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_06_fs_open() {
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check bad open and close");
+    assert(fs_open(&fs, 199) == false);
+    assert(fs_close(&fs, 21) == false);
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    char data[8*BLOCK_SIZE];
+    char copy[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i % 253;
+    }
+
+    debug("Check open file buffers writes");
+    assert(fs_open(&fs, inode_number));
+    assert(fs_open(&fs, inode_number));
+
+    size_t writes = disk->writes;
+    for (size_t i = 0; i < 8; i++) {
+        assert(fs_write(&fs, inode_number, data + i*BLOCK_SIZE, BLOCK_SIZE, i*BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(disk->writes - writes == 0);
+
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+    assert(disk->reads - reads == 0);
+
+    debug("Check close writes data, indirect block and inode table");
+    assert(fs_close(&fs, inode_number));
+    assert(disk->writes - writes == 8);
+    assert(fs_close(&fs, inode_number));
+    assert(disk->writes - writes == 10);
+    assert(fs.files == NULL);
+
+    fs_unmount(&fs);
+
+    debug("Check file persists");
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    memset(copy, 0, sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_07_fs_readahead() {
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    static char data[40*BLOCK_SIZE];
+    char copy[BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i % 241;
+    }
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    debug("Check sequential reads are prefetched");
+    assert(disk_cache(disk, 64));
+    assert(fs_open(&fs, inode_number));
+
+    size_t syscalls = disk->syscalls;
+    for (size_t i = 0; i < 40; i++) {
+        assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, i*BLOCK_SIZE) == BLOCK_SIZE);
+        assert(memcmp(copy, data + i*BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+    assert(disk->syscalls - syscalls <= 8);
+    assert(fs.files->ra_window == READAHEAD_MAX);
+
+    debug("Check random read resets window");
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, 3*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(copy, data + 3*BLOCK_SIZE, BLOCK_SIZE) == 0);
+    assert(fs.files->ra_window == 0);
+
+    debug("Check unaligned sequential reads are prefetched");
+    assert(disk_cache(disk, 0) && disk_cache(disk, 64));
+    syscalls = disk->syscalls;
+    for (size_t offset = 0; offset < sizeof(data); offset += 1000) {
+        size_t chunk = sizeof(data) - offset < 1000 ? sizeof(data) - offset : 1000;
+        assert(fs_read(&fs, inode_number, copy, chunk, offset) == (ssize_t)chunk);
+        assert(memcmp(copy, data + offset, chunk) == 0);
+    }
+    assert(disk->syscalls - syscalls <= 8);
+    assert(fs.files->ra_window == READAHEAD_MAX);
+
+    assert(fs_close(&fs, inode_number));
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+#define THREADS     (4)
+#define ROUNDS      (8)
+
+typedef struct {
+    FileSystem *fs;
+    size_t      id;
+} Client;
+
+void *client(void *arg) {
+    Client *c = arg;
+    char    data[7*BLOCK_SIZE];
+    char    copy[sizeof(data)];
+
+    for (size_t round = 0; round < ROUNDS; round++) {
+        memset(data, 'a' + c->id * ROUNDS + round, sizeof(data));
+
+        ssize_t inode_number = fs_create(c->fs);
+        assert(inode_number >= 0);
+        assert(fs_open(c->fs, inode_number));
+
+        for (size_t i = 0; i < 7; i++) {
+            assert(fs_write(c->fs, inode_number, data + i*BLOCK_SIZE, BLOCK_SIZE, i*BLOCK_SIZE) == BLOCK_SIZE);
+        }
+        assert(fs_stat(c->fs, inode_number) == sizeof(data));
+        assert(fs_read(c->fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+        assert(memcmp(copy, data, sizeof(data)) == 0);
+
+        assert(fs_close(c->fs, inode_number));
+        assert(fs_sync(c->fs));
+
+        if (round % 2) {
+            assert(fs_remove(c->fs, inode_number));
+        }
+    }
+
+    return NULL;
+}
+
+int test_08_fs_threads() {
+    Disk *disk = disk_open("data/image.unit", 400);
+    assert(disk);
+    assert(disk_cache(disk, 32));
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+
+    debug("Check concurrent clients");
+    pthread_t threads[THREADS];
+    Client    clients[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        clients[t] = (Client){&fs, t};
+        assert(pthread_create(&threads[t], NULL, client, &clients[t]) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(threads[t], NULL) == 0);
+    }
+
+    debug("Check every kept file and free block count");
+    size_t kept = THREADS * ROUNDS / 2;
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - kept * 8);
+    fs_unmount(&fs);
+
+    assert(fs_mount(&fs, disk));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - kept * 8);
+
+    size_t files = 0;
+    char   copy[7*BLOCK_SIZE];
+    for (size_t i = 0; i < fs.meta_data.inodes; i++) {
+        if (fs_stat(&fs, i) < 0) {
+            continue;
+        }
+        assert(fs_stat(&fs, i) == sizeof(copy));
+        assert(fs_read(&fs, i, copy, sizeof(copy), 0) == sizeof(copy));
+        for (size_t b = 1; b < sizeof(copy); b++) {
+            assert(copy[b] == copy[0]);
+        }
+        files++;
+    }
+    assert(files == kept);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_09_fs_mount_workers() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+
+    // Place Inodes in blocks scanned by the first and last mount workers
+    // (and mark image dirty so they are scanned)
+
+    Block block = {{0}};
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+
+    memset(block.data, 0, BLOCK_SIZE);
+    block.inodes[3] = (Inode){.valid = 1, .size = 7*BLOCK_SIZE, .direct = {1500, 1501, 1502, 1503, 5000}, .indirect = 1600};
+    assert(disk_write(disk, 1 + 150, block.data) == BLOCK_SIZE);
+
+    memset(block.data, 0, BLOCK_SIZE);
+    block.inodes[0] = (Inode){.valid = 1, .size = BLOCK_SIZE, .direct = {1700}};
+    assert(disk_write(disk, 1 + 10, block.data) == BLOCK_SIZE);
+
+    memset(block.data, 0, BLOCK_SIZE);
+    block.pointers[0] = 1601;
+    block.pointers[1] = 1602;
+    assert(disk_write(disk, 1600, block.data) == BLOCK_SIZE);
+
+    debug("Check free blocks bitmap");
+    assert(fs_mount(&fs, disk));
+    assert(fs_stat(&fs, 150 * INODES_PER_BLOCK + 3) == 7*BLOCK_SIZE);
+    assert(fs_stat(&fs, 10 * INODES_PER_BLOCK) == BLOCK_SIZE);
+
+    size_t used[] = {1500, 1501, 1502, 1503, 1600, 1601, 1602, 1700};
+    for (size_t i = 0; i < sizeof(used) / sizeof(used[0]); i++) {
+        assert(!bitmap_get(fs.free_blocks, used[i]));
+    }
+    assert(bitmap_get(fs.free_blocks, 1504));
+    assert(bitmap_count(fs.free_blocks, 2000) == 2000 - 202 - 8);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_10_fs_bitmap_persist() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    char       data[8*BLOCK_SIZE] = {0};
+
+    debug("Check mount marks image dirty");
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.version == FS_VERSION);
+    assert(fs.meta_data.bitmap_blocks == 1);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.clean == false);
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+
+    uint64_t *expected = bitmap_create(2000, false);
+    assert(expected);
+    memcpy(expected, fs.free_blocks, BITMAP_WORDS(2000) * sizeof(uint64_t));
+
+    debug("Check unmount marks image clean");
+    fs_unmount(&fs);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.clean == true);
+
+    debug("Check clean mount loads bitmap without reading indirect blocks");
+    size_t reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(disk->reads - reads == 1 + 200 + 1);
+    assert(memcmp(fs.free_blocks, expected, BITMAP_WORDS(2000) * sizeof(uint64_t)) == 0);
+    fs_unmount(&fs);
+
+    debug("Check dirty mount rebuilds bitmap");
+    memset(block.data, 0, BLOCK_SIZE);
+    assert(disk_write(disk, 1 + 200, block.data) == BLOCK_SIZE);
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+
+    reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(disk->reads - reads == 1 + 200 + 1);
+    assert(memcmp(fs.free_blocks, expected, BITMAP_WORDS(2000) * sizeof(uint64_t)) == 0);
+    fs_unmount(&fs);
+
+    debug("Check original images still mount");
+    FileSystem old = {0};
+    Disk *image = disk_open("data/image.20", 20);
+    assert(image);
+    assert(fs_mount(&old, image));
+    assert(old.meta_data.version == 0);
+    size_t writes = image->writes;
+    fs_unmount(&old);
+    assert(image->writes == writes);
+    disk_close(image);
+
+    free(expected);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_11_fs_free_inodes() {
+    assert(system("cp data/image.20 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    debug("Check free inodes bitmap");
+    assert(bitmap_count(fs.free_inodes, fs.meta_data.inodes) == fs.meta_data.inodes - 2);
+    assert(bitmap_get(fs.free_inodes, 2) == false);
+    assert(bitmap_get(fs.free_inodes, 3) == false);
+
+    debug("Check create takes lowest free inode without reads");
+    size_t reads = disk->reads;
+    assert(fs_create(&fs) == 0);
+    assert(fs_create(&fs) == 1);
+    assert(fs_create(&fs) == 4);
+    assert(disk->reads == reads);
+    assert(bitmap_get(fs.free_inodes, 4) == false);
+
+    debug("Check remove frees inode for reuse");
+    assert(fs_remove(&fs, 1));
+    assert(bitmap_get(fs.free_inodes, 1));
+    assert(fs_create(&fs) == 1);
+    assert(fs_create(&fs) == 5);
+
+    debug("Check create on full table");
+    for (size_t i = 6; i < fs.meta_data.inodes; i++) {
+        assert(fs_create(&fs) == i);
+    }
+    assert(fs_create(&fs) < 0);
+    assert(fs_remove(&fs, 100));
+    assert(fs_create(&fs) == 100);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_12_fs_remove_many() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    size_t free_inodes = bitmap_count(fs.free_inodes, fs.meta_data.inodes);
+    char   data[8 * BLOCK_SIZE];
+    memset(data, 'x', sizeof(data));
+
+    debug("Create inodes across three inode blocks");
+    for (size_t i = 0; i < 300; i++) {
+        assert(fs_create(&fs) == i);
+        assert(fs_write(&fs, i, data, 1, 0) == 1);
+    }
+    assert(fs_write(&fs, 5, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_write(&fs, 200, data, sizeof(data), 0) == sizeof(data));
+
+    debug("Check removing nothing");
+    assert(fs_remove_many(&fs, NULL, 0) == 0);
+
+    debug("Check each inode block is written once");
+    size_t inodes[303];
+    for (size_t i = 0; i < 300; i++) {
+        inodes[i] = 299 - i;
+    }
+    inodes[300] = 7;
+    inodes[301] = 1000;
+    inodes[302] = fs.meta_data.inodes;
+
+    size_t reads  = disk->reads;
+    size_t writes = disk->writes;
+    assert(fs_remove_many(&fs, inodes, 303) == 300);
+    assert(disk->reads  - reads  == 2);
+    assert(disk->writes - writes == 3);
+
+    debug("Check blocks and inodes are free");
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+    assert(bitmap_count(fs.free_inodes, fs.meta_data.inodes) == free_inodes);
+    assert(fs_stat(&fs, 5) < 0);
+    assert(fs_remove_many(&fs, inodes, 300) == 0);
+    assert(fs_create(&fs) == 0);
+
+    debug("Check removal persists");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(bitmap_count(fs.free_inodes, fs.meta_data.inodes) == free_inodes - 1);
+    assert(fs_stat(&fs, 200) < 0);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_13_fs_delalloc() {
+    assert(system("cp data/image.200 data/image.unit") == EXIT_SUCCESS);
+
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_mount(&fs, disk));
+
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    char data[12*BLOCK_SIZE];
+    char copy[sizeof(data)];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = i % 251;
+    }
+
+    debug("Check small appends allocate nothing until close");
+    size_t free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    size_t writes      = disk->writes;
+
+    assert(fs_open(&fs, inode_number));
+    for (size_t i = 0; i < sizeof(data); i += 1000) {
+        size_t length = i + 1000 > sizeof(data) ? sizeof(data) - i : 1000;
+        assert(fs_write(&fs, inode_number, data + i, length, i) == length);
+    }
+    assert(disk->writes == writes);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+
+    debug("Check reads see buffered data");
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    debug("Check close writes one extent, indirect block and inode table");
+    assert(fs_close(&fs, inode_number));
+    assert(disk->writes - writes == 12 + 1 + 1);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - 13);
+
+    Inode *inode = &fs.inodes[inode_number];
+    for (size_t i = 1; i < POINTERS_PER_INODE; i++) {
+        assert(inode->direct[i] == inode->direct[0] + i);
+    }
+    assert(inode->indirect == inode->direct[0] + POINTERS_PER_INODE);
+
+    debug("Check overwrite merges buffered and written data");
+    assert(fs_open(&fs, inode_number));
+    memset(data + 100, 'x', 3000);
+    assert(fs_write(&fs, inode_number, data + 100, 3000, 100) == 3000);
+    memset(copy, 0, sizeof(copy));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(data)) == 0);
+
+    debug("Check write elsewhere writes back buffer first");
+    writes = disk->writes;
+    assert(fs_write(&fs, inode_number, data, 10, 8*BLOCK_SIZE) == 10);
+    assert(disk->writes - writes == 1);
+    assert(fs_sync(&fs));
+
+    debug("Check failed write back keeps buffered data");
+    ssize_t one    = fs_create(&fs);
+    ssize_t filler = fs_create(&fs);
+    char   *zeros  = calloc(fs.meta_data.blocks, BLOCK_SIZE);
+    assert(one >= 0 && filler >= 0 && zeros);
+    assert(fs_write(&fs, one, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, filler, zeros, fs.meta_data.blocks * BLOCK_SIZE, 0) > 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == 0);
+
+    assert(fs_write(&fs, inode_number, data, 2*BLOCK_SIZE, sizeof(data)) == 2*BLOCK_SIZE);
+    assert(!fs_sync(&fs));
+    assert(fs_stat(&fs, inode_number) == sizeof(data) + 2*BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, copy, 2*BLOCK_SIZE, sizeof(data)) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+
+    debug("Check short write back keeps the unwritten tail");
+    assert(fs_remove(&fs, one));
+    assert(!fs_sync(&fs));
+    assert(fs.inodes[inode_number].size == sizeof(data) + BLOCK_SIZE);
+    assert(fs_stat(&fs, inode_number) == sizeof(data) + 2*BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, copy, 2*BLOCK_SIZE, sizeof(data)) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+
+    debug("Check sync retries write back");
+    assert(fs_remove(&fs, filler));
+    assert(fs_sync(&fs));
+    assert(fs.inodes[inode_number].size == sizeof(data) + 2*BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, copy, 2*BLOCK_SIZE, sizeof(data)) == 2*BLOCK_SIZE);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE) == 0);
+    free(zeros);
+
+    debug("Check remove discards buffer");
+    assert(fs_write(&fs, inode_number, data, 10, sizeof(data)) == 10);
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_stat(&fs, inode_number) < 0);
+    assert(fs_close(&fs, inode_number));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_14_fs_dindirect() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    size_t     nblocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK + 64;
+    char      *data    = malloc(nblocks * BLOCK_SIZE);
+    char      *copy    = malloc(nblocks * BLOCK_SIZE);
+    assert(data && copy);
+
+    for (size_t i = 0; i < nblocks * BLOCK_SIZE; i++) {
+        data[i] = (i / BLOCK_SIZE + i) % 251;
+    }
+
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.features & FS_FEATURE_DINDIRECT);
+
+    size_t  free_blocks  = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    debug("Check write past indirect block uses double indirect block");
+    assert(fs_write(&fs, inode_number, data, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(fs_stat(&fs, inode_number) == nblocks * BLOCK_SIZE);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - nblocks - 3);
+
+    Inode *inode = &fs.inodes[inode_number];
+    assert(disk_read(disk, inode->indirect, block.data) == BLOCK_SIZE);
+    uint32_t dindirect = block.pointers[DINDIRECT_POINTER];
+    assert(dindirect);
+    assert(disk_read(disk, dindirect, block.data) == BLOCK_SIZE);
+    assert(block.pointers[0] && block.pointers[1] == 0);
+
+    debug("Check read through double indirect block");
+    assert(fs_read(&fs, inode_number, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+
+    debug("Check open File appends through resident leaf");
+    assert(fs_open(&fs, inode_number));
+    for (size_t i = 0; i < 16; i++) {
+        assert(fs_write(&fs, inode_number, data, BLOCK_SIZE, (nblocks + i) * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, (nblocks - 1) * BLOCK_SIZE) == BLOCK_SIZE);
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, (nblocks - 2) * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(disk->reads - reads == 1);
+    assert(fs_close(&fs, inode_number));
+    assert(fs_stat(&fs, inode_number) == (nblocks + 16) * BLOCK_SIZE);
+
+    debug("Check dirty mount marks double indirect blocks used");
+    uint64_t *expected = bitmap_create(2000, false);
+    assert(expected);
+    memcpy(expected, fs.free_blocks, BITMAP_WORDS(2000) * sizeof(uint64_t));
+    fs_unmount(&fs);
+
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(memcmp(fs.free_blocks, expected, BITMAP_WORDS(2000) * sizeof(uint64_t)) == 0);
+    free(expected);
+
+    assert(fs_read(&fs, inode_number, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+    assert(fs_read(&fs, inode_number, copy, BLOCK_SIZE, (nblocks + 15) * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(copy, data, BLOCK_SIZE) == 0);
+
+    debug("Check write past maximum size");
+    assert(fs_write(&fs, inode_number, data, 10, UINT32_MAX) == 0);
+
+    debug("Check remove releases double indirect blocks");
+    assert(fs_remove(&fs, inode_number));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    free(data);
+    free(copy);
+    return EXIT_SUCCESS;
+}
+
+int test_15_fs_extents() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    char       data[16*BLOCK_SIZE];
+    char       copy[sizeof(data)];
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (i / BLOCK_SIZE + i) % 251;
+    }
+
+    assert(!fs_format_features(&fs, disk, 0x80000000));
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS));
+    assert(fs_mount(&fs, disk));
+
+    size_t  free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    ssize_t a = fs_create(&fs);
+    ssize_t b = fs_create(&fs);
+    assert(a >= 0 && b >= 0);
+
+    debug("Check write maps one extent");
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, a, data, 12*BLOCK_SIZE, 0) == 12*BLOCK_SIZE);
+    assert(disk->writes - writes == 12 + 1);
+    assert(fs.inodes[a].nextents == 1);
+    assert(fs.inodes[a].extents[0].length == 12);
+    assert(fs.inodes[a].indirect == 0);
+
+    debug("Check read needs no mapping blocks");
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, a, copy, 12*BLOCK_SIZE, 0) == 12*BLOCK_SIZE);
+    assert(disk->reads - reads == 12);
+    assert(memcmp(copy, data, 12*BLOCK_SIZE) == 0);
+
+    debug("Check contiguous append grows last extent");
+    assert(fs_write(&fs, a, data + 12*BLOCK_SIZE, BLOCK_SIZE, 12*BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs.inodes[a].nextents == 1);
+    assert(fs.inodes[a].extents[0].length == 13);
+
+    debug("Check interleaved appends spill into extent block");
+    for (size_t i = 0; i < 3; i++) {
+        assert(fs_write(&fs, b, data, BLOCK_SIZE, i * BLOCK_SIZE) == BLOCK_SIZE);
+        assert(fs_write(&fs, a, data + (13 + i) * BLOCK_SIZE, BLOCK_SIZE, (13 + i) * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(fs.inodes[a].nextents == 4);
+    assert(fs.inodes[a].indirect);
+    assert(disk_read(disk, fs.inodes[a].indirect, block.data) == BLOCK_SIZE);
+    assert(block.extents[0].length == 1 && block.extents[1].length == 1);
+    assert(fs_read(&fs, a, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(copy)) == 0);
+
+    debug("Check write past end zeroes skipped blocks");
+    assert(fs_write(&fs, b, data, 10, 6*BLOCK_SIZE) == 10);
+    assert(fs_stat(&fs, b) == 6*BLOCK_SIZE + 10);
+    memset(copy, 'x', sizeof(copy));
+    assert(fs_read(&fs, b, copy, sizeof(copy), 3*BLOCK_SIZE) == 3*BLOCK_SIZE + 10);
+    for (size_t i = 0; i < 3*BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(memcmp(copy + 3*BLOCK_SIZE, data, 10) == 0);
+
+    debug("Check open File defers extent block to close");
+    assert(fs_open(&fs, b));
+    writes = disk->writes;
+    assert(fs_write(&fs, b, data, 16*BLOCK_SIZE, 7*BLOCK_SIZE) == 16*BLOCK_SIZE);
+    assert(disk->writes - writes == 16);
+    assert(fs_close(&fs, b));
+    assert(fs_read(&fs, b, copy, sizeof(copy), 7*BLOCK_SIZE) == sizeof(copy));
+    assert(memcmp(copy, data, sizeof(copy)) == 0);
+
+    debug("Check dirty mount marks extents used");
+    uint64_t *expected = bitmap_create(2000, false);
+    assert(expected);
+    memcpy(expected, fs.free_blocks, BITMAP_WORDS(2000) * sizeof(uint64_t));
+    fs_unmount(&fs);
+
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.features == FS_FEATURE_EXTENTS);
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(memcmp(fs.free_blocks, expected, BITMAP_WORDS(2000) * sizeof(uint64_t)) == 0);
+    free(expected);
+
+    debug("Check remove releases extents");
+    size_t removed[] = {a, b};
+    assert(fs_remove(&fs, a));
+    assert(fs_remove_many(&fs, removed, 2) == 1);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_16_fs_inline() {
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    char       data[3*BLOCK_SIZE];
+    char       copy[sizeof(data)];
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    assert(fs_format_features(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_INLINE));
+    assert(fs_mount(&fs, disk));
+
+    size_t  free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    ssize_t a = fs_create(&fs);
+    assert(a >= 0);
+
+    debug("Check small write only writes the inode block");
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, a, data, 20, 0) == 20);
+    assert(disk->writes - writes == 1);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+
+    debug("Check small read needs no disk reads");
+    size_t reads = disk->reads;
+    assert(fs_read(&fs, a, copy, sizeof(copy), 0) == 20);
+    assert(disk->reads == reads);
+    assert(memcmp(copy, data, 20) == 0);
+
+    debug("Check growing past the inode moves data to a block");
+    assert(fs_write(&fs, a, data + 20, INLINE_MAX - 20, 20) == INLINE_MAX - 20);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+    assert(fs_write(&fs, a, data + INLINE_MAX, 100, INLINE_MAX) == 100);
+    assert(fs_stat(&fs, a) == INLINE_MAX + 100);
+    assert(fs.inodes[a].direct[0] && fs.inodes[a].direct[1] == 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - 1);
+    assert(fs_read(&fs, a, copy, sizeof(copy), 0) == INLINE_MAX + 100);
+    assert(memcmp(copy, data, INLINE_MAX + 100) == 0);
+
+    debug("Check write past first block keeps inline bytes");
+    ssize_t b = fs_create(&fs);
+    assert(b >= 0);
+    assert(fs_write(&fs, b, data, 10, 0) == 10);
+    assert(fs_write(&fs, b, data, 10, 2*BLOCK_SIZE) == 10);
+    memset(copy, 'x', sizeof(copy));
+    assert(fs_read(&fs, b, copy, sizeof(copy), 0) == 2*BLOCK_SIZE + 10);
+    assert(memcmp(copy, data, 10) == 0);
+    for (size_t i = 10; i < BLOCK_SIZE; i++) {
+        assert(copy[i] == 0);
+    }
+    assert(memcmp(copy + 2*BLOCK_SIZE, data, 10) == 0);
+
+    debug("Check open File writes inline data on close");
+    ssize_t c = fs_create(&fs);
+    assert(c >= 0);
+    assert(fs_open(&fs, c));
+    writes = disk->writes;
+    for (size_t i = 0; i < 16; i += 4) {
+        assert(fs_write(&fs, c, data + i, 4, i) == 4);
+    }
+    assert(disk->writes == writes);
+    assert(fs_close(&fs, c));
+    assert(disk->writes - writes == 1);
+    assert(fs_read(&fs, c, copy, sizeof(copy), 0) == 16);
+    assert(memcmp(copy, data, 16) == 0);
+
+    debug("Check dirty mount ignores inline data");
+    size_t expected = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    fs_unmount(&fs);
+
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == expected);
+    assert(fs_read(&fs, c, copy, sizeof(copy), 0) == 16);
+    assert(memcmp(copy, data, 16) == 0);
+
+    debug("Check remove of inline inode frees no blocks");
+    assert(fs_remove(&fs, c));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == expected);
+    assert(fs_remove(&fs, a) && fs_remove(&fs, b));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+    fs_unmount(&fs);
+
+    debug("Check inline data with extents");
+    assert(fs_format_features(&fs, disk, FS_FEATURE_EXTENTS | FS_FEATURE_INLINE));
+    assert(fs_mount(&fs, disk));
+    a = fs_create(&fs);
+    assert(fs_write(&fs, a, data, 10, 0) == 10);
+    assert(fs_write(&fs, a, data + 10, 2*BLOCK_SIZE, 10) == 2*BLOCK_SIZE);
+    assert(fs.inodes[a].nextents == 1 && fs.inodes[a].extents[0].length == 3);
+    assert(fs_read(&fs, a, copy, sizeof(copy), 0) == 2*BLOCK_SIZE + 10);
+    assert(memcmp(copy, data, 2*BLOCK_SIZE + 10) == 0);
+
+    debug("Check failed move to a block keeps data inline");
+    ssize_t one    = fs_create(&fs);
+    ssize_t filler = fs_create(&fs);
+    char   *zeros  = calloc(fs.meta_data.blocks, BLOCK_SIZE);
+    assert(one >= 0 && filler >= 0 && zeros);
+    assert(fs_write(&fs, one, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(fs_write(&fs, filler, zeros, fs.meta_data.blocks * BLOCK_SIZE, 0) > 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == 0);
+    assert(fs_remove(&fs, one));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == 1);
+
+    b = fs_create(&fs);
+    assert(fs_write(&fs, b, data, 10, 0) == 10);
+    assert(fs_write(&fs, b, data, 100, 2*BLOCK_SIZE) <= 0);
+    assert(fs_stat(&fs, b) == 10);
+    assert(fs.inodes[b].size == 10 && memcmp(fs.inodes[b].inline_data, data, 10) == 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == 1);
+
+    debug("Check partial move to a block keeps the bytes written");
+    assert(fs_write(&fs, b, data + 10, 2*BLOCK_SIZE, 10) == BLOCK_SIZE - 10);
+    assert(fs_stat(&fs, b) == BLOCK_SIZE);
+    assert(fs_read(&fs, b, copy, sizeof(copy), 0) == BLOCK_SIZE);
+    assert(memcmp(copy, data, BLOCK_SIZE) == 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == 0);
+
+    free(zeros);
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_17_fs_format() {
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    Block      zero;
+    memset(zero.data, 0, BLOCK_SIZE);
+
+    debug("Check format only writes meta data blocks");
+    memset(block.data, 0xff, BLOCK_SIZE);
+    for (size_t b = 0; b < disk->blocks; b++) {
+        assert(disk_write(disk, b, block.data) == BLOCK_SIZE);
+    }
+    size_t writes = disk->writes;
+    assert(fs_format(&fs, disk));
+    assert(disk->writes - writes == 1 + 20 + 1 || disk->writes - writes == disk->blocks);
+
+    for (size_t b = 1; b < disk->blocks; b++) {
+        if (b == 21) {
+            continue;
+        }
+        assert(disk_read(disk, b, block.data) == BLOCK_SIZE);
+        assert(memcmp(block.data, zero.data, BLOCK_SIZE) == 0);
+    }
+
+    debug("Check format drops cached data blocks");
+    assert(disk_cache(disk, 16));
+    memset(block.data, 0xff, BLOCK_SIZE);
+    assert(disk_write(disk, 100, block.data) == BLOCK_SIZE);
+    assert(fs_format(&fs, disk));
+    assert(disk_read(disk, 100, block.data) == BLOCK_SIZE);
+    assert(memcmp(block.data, zero.data, BLOCK_SIZE) == 0);
+    assert(disk_cache(disk, 0));
+
+    debug("Check wipe writes every block");
+    memset(block.data, 0xff, BLOCK_SIZE);
+    assert(disk_write(disk, 150, block.data) == BLOCK_SIZE);
+    writes = disk->writes;
+    assert(fs_format_wipe(&fs, disk, FS_FEATURE_EXTENTS));
+    assert(disk->writes - writes == disk->blocks);
+    assert(disk_read(disk, 150, block.data) == BLOCK_SIZE);
+    assert(memcmp(block.data, zero.data, BLOCK_SIZE) == 0);
+
+    debug("Check file system works after format");
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.features == FS_FEATURE_EXTENTS);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == disk->blocks - 22);
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number == 0);
+    assert(fs_stat(&fs, inode_number) == 0);
+    assert(!fs_format(&fs, disk));
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_18_fs_stats() {
+    Disk *disk = disk_open("data/image.unit", 200);
+    assert(disk);
+
+    FileSystem fs = {0};
+    FsStats    stats;
+    char       data[2*BLOCK_SIZE];
+    char       copy[sizeof(data)];
+
+    memset(data, 'x', sizeof(data));
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    debug("Check operations are counted");
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+    assert(fs_write(&fs, inode_number, data, sizeof(data), 0) == sizeof(data));
+    assert(fs_read(&fs, inode_number, copy, sizeof(copy), 0) == sizeof(copy));
+    assert(fs_stat(&fs, inode_number) == sizeof(data));
+    assert(fs_stat(&fs, fs.meta_data.inodes) == -1);
+
+    fs_stats(&fs, &stats);
+    assert(stats.ops[FS_OP_CREATE].calls == 1);
+    assert(stats.ops[FS_OP_WRITE].calls  == 1);
+    assert(stats.ops[FS_OP_READ].calls   == 1);
+    assert(stats.ops[FS_OP_STAT].calls   == 2);
+    assert(stats.ops[FS_OP_STAT].failures == 1);
+    assert(stats.ops[FS_OP_REMOVE].calls == 0);
+    assert(stats.disk.reads == disk->reads && stats.disk.writes == disk->writes);
+    assert(strcmp(fs_stats_name(FS_OP_WRITE), "write") == 0);
+
+    debug("Check disk transfers are attributed to meta data and data");
+    OpStats *write = &stats.ops[FS_OP_WRITE];
+    OpStats *read  = &stats.ops[FS_OP_READ];
+    assert(write->writes[DISK_DATA] == 2 && write->writes[DISK_METADATA] == 1);
+    assert(read->reads[DISK_DATA] == 2 && read->reads[DISK_METADATA] == 0);
+    assert(stats.ops[FS_OP_CREATE].writes[DISK_METADATA] == 1);
+    assert(stats.ops[FS_OP_CREATE].writes[DISK_DATA] == 0);
+
+    debug("Check latency histogram");
+    size_t calls = 0;
+    for (size_t b = 0; b < STATS_BUCKETS; b++) {
+        calls += stats.ops[FS_OP_STAT].histogram[b];
+    }
+    assert(calls == 2);
+    assert(write->nsecs > 0 && write->max_nsecs == write->nsecs);
+    assert(fs_stats_percentile(write, 0.5) >= write->max_nsecs / 1e3);
+    assert(fs_stats_percentile(write, 0.5) <= 2 * write->max_nsecs / 1e3 + 1);
+    assert(fs_stats_percentile(&stats.ops[FS_OP_SYNC], 0.5) == 0.0);
+
+    debug("Check stats reset");
+    fs_stats_reset(&fs);
+    fs_stats(&fs, &stats);
+    for (FsOp op = 0; op < FS_OPS; op++) {
+        assert(stats.ops[op].calls == 0 && stats.ops[op].nsecs == 0);
+    }
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_19_fs_create_many() {
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+    size_t     inodes[300];
+
+    debug("Check unmounted");
+    assert(fs_create_many(&fs, inodes, 1) == -1);
+
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    debug("Check Inode blocks are written once");
+    size_t writes = disk->writes;
+    assert(fs_create_many(&fs, inodes, 0) == 0);
+    assert(disk->writes == writes);
+    assert(fs_create_many(&fs, inodes, 130) == 130);
+    assert(disk->writes - writes == 2);
+    for (size_t i = 0; i < 130; i++) {
+        assert(inodes[i] == i);
+        assert(fs_stat(&fs, i) == 0);
+    }
+
+    debug("Check lowest free Inodes are reused");
+    assert(fs_remove(&fs, 7));
+    assert(fs_remove(&fs, 3));
+    assert(fs_create_many(&fs, inodes, 3) == 3);
+    assert(inodes[0] == 3 && inodes[1] == 7 && inodes[2] == 130);
+
+    debug("Check full Inode table");
+    assert(fs_create_many(&fs, inodes, 300) == (ssize_t)fs.meta_data.inodes - 131);
+    assert(fs_create(&fs) == -1);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_20_fs_journal() {
+    Disk *disk = disk_open("data/image.unit", 20);
+    assert(disk);
+
+    FileSystem fs = {0};
+
+    debug("Check journal does not fit small disk");
+    assert(!fs_format_features(&fs, disk, FS_FEATURE_JOURNAL));
+    disk_close(disk);
+
+    disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+    assert(fs_format_features(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_JOURNAL));
+    assert(fs_mount(&fs, disk));
+    assert(fs.journal && fs.meta_data.journal_blocks == 125);
+
+    debug("Check meta data is staged until commit");
+    char   data[3*BLOCK_SIZE];
+    char   copy[sizeof(data)];
+    Block  block;
+    size_t writes = disk->writes;
+
+    for (size_t i = 0; i < 10; i++) {
+        memset(data, 'a' + i, sizeof(data));
+        assert(fs_create(&fs) == (ssize_t)i);
+        assert(fs_write(&fs, i, data, sizeof(data), 0) == sizeof(data));
+        assert(fs_read(&fs, i, copy, sizeof(copy), 0) == sizeof(copy));
+        assert(memcmp(copy, data, sizeof(data)) == 0);
+    }
+    assert(disk->writes - writes == 10 * 3);
+    assert(disk_read(disk, 1, block.data) != DISK_FAILURE);
+    assert(block.inodes[0].valid == 0);
+
+    debug("Check commit writes transaction once and its home blocks");
+    writes = disk->writes;
+    assert(fs_sync(&fs));
+    assert(disk->writes - writes == 3 + 2);
+    assert(disk_read(disk, 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks, block.data) != DISK_FAILURE);
+    assert(block.descriptor.magic == JOURNAL_MAGIC && block.descriptor.count == 2);
+    assert(block.descriptor.targets[0] == 1);
+    assert(disk_read(disk, 1, block.data) != DISK_FAILURE);
+    assert(block.inodes[9].valid == 1 && block.inodes[9].size == sizeof(data));
+
+    debug("Check released blocks are reused only after commit");
+    size_t free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    assert(fs_remove(&fs, 0));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+    assert(fs_sync(&fs));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks + 3);
+
+    debug("Check crash replays last commit");
+    assert(fs_remove(&fs, 1));
+    assert(fs_create(&fs) == 0);
+    memset(block.data, 0, BLOCK_SIZE);
+    assert(disk_write(disk, 1, block.data) != DISK_FAILURE);
+
+    Disk      *crashed = disk_open("data/image.unit", 2000);
+    FileSystem recovered = {0};
+    assert(crashed);
+    assert(fs_mount(&recovered, crashed));
+    assert(fs_stat(&recovered, 0) == -1);
+    for (size_t i = 1; i < 10; i++) {
+        memset(data, 'a' + i, sizeof(data));
+        assert(fs_read(&recovered, i, copy, sizeof(copy), 0) == sizeof(copy));
+        assert(memcmp(copy, data, sizeof(data)) == 0);
+    }
+    assert(bitmap_count(recovered.free_blocks, recovered.meta_data.blocks) == free_blocks + 3);
+    fs_unmount(&recovered);
+    disk_close(crashed);
+
+    debug("Check concurrent clients with write-back cache");
+    fs_unmount(&fs);
+    assert(disk_cache(disk, 32));
+    assert(fs_format_features(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_JOURNAL));
+    assert(fs_mount(&fs, disk));
+
+    free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    pthread_t threads[THREADS];
+    Client    clients[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        clients[t] = (Client){&fs, t};
+        assert(pthread_create(&threads[t], NULL, client, &clients[t]) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(threads[t], NULL) == 0);
+    }
+    assert(fs_sync(&fs));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - THREADS * ROUNDS / 2 * 8);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_21_fs_sparse() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    size_t     nblocks = 8;
+    char      *data    = calloc(nblocks, BLOCK_SIZE);
+    char      *copy    = malloc(nblocks * BLOCK_SIZE);
+    assert(data && copy);
+
+    memset(data + (nblocks - 1) * BLOCK_SIZE, 'S', BLOCK_SIZE);
+
+    assert(fs_format(&fs, disk));
+    assert(fs_mount(&fs, disk));
+
+    size_t  free_blocks  = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    ssize_t inode_number = fs_create(&fs);
+    assert(inode_number >= 0);
+
+    debug("Check write past end leaves a hole that reads as zeroes");
+    assert(fs_write(&fs, inode_number, data + (nblocks - 1) * BLOCK_SIZE, BLOCK_SIZE, 20 * BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs_stat(&fs, inode_number) == 21 * BLOCK_SIZE);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks - 2);
+
+    size_t reads = disk->reads;
+    memset(copy, 1, nblocks * BLOCK_SIZE);
+    assert(fs_read(&fs, inode_number, copy, 3 * BLOCK_SIZE + 10, 100) == 3 * BLOCK_SIZE + 10);
+    assert(disk->reads == reads);
+    for (size_t i = 0; i < 3 * BLOCK_SIZE + 10; i++) {
+        assert(copy[i] == 0);
+    }
+
+    debug("Check read across hole and data reads only allocated blocks");
+    reads = disk->reads;
+    assert(fs_read(&fs, inode_number, copy, 2 * BLOCK_SIZE, 19 * BLOCK_SIZE) == 2 * BLOCK_SIZE);
+    assert(disk->reads - reads == 2);
+    assert(memcmp(copy, data + (nblocks - 2) * BLOCK_SIZE, 2 * BLOCK_SIZE) == 0);
+
+    debug("Check zero write allocates blocks unless sparse");
+    ssize_t dense = fs_create(&fs);
+    assert(dense >= 0);
+    size_t before = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    assert(fs_write(&fs, dense, data, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == before - nblocks - 1);
+
+    fs_sparse(&fs, true);
+    ssize_t sparse = fs_create(&fs);
+    assert(sparse >= 0);
+    before = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    size_t writes = disk->writes;
+    assert(fs_write(&fs, sparse, data, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(fs_stat(&fs, sparse) == nblocks * BLOCK_SIZE);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == before - 2);
+    assert(fs.inodes[sparse].direct[0] == 0);
+    assert(disk->writes - writes == 3);
+
+    assert(fs_read(&fs, sparse, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+
+    debug("Check partial nonzero write fills a hole");
+    assert(fs_write(&fs, sparse, "hole", 4, BLOCK_SIZE + 5) == 4);
+    assert(fs.inodes[sparse].direct[1] != 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == before - 3);
+    assert(fs_read(&fs, sparse, copy, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(copy + 5, "hole", 4) == 0);
+    assert(copy[4] == 0 && copy[9] == 0);
+
+    debug("Check zero write over allocated block keeps it");
+    assert(fs_write(&fs, sparse, data, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(fs.inodes[sparse].direct[1] != 0);
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == before - 3);
+    assert(fs_read(&fs, sparse, copy, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(copy, data, BLOCK_SIZE) == 0);
+
+    debug("Check holes survive remount");
+    fs_unmount(&fs);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, sparse, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+    assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+
+    debug("Check remove releases only allocated blocks");
+    assert(fs_remove(&fs, inode_number));
+    assert(fs_remove(&fs, dense));
+    assert(fs_remove(&fs, sparse));
+    assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+
+    fs_unmount(&fs);
+    disk_close(disk);
+    free(data);
+    free(copy);
+    return EXIT_SUCCESS;
+}
+
+int test_22_fs_defrag() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    uint32_t features[] = {0, FS_FEATURE_EXTENTS, FS_FEATURE_JOURNAL};
+    size_t   nblocks    = 20;
+    char    *data       = malloc(2 * nblocks * BLOCK_SIZE);
+    char    *copy       = malloc(nblocks * BLOCK_SIZE);
+    assert(data && copy);
+
+    for (size_t i = 0; i < 2 * nblocks * BLOCK_SIZE; i++) {
+        data[i] = (i / BLOCK_SIZE) * 7 + i % 251;
+    }
+
+    for (size_t f = 0; f < sizeof(features) / sizeof(features[0]); f++) {
+        FileSystem fs = {0};
+        assert(fs_format_features(&fs, disk, features[f]));
+        assert(fs_mount(&fs, disk));
+
+        size_t  free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+        ssize_t a = fs_create(&fs);
+        ssize_t b = fs_create(&fs);
+        assert(a >= 0 && b >= 0);
+
+        debug("Check interleaved writes fragment both files");
+        for (size_t i = 0; i < nblocks; i++) {
+            assert(fs_write(&fs, a, data + i * BLOCK_SIZE, BLOCK_SIZE, i * BLOCK_SIZE) == BLOCK_SIZE);
+            assert(fs_write(&fs, b, data + (nblocks + i) * BLOCK_SIZE, BLOCK_SIZE, i * BLOCK_SIZE) == BLOCK_SIZE);
+        }
+        assert(fs_fragments(&fs, a) > 1);
+        assert(fs_fragments(&fs, b) > 1);
+        assert(fs_fragments(&fs, 1000) == -1);
+
+        debug("Check fs_defrag moves file into one extent");
+        size_t used = free_blocks - bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+        assert(fs_defrag(&fs, a) == (ssize_t)nblocks);
+        assert(fs_fragments(&fs, a) == 1);
+        assert(fs_defrag(&fs, a) == 0);
+        if (features[f] & FS_FEATURE_EXTENTS) {
+            assert(fs.inodes[a].nextents == 1);
+        }
+
+        assert(fs_read(&fs, a, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+        assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+        assert(fs_read(&fs, b, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+        assert(memcmp(copy, data + nblocks * BLOCK_SIZE, nblocks * BLOCK_SIZE) == 0);
+
+        debug("Check fs_defrag writes back an open file first");
+        assert(fs_open(&fs, b));
+        assert(fs_write(&fs, b, data, BLOCK_SIZE, nblocks * BLOCK_SIZE) == BLOCK_SIZE);
+        assert(fs_defrag(&fs, b) == (ssize_t)nblocks + 1);
+        assert(fs_fragments(&fs, b) == 1);
+        assert(fs_close(&fs, b));
+
+        debug("Check defragmented files survive remount");
+        fs_unmount(&fs);
+        assert(fs_mount(&fs, disk));
+        assert(free_blocks - bitmap_count(fs.free_blocks, fs.meta_data.blocks) == used + 1);
+        assert(fs_fragments(&fs, a) == 1);
+        assert(fs_fragments(&fs, b) == 1);
+
+        assert(fs_read(&fs, a, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+        assert(memcmp(copy, data, nblocks * BLOCK_SIZE) == 0);
+        assert(fs_read(&fs, b, copy, nblocks * BLOCK_SIZE, 0) == nblocks * BLOCK_SIZE);
+        assert(memcmp(copy, data + nblocks * BLOCK_SIZE, nblocks * BLOCK_SIZE) == 0);
+        assert(fs_read(&fs, b, copy, BLOCK_SIZE, nblocks * BLOCK_SIZE) == BLOCK_SIZE);
+        assert(memcmp(copy, data, BLOCK_SIZE) == 0);
+
+        assert(fs_remove(&fs, a));
+        assert(fs_remove(&fs, b));
+        fs_unmount(&fs);
+        assert(fs_mount(&fs, disk));
+        assert(bitmap_count(fs.free_blocks, fs.meta_data.blocks) == free_blocks);
+        fs_unmount(&fs);
+    }
+
+    disk_close(disk);
+    free(data);
+    free(copy);
+    return EXIT_SUCCESS;
+}
+
+int test_23_fs_density() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+
+    debug("Check fs_format stores the default ratio");
+    assert(fs_format(&fs, disk));
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    assert(block.super.inode_ratio == INODE_RATIO);
+    assert(block.super.inode_blocks == 200);
+
+    debug("Check sparse inode table sizes inodes and mount scan");
+    assert(!fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT, 0, false));
+    assert(fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT, 1000, false));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inode_blocks == 2);
+    assert(fs.meta_data.inodes == 2 * INODES_PER_BLOCK);
+    assert(fs.meta_data.inode_ratio == 1000);
+
+    size_t inodes[2 * INODES_PER_BLOCK];
+    assert(fs_create_many(&fs, inodes, 2 * INODES_PER_BLOCK) == 2 * INODES_PER_BLOCK);
+    assert(fs_create(&fs) == -1);
+    size_t free_blocks = bitmap_count(fs.free_blocks, fs.meta_data.blocks);
+    assert(free_blocks == disk->blocks - 1 - 2 - fs.meta_data.bitmap_blocks);
+
+    assert(fs_write(&fs, inodes[0], block.data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    size_t reads = disk->reads;
+    assert(fs_mount(&fs, disk));
+    assert(disk->reads - reads <= 1 + 2 + fs.meta_data.bitmap_blocks);
+    assert(fs_stat(&fs, inodes[0]) == BLOCK_SIZE);
+    fs_unmount(&fs);
+
+    debug("Check dense inode table");
+    assert(fs_format_density(&fs, disk, FS_FEATURE_EXTENTS | FS_FEATURE_JOURNAL, 3, true));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inode_blocks == 667);
+    assert(fs.meta_data.inodes == 667 * INODES_PER_BLOCK);
+    fs_unmount(&fs);
+
+    assert(!fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT, 1, false));
+
+    debug("Check fs_mount validates inode blocks against stored ratio");
+    assert(fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT, 1000, false));
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+
+    block.super.inode_ratio = 500;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(!fs_mount(&fs, disk));
+
+    debug("Check images without a stored ratio use the default");
+    block.super.inode_ratio = 0;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(!fs_mount(&fs, disk));
+
+    assert(fs_format(&fs, disk));
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.inode_ratio = 0;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.inode_blocks == 200);
+    fs_unmount(&fs);
+
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_24_fs_checksums() {
+    Disk *disk = disk_open("data/image.unit", 2000);
+    assert(disk);
+
+    FileSystem fs = {0};
+    Block      block;
+    size_t     length = (POINTERS_PER_INODE + 2) * BLOCK_SIZE;
+    char      *data   = malloc(length);
+    char      *copy   = malloc(length);
+    char       bad[BLOCK_SIZE];
+    ssize_t    inode_number;
+    uint32_t   indirect, direct;
+
+    assert(data && copy);
+    for (size_t i = 0; i < length; i++) {
+        data[i] = i % 241;
+    }
+    memset(bad, 0xee, BLOCK_SIZE);
+
+    debug("Check fs_format reserves checksum blocks after the journal");
+    assert(fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_JOURNAL | FS_FEATURE_CHECKSUMS, INODE_RATIO, false));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.checksum_blocks == 2);
+    assert(fs.checksums && disk->sums == fs.checksums);
+    assert(!bitmap_get(fs.free_blocks, 1 + fs.meta_data.inode_blocks + fs.meta_data.bitmap_blocks + fs.meta_data.journal_blocks + 1));
+
+    assert((inode_number = fs_create(&fs)) >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    indirect = fs.inodes[inode_number].indirect;
+    direct   = fs.inodes[inode_number].direct[0];
+    fs_unmount(&fs);
+    assert(disk->sums == NULL && fs.checksums == NULL);
+
+    debug("Check stored checksums verify after remount");
+    size_t corrupt = disk->corrupt;
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, copy, length, 0) == (ssize_t)length);
+    assert(memcmp(data, copy, length) == 0);
+    assert(disk->corrupt == corrupt);
+    fs_unmount(&fs);
+
+    debug("Check corrupt indirect block fails to read");
+    assert(disk_write(disk, indirect, bad) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, copy, length, 0) < (ssize_t)length);
+    assert(disk->corrupt > corrupt);
+    fs_unmount(&fs);
+
+    debug("Check metadata only checksums do not cover data");
+    assert(fs_format_density(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_CHECKSUMS, INODE_RATIO, false));
+    assert(fs_mount(&fs, disk));
+    assert((inode_number = fs_create(&fs)) >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    direct = fs.inodes[inode_number].direct[0];
+    fs_unmount(&fs);
+
+    assert(disk_write(disk, direct, bad) == BLOCK_SIZE);
+    corrupt = disk->corrupt;
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, copy, length, 0) == (ssize_t)length);
+    assert(memcmp(copy, bad, BLOCK_SIZE) == 0);
+    assert(disk->corrupt == corrupt);
+    fs_unmount(&fs);
+
+    debug("Check data checksums detect corrupt data block");
+    assert(fs_format_density(&fs, disk, FS_FEATURE_EXTENTS | FS_FEATURE_DATA_SUMS, INODE_RATIO, false));
+    assert(fs_mount(&fs, disk));
+    assert(fs.meta_data.features & FS_FEATURE_CHECKSUMS);
+    assert((inode_number = fs_create(&fs)) >= 0);
+    assert(fs_write(&fs, inode_number, data, length, 0) == (ssize_t)length);
+    direct = fs.inodes[inode_number].extents[0].start;
     fs_unmount(&fs);
+
+    assert(disk_write(disk, direct, bad) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, copy, length, 0) < (ssize_t)length);
+    assert(disk->corrupt > corrupt);
+    fs_unmount(&fs);
+
+    debug("Check fs_mount validates checksum layout");
+    assert(disk_read(disk, 0, block.data) == BLOCK_SIZE);
+    block.super.checksum_blocks = 1;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(!fs_mount(&fs, disk));
+    assert(disk->sums == NULL);
+
+    block.super.checksum_blocks = 2;
+    block.super.features &= ~FS_FEATURE_CHECKSUMS;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(!fs_mount(&fs, disk));
+
+    debug("Check fs_mount without clean unmount trusts no old checksums");
+    block.super.features |= FS_FEATURE_CHECKSUMS;
+    block.super.clean = false;
+    assert(disk_write(disk, 0, block.data) == BLOCK_SIZE);
+    assert(fs_mount(&fs, disk));
+    assert(fs_read(&fs, inode_number, copy, length, 0) == (ssize_t)length);
+    assert(memcmp(copy, bad, BLOCK_SIZE) == 0);
+    fs_unmount(&fs);
+
+    free(data);
+    free(copy);
+    disk_close(disk);
+    return EXIT_SUCCESS;
+}
+
+int test_25_fs_journal_open() {
+    Disk *disk = disk_open("data/image.unit", 8192);
+    assert(disk);
+
+    FileSystem fs = {0};
+    assert(fs_format_features(&fs, disk, FS_FEATURE_DINDIRECT | FS_FEATURE_JOURNAL));
+    assert(fs_mount(&fs, disk));
+
+    size_t files = 400;
+    assert(fs.meta_data.journal_blocks / 2 < files);
+    char   data[6*BLOCK_SIZE];
+    char   copy[sizeof(data)];
+
+    debug("Check dirty open files past journal capacity still commit");
+    for (size_t i = 0; i < files; i++) {
+        memset(data, 'a' + i % 26, sizeof(data));
+        assert(fs_create(&fs) == (ssize_t)i);
+        assert(fs_open(&fs, i));
+        assert(fs_write(&fs, i, data, sizeof(data), 0) == sizeof(data));
+    }
+    assert(fs_sync(&fs));
+    assert(fs_create(&fs) == (ssize_t)files);
+
+    debug("Check writes that dirty open files commit at the threshold");
+    for (size_t i = 0; i < files; i++) {
+        assert(fs_write(&fs, i, data, BLOCK_SIZE, 8 * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(fs_create(&fs) == (ssize_t)files + 1);
+    assert(fs_sync(&fs));
+
+    debug("Check removed and closed files release their reservations");
+    for (size_t i = 0; i < files; i += 2) {
+        memset(data, 'z', sizeof(data));
+        assert(fs_write(&fs, i, data, sizeof(data), sizeof(data)) == sizeof(data));
+        assert(fs_remove(&fs, i));
+    }
+    for (size_t i = 0; i < files; i++) {
+        assert(fs_close(&fs, i));
+    }
+    assert(fs_sync(&fs));
+    assert(fs_create(&fs) == 0);
+    fs_unmount(&fs);
+
+    debug("Check committed files after remount");
+    assert(fs_mount(&fs, disk));
+    for (size_t i = 1; i < files; i += 2) {
+        memset(data, 'a' + i % 26, sizeof(data));
+        assert(fs_read(&fs, i, copy, sizeof(copy), 0) == sizeof(copy));
+        assert(memcmp(copy, data, sizeof(data)) == 0);
+    }
+    fs_unmount(&fs);
+
     disk_close(disk);
     return EXIT_SUCCESS;
 }
@@ -174,6 +1747,28 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test fs_create\n");
         fprintf(stderr, "    2. Test fs_remove\n");
         fprintf(stderr, "    3. Test fs_stat\n");
+        fprintf(stderr, "    4. Test fs_write\n");
+        fprintf(stderr, "    5. Test fs_read\n");
+        fprintf(stderr, "    6. Test fs_open\n");
+        fprintf(stderr, "    7. Test fs_read readahead\n");
+        fprintf(stderr, "    8. Test concurrent clients\n");
+        fprintf(stderr, "    9. Test fs_mount workers\n");
+        fprintf(stderr, "    10. Test on-disk free block bitmap\n");
+        fprintf(stderr, "    11. Test free inodes bitmap\n");
+        fprintf(stderr, "    12. Test fs_remove_many\n");
+        fprintf(stderr, "    13. Test delayed allocation\n");
+        fprintf(stderr, "    14. Test double indirect blocks\n");
+        fprintf(stderr, "    15. Test extent inodes\n");
+        fprintf(stderr, "    16. Test inline data\n");
+        fprintf(stderr, "    17. Test fs_format\n");
+        fprintf(stderr, "    18. Test fs_stats\n");
+        fprintf(stderr, "    19. Test fs_create_many\n");
+        fprintf(stderr, "    20. Test metadata journal\n");
+        fprintf(stderr, "    21. Test sparse files\n");
+        fprintf(stderr, "    22. Test fs_defrag\n");
+        fprintf(stderr, "    23. Test inode density\n");
+        fprintf(stderr, "    24. Test block checksums\n");
+        fprintf(stderr, "    25. Test journal with many dirty open files\n");
         return EXIT_FAILURE;
     }
 
@@ -187,6 +1782,28 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_fs_create(); break;
         case 2:  status = test_02_fs_remove(); break;
         case 3:  status = test_03_fs_stat(); break;
+        case 4:  status = test_04_fs_write(); break;
+        case 5:  status = test_05_fs_read(); break;
+        case 6:  status = test_06_fs_open(); break;
+        case 7:  status = test_07_fs_readahead(); break;
+        case 8:  status = test_08_fs_threads(); break;
+        case 9:  status = test_09_fs_mount_workers(); break;
+        case 10: status = test_10_fs_bitmap_persist(); break;
+        case 11: status = test_11_fs_free_inodes(); break;
+        case 12: status = test_12_fs_remove_many(); break;
+        case 13: status = test_13_fs_delalloc(); break;
+        case 14: status = test_14_fs_dindirect(); break;
+        case 15: status = test_15_fs_extents(); break;
+        case 16: status = test_16_fs_inline(); break;
+        case 17: status = test_17_fs_format(); break;
+        case 18: status = test_18_fs_stats(); break;
+        case 19: status = test_19_fs_create_many(); break;
+        case 20: status = test_20_fs_journal(); break;
+        case 21: status = test_21_fs_sparse(); break;
+        case 22: status = test_22_fs_defrag(); break;
+        case 23: status = test_23_fs_density(); break;
+        case 24: status = test_24_fs_checksums(); break;
+        case 25: status = test_25_fs_journal_open(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }
 